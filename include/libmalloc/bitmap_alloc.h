@@ -4,6 +4,23 @@
 #include "memmap.h"
 #include "common.h"
 
+/**
+ * @brief Implementations of the routine used to scan the bitmap for words
+ * containing available blocks.
+ * 
+ * The SIMD variants test 2, 4 or 8 words per instruction. They are only
+ * compiled into hosted builds for x86-64; freestanding builds always use the
+ * scalar implementation.
+ */
+typedef enum
+{
+    BITMAP_SCAN_AUTO = 0,
+    BITMAP_SCAN_SCALAR = 1,
+    BITMAP_SCAN_SSE2 = 2,
+    BITMAP_SCAN_AVX2 = 3,
+    BITMAP_SCAN_AVX512 = 4
+} bitmap_scan_t;
+
 /**
  * @brief 
  * 
@@ -17,9 +34,56 @@ typedef struct bitmap_heap_descriptor_t
      */
     unsigned long *bitmap;
 
+    /**
+     * @brief Hierarchical index over `bitmap`, used to find available blocks
+     * without scanning whole levels of the tree.
+     *
+     * The first level holds one bit per word of `bitmap`, which is set if that
+     * word contains any available block. Each following level holds one bit
+     * per word of the level before it, up to a level which fits in a single
+     * word. The index is stored immediately after the bitmap and this field
+     * is set by `initialize_heap`.
+     *
+     */
+    unsigned long *summary;
+
+    /**
+     * @brief Optional table holding one byte for each block at the lowest
+     * level of the tree, used to find the reservation containing a location
+     * in constant time.
+     * 
+     * Each entry holds one more than the height of the reserved block which
+     * covers that block of memory, or 0 if it is not reserved. If this field
+     * is NULL, such lookups search upward through the tree instead. The table
+     * must be at least as large as reported by `owner_table_size`.
+     * 
+     */
+    unsigned char *owners;
+
+    /**
+     * @brief Optional array holding the state bits of each block other than
+     * its availability.
+     * 
+     * If this field is not NULL, `bitmap` holds only the availability of each
+     * block, one bit per block, so that searching for an available block reads
+     * `block_bits` times less memory. This array holds `block_bits` bits per
+     * block, laid out as `bitmap` would be otherwise, with the availability
+     * bit of each block left clear. It must be at least as large as reported
+     * by `metadata_size`, and `bitmap` must be sized with a `block_bits` of 1.
+     * `read_bit` and `write_bit` behave the same with either layout.
+     * 
+     */
+    unsigned long *metadata;
+
     /**
      * @brief Stores a list of available blocks of memory to speed up allocation.
      * 
+     * The array is divided into one stack per level of the tree, starting
+     * with the highest level that spans a whole word of `bitmap`. Each stack
+     * occupies `cache_depth + 1` elements: a count followed by up to
+     * `cache_depth` block indices. Levels which do not fit in the array are
+     * not cached.
+     * 
      */
     unsigned long *cache;
 
@@ -35,6 +99,28 @@ typedef struct bitmap_heap_descriptor_t
      */
     unsigned long cache_capacity;
 
+    /**
+     * @brief The number of block indices held by the cache for each level of
+     * the tree. A value of 0 is treated as 1.
+     * 
+     */
+    unsigned long cache_depth;
+
+    /**
+     * @brief The number of lookups which were satisfied by the cache since the
+     * heap was initialized.
+     * 
+     */
+    unsigned long cache_hits;
+
+    /**
+     * @brief The number of lookups which found no usable entry in the cache
+     * since the heap was initialized. Lookups at levels which do not fit in
+     * the cache are not counted.
+     * 
+     */
+    unsigned long cache_misses;
+
     /**
      * @brief The size in bytes of the smallest unit of allocation.
      *
@@ -63,7 +149,8 @@ typedef struct bitmap_heap_descriptor_t
     /**
      * @brief Bitmask used to isolate only those bits which indicate the
      * availability of a block. Useful when several bits are used to represent
-     * the state of a single block. See `block_bits`.
+     * the state of a single block. See `block_bits`. Every bit is set if the
+     * heap keeps its `metadata` separately.
      * 
      */
     unsigned long mask;
@@ -85,7 +172,8 @@ typedef struct bitmap_heap_descriptor_t
 
     /**
      * @brief The number of blocks described by a single unsigned long contained
-     * in `bitmap`. Equal to (8 * sizeof(unsigned long)) / block_bits.
+     * in `bitmap`. Equal to (8 * sizeof(unsigned long)) / block_bits, or to
+     * 8 * sizeof(unsigned long) if the heap keeps its `metadata` separately.
      * 
      */
     unsigned long blocks_in_word;
@@ -96,11 +184,174 @@ typedef struct bitmap_heap_descriptor_t
      */
     unsigned long offset;
 
+    /**
+     * @brief The implementation used to scan the bitmap a word at a time.
+     * 
+     * `initialize_heap` replaces this with the widest variant, no wider than
+     * the one requested, that the CPU supports. BITMAP_SCAN_AUTO requests the
+     * widest available.
+     */
+    bitmap_scan_t scan;
+
+    /**
+     * @brief If nonzero, `reserve_region` and `free_region` may be called
+     * from several threads at once without external locking.
+     * 
+     * Blocks are claimed and merged with compare-and-swap operations on the
+     * bitmap. The cache is not used, and the batch functions reserve and free
+     * one region at a time. `block_bits` must be no more than half the number
+     * of bits in an unsigned long. All other functions still require
+     * exclusive access to the heap.
+     */
+    int concurrent;
+
+    /**
+     * @brief If nonzero, the heap is built in sections of this many bytes,
+     * rounded up to a power of two times `block_size`, rather than all at
+     * once.
+     * 
+     * `initialize_heap` builds only the first section. Each following
+     * section is built, in order of address, when an allocation cannot be
+     * satisfied from those built so far, or by calling `initialize_section`.
+     * Blocks in sections not yet built are not counted in `free_block_count`.
+     * In concurrent mode, sections are only built by `initialize_section`.
+     */
+    unsigned long section_size;
+
+    /**
+     * @brief The number of sections which have been built. Set by
+     * `initialize_heap`.
+     * 
+     */
+    unsigned long next_section;
+
+    /**
+     * @brief The memory map the heap was initialized from, which is read
+     * again as each section is built. It must remain valid until every
+     * section has been built.
+     * 
+     */
+    const memory_map_t *section_map;
+
+    /**
+     * @brief Optional directory of the sections which make up a sparse heap.
+     * 
+     * If this field is not NULL, the tree covers only those sections of
+     * `section_size` bytes which contain available memory, placed one after
+     * another, so holes in the memory map cost neither bitmap space nor scan
+     * time. Each entry holds the location of a section relative to `offset`,
+     * in ascending order. Regions larger than a section cannot be reserved
+     * from a sparse heap. The directory is filled in by `initialize_heap`.
+     * 
+     */
+    unsigned long *directory;
+
+    /**
+     * @brief The number of elements in the array pointed to by `directory`.
+     * 
+     */
+    unsigned long directory_capacity;
+
+    /**
+     * @brief The number of sections in the directory. Set by
+     * `initialize_heap`.
+     * 
+     */
+    unsigned long directory_size;
+
     /**
      * @brief Function pointer which, if not null, will be called whenever
      * a region on the heap is allocated for the first time.
      */
-    int (*mmap)(void *location, unsigned long size)
+    int (*mmap)(void *location, unsigned long size);
+
+    /**
+     * @brief Function pointer which, if not null, will be called to give back
+     * the memory of free blocks mapped by `mmap`. Requires `mmap`, a
+     * `block_bits` of at least 3 and a heap which is not `concurrent`.
+     * 
+     * Once `dirty_block_count` reaches `unmap_high`, `free_region` unmaps each
+     * freed block which merges into a block of at least `unmap_height`, until
+     * `dirty_block_count` falls to `unmap_low` or below. Blocks freed and
+     * reserved again between the two marks keep their mapping.
+     */
+    int (*unmap)(void *location, unsigned long size);
+
+    /**
+     * @brief The smallest height of a free block which may be unmapped.
+     * 
+     */
+    unsigned long unmap_height;
+
+    /**
+     * @brief The number of mapped free blocks at which unmapping starts.
+     * 
+     */
+    unsigned long unmap_high;
+
+    /**
+     * @brief The number of mapped free blocks at which unmapping stops.
+     * 
+     */
+    unsigned long unmap_low;
+
+    /**
+     * @brief The number of free blocks which are still mapped. Kept only if
+     * `unmap` is set.
+     * 
+     */
+    unsigned long dirty_block_count;
+
+    /**
+     * @brief Nonzero while blocks are being unmapped as they are freed. Set by
+     * `free_region`.
+     * 
+     */
+    int unmapping;
+
+    /**
+     * @brief Optional array holding the number of free blocks in each aligned
+     * group of `pack_size` bytes covered by the tree, used to keep whole
+     * groups free so that they can be backed by huge pages.
+     * 
+     * If this field is not NULL, `reserve_region` takes blocks smaller than a
+     * group from the group it last took one from while that group has room,
+     * and otherwise from the partly used group with the fewest free blocks,
+     * rather than taking the lowest-addressed free block. A group which is
+     * wholly free is split only when no partly used group has room. The
+     * counts are followed by lists of the groups with each count, so that
+     * the fullest group with room is found without a pass over the counts.
+     * The array must be at least as large as reported by `pack_table_size`.
+     * Packing requires a heap which is not `concurrent`, and the batch
+     * functions reserve and free one region at a time.
+     */
+    unsigned long *pack_counts;
+
+    /**
+     * @brief The size of the groups kept by `pack_counts`, such as 2 MiB or
+     * 1 GiB, rounded up to a power of two times `block_size`.
+     * 
+     */
+    unsigned long pack_size;
+
+    /**
+     * @brief One more than the number of the group reservations are being
+     * packed into, or 0 if there is none yet. Set by `reserve_region`.
+     * 
+     */
+    unsigned long pack_group;
+
+    /**
+     * @brief If nonzero, the number of page colors, used by
+     * `reserve_region_colored`. A power of two.
+     * 
+     * Blocks whose locations, divided by `block_size`, are equal modulo
+     * `colors` map to the same sets of a physically indexed cache, such as
+     * the size of one way of the cache divided by `block_size`. A sparse heap
+     * must have sections of at least `colors` blocks, and the heap must not be
+     * `concurrent`.
+     */
+    unsigned long colors;
 
 } bitmap_heap_descriptor_t;
 
@@ -131,6 +382,30 @@ unsigned long read_bit(bitmap_heap_descriptor_t *heap, unsigned long location,
 int write_bit(bitmap_heap_descriptor_t *heap, unsigned long location,
     unsigned long bit, int value);
 
+/**
+ * @brief Counts the regions overlapping the `size` bytes at `location` which
+ * have the given bit set in their metadata.
+ * 
+ * Each region previously returned by `reserve_region` is counted once, no
+ * matter how much of it lies within the range. With an owner table, each
+ * region is found with a single lookup.
+ * 
+ * @returns the number of regions with `bit` set, or 0 if `bit` is not less
+ * than the `block_bits` field in `heap`.
+ */
+unsigned long read_bit_range(bitmap_heap_descriptor_t *heap,
+    unsigned long location, unsigned long size, unsigned long bit);
+
+/**
+ * @brief Writes to the given bit in the metadata of every region overlapping
+ * the `size` bytes at `location`.
+ * 
+ * @returns the number of regions written to, or 0 if `bit` is not less than
+ * the `block_bits` field in `heap`.
+ */
+unsigned long write_bit_range(bitmap_heap_descriptor_t *heap,
+    unsigned long location, unsigned long size, unsigned long bit, int value);
+
 /**
  * @brief Reserves a region of memory within the heap containing at least `size`
  * bytes.
@@ -145,6 +420,93 @@ int write_bit(bitmap_heap_descriptor_t *heap, unsigned long location,
 unsigned long reserve_region(bitmap_heap_descriptor_t *heap, 
     unsigned long size);
 
+/**
+ * @brief Reserves a region of memory as `reserve_region` does, but only from
+ * within the addresses [`min_addr`, `max_addr`), as for a device which can
+ * only address part of memory.
+ * 
+ * Only the parts of the tree covering the window are searched. At each level,
+ * the blocks lying wholly within the window are found with the summary index,
+ * and larger available blocks straddling its ends are split so as to leave a
+ * block inside it.
+ * 
+ * @param heap 
+ * @param size 
+ * @param min_addr The lowest location the region may start at
+ * @param max_addr The location the region must end at or below
+ * @return unsigned long The location of the region, or NOMEM if no region of
+ * `size` bytes is available within the window.
+ */
+unsigned long reserve_region_in_range(bitmap_heap_descriptor_t *heap,
+    unsigned long size, unsigned long min_addr, unsigned long max_addr);
+
+/**
+ * @brief Reserves a region of memory as `reserve_region` does, preferring one
+ * of the page color `*color`, so that the regions a caller holds are spread
+ * evenly across the sets of the cache. See the `colors` field of
+ * `bitmap_heap_descriptor_t`.
+ * 
+ * The color of a region is its location divided by `block_size`, modulo
+ * `colors`. A block of the color is taken, or a larger block is split so as
+ * to leave one, with the tree searched a bitmap word at a time through masks
+ * selecting the blocks of the color. Further sections are built one at a
+ * time to find one. If there is none, any free block is taken. `*color` is
+ * then advanced past the colors the region covers, so a caller which keeps
+ * its own `*color` across calls rotates through the colors. Regions covering
+ * every color, and heaps without `colors`, are reserved as by
+ * `reserve_region`.
+ * 
+ * @param heap 
+ * @param size 
+ * @param color The color wanted, which is advanced past the region reserved
+ * @return unsigned long The location of the region, or NOMEM if no region of
+ * `size` bytes is available.
+ */
+unsigned long reserve_region_colored(bitmap_heap_descriptor_t *heap,
+    unsigned long size, unsigned long *color);
+
+/**
+ * @brief Reserves up to `count` regions of memory, each containing at least
+ * `size` bytes, and writes their locations to `out`.
+ * 
+ * The result is the same as calling `reserve_region` `count` times, except
+ * that the regions need not be the ones `reserve_region` would have chosen.
+ * Free blocks of the right size are taken a whole bitmap word at a time, and
+ * when none are left a larger block is reserved in one step and handed out
+ * as all of its descendants. The regions may be freed individually.
+ * 
+ * @param heap 
+ * @param size 
+ * @param count The number of regions to reserve
+ * @param out An array of at least `count` elements
+ * @return unsigned long The number of regions reserved, which is less than
+ * `count` if the heap ran out of memory or `mmap` failed.
+ */
+unsigned long reserve_region_batch(bitmap_heap_descriptor_t *heap,
+    unsigned long size, unsigned long count, unsigned long *out);
+
+/**
+ * @brief Reserves `blocks` blocks of memory which need not be contiguous, as
+ * a list of up to `max_extents` regions.
+ * 
+ * The largest free block no bigger than what remains to be reserved is taken
+ * each time, so the request is met with as few regions as the heap allows.
+ * Each region is a single block, with its location written to `locations`
+ * and its size to `sizes`, and may be freed with `free_region`, or all of
+ * them at once with `free_region_batch`.
+ * 
+ * @param heap 
+ * @param blocks The number of blocks to reserve
+ * @param locations An array of at least `max_extents` elements
+ * @param sizes An array of at least `max_extents` elements
+ * @param max_extents The largest number of regions to reserve
+ * @return unsigned long The number of regions reserved, or 0 if `blocks`
+ * blocks could not be reserved in `max_extents` regions, in which case
+ * nothing is reserved.
+ */
+unsigned long reserve_extents(bitmap_heap_descriptor_t *heap, unsigned long blocks,
+    unsigned long *locations, unsigned long *sizes, unsigned long max_extents);
+
 /**
  * @brief Marks the region of memory indicated by `location` and `size` as
  * available to be allocated.
@@ -159,9 +521,29 @@ unsigned long reserve_region(bitmap_heap_descriptor_t *heap,
 void free_region(bitmap_heap_descriptor_t *heap, unsigned long location, 
     unsigned long size);
 
+/**
+ * @brief Marks each of the `count` regions of memory indicated by `locations`
+ * and `sizes` as available to be allocated.
+ * 
+ * The resulting state of the heap is the same as after calling `free_region`
+ * on each region in turn, but the regions are grouped by bitmap word and
+ * buddies are merged a level at a time, so each word is written once per
+ * level rather than once per region. Heaps with an `unmap` callback free the
+ * regions one at a time.
+ * 
+ * @param heap 
+ * @param locations The regions to free. This array is used as scratch space,
+ * and its contents are undefined after the call returns.
+ * @param sizes The size of each region, as for `free_region`. May be NULL if
+ * `block_bits` is at least 2, in which case the sizes are read from the heap.
+ * @param count The number of regions to free
+ */
+void free_region_batch(bitmap_heap_descriptor_t *heap, unsigned long *locations,
+    const unsigned long *sizes, unsigned long count);
+
 /**
  * @brief Computes the amount of space required to store the heap's internal
- * bitmaps.
+ * bitmaps, including the summary index which follows the bitmap itself.
  * 
  * @param map A pointer to the structure providing an initial memory layout
  * @param block_size The minimum unit of allocation
@@ -169,6 +551,97 @@ void free_region(bitmap_heap_descriptor_t *heap, unsigned long location,
  */
 unsigned long bitmap_size(const memory_map_t *map, unsigned long block_size, unsigned long block_bits);
 
+/**
+ * @brief Computes the size in bytes of the owner table for a heap built from
+ * `map`. See the `owners` field of `bitmap_heap_descriptor_t`.
+ * 
+ * @param map A pointer to the structure providing an initial memory layout
+ * @param block_size The minimum unit of allocation
+ * @return unsigned long 
+ */
+unsigned long owner_table_size(const memory_map_t *map, unsigned long block_size);
+
+/**
+ * @brief Computes the size in bytes of the array holding the state bits other
+ * than availability, for a heap which keeps them apart from its bitmap. See
+ * the `metadata` field of `bitmap_heap_descriptor_t`.
+ * 
+ * @param map A pointer to the structure providing an initial memory layout
+ * @param block_size The minimum unit of allocation
+ * @param block_bits The number of bits used to store each block's state
+ * @return unsigned long 
+ */
+unsigned long metadata_size(const memory_map_t *map, unsigned long block_size,
+    unsigned long block_bits);
+
+/**
+ * @brief Computes the number of sections of `section_size` bytes in `map` which
+ * contain available memory, and so the number of elements required by the
+ * directory of a sparse heap. See the `directory` field of
+ * `bitmap_heap_descriptor_t`.
+ * 
+ * @param map A pointer to the structure providing an initial memory layout
+ * @param block_size The minimum unit of allocation
+ * @param section_size The size of each section
+ * @return unsigned long 
+ */
+unsigned long sparse_section_count(const memory_map_t *map,
+    unsigned long block_size, unsigned long section_size);
+
+/**
+ * @brief Computes the amount of space required to store the internal bitmaps
+ * of a sparse heap with sections of `section_size` bytes. If `section_size` is
+ * 0, the result is the same as `bitmap_size`.
+ * 
+ * @param map A pointer to the structure providing an initial memory layout
+ * @param block_size The minimum unit of allocation
+ * @param section_size The size of each section
+ * @return unsigned long 
+ */
+unsigned long sparse_bitmap_size(const memory_map_t *map, unsigned long block_size,
+    unsigned long block_bits, unsigned long section_size);
+
+/**
+ * @brief Computes the size in bytes of the owner table for a sparse heap with
+ * sections of `section_size` bytes. If `section_size` is 0, the result is the
+ * same as `owner_table_size`.
+ * 
+ * @param map A pointer to the structure providing an initial memory layout
+ * @param block_size The minimum unit of allocation
+ * @param section_size The size of each section
+ * @return unsigned long 
+ */
+unsigned long sparse_owner_table_size(const memory_map_t *map,
+    unsigned long block_size, unsigned long section_size);
+
+/**
+ * @brief Computes the size in bytes of the metadata array of a sparse heap with
+ * sections of `section_size` bytes. If `section_size` is 0, the result is the
+ * same as `metadata_size`.
+ * 
+ * @param map A pointer to the structure providing an initial memory layout
+ * @param block_size The minimum unit of allocation
+ * @param block_bits The number of bits used to store each block's state
+ * @param section_size The size of each section
+ * @return unsigned long 
+ */
+unsigned long sparse_metadata_size(const memory_map_t *map, unsigned long block_size,
+    unsigned long block_bits, unsigned long section_size);
+
+/**
+ * @brief Computes the size in bytes of the array of free block counts kept
+ * for each group of `pack_size` bytes. See the `pack_counts` field of
+ * `bitmap_heap_descriptor_t`.
+ * 
+ * @param map A pointer to the structure providing an initial memory layout
+ * @param block_size The minimum unit of allocation
+ * @param section_size The size of each section of a sparse heap, or 0
+ * @param pack_size The size of each group
+ * @return unsigned long 
+ */
+unsigned long pack_table_size(const memory_map_t *map, unsigned long block_size,
+    unsigned long section_size, unsigned long pack_size);
+
 /**
  * @brief Builds the heap's internal structures according to the memory
  * layout provided in `map`. All locations in `map` are relative to the `offset`
@@ -180,18 +653,32 @@ unsigned long bitmap_size(const memory_map_t *map, unsigned long block_size, uns
  * 
  * There are several requirements for the initial state of the `heap` structure:
  * 
- * - The `bitmap` field may point to a pre-allocated region of memory which will
- * be used to store the heap's internal bitmap. If this field is NULL, part of
- * the heap will be used to store the bitmap, and `mmap`, if not NULL, will be
+ * - The `bitmap` field may point to a pre-allocated region of memory, at least
+ * as large as reported by `bitmap_size`, which will be used to store the heap's
+ * internal bitmap and its summary index. If this field is NULL, part of the
+ * heap will be used to store the bitmap, and `mmap`, if not NULL, will be
  * called to map that region of memory.
  * 
  * - The `cache` field may point to an array of unsigned longs of sufficient 
  * size, which will be used to speed up memory allocation. If this field is
  * NULL, caching will not be performed.
  * 
+ * - The `owners` field may point to an array of at least `owner_table_size`
+ * bytes, which will be used to look up the metadata of reserved regions in
+ * constant time. If this field is NULL, no table is kept.
+ * 
+ * - The `metadata` field may point to an array of at least `metadata_size`
+ * bytes, in which case the state bits other than availability are kept there
+ * and `bitmap` only needs to be as large as `bitmap_size` reports for a
+ * `block_bits` of 1. If this field is NULL, all bits are kept in `bitmap`.
+ * 
  * - The `cache_capacity` field must be set to the size of the array pointed to
  * by `cache`.
  * 
+ * - The `cache_depth` field may be set to the number of entries to keep for
+ * each level of the tree. Deeper caches absorb longer runs of allocations at
+ * the cost of caching fewer levels within `cache_capacity`.
+ * 
  * - The `block_size` field must be set to the desired smallest unit of 
  * allocation.
  * 
@@ -201,6 +688,34 @@ unsigned long bitmap_size(const memory_map_t *map, unsigned long block_size, uns
  * - The `offset` field must be set to the first location to allocate memory
  * from. Locations in `map` will be interpreted as relative to `offset`.
  * 
+ * - The `scan` field may be set to select a particular word scanner. It is
+ * normally left as BITMAP_SCAN_AUTO.
+ * 
+ * - The `concurrent` field may be set to allow regions to be reserved and
+ * freed from several threads at once.
+ * 
+ * - The `unmap` field may be set, along with `mmap`, to give back the memory
+ * of free blocks, in which case `unmap_height`, `unmap_high` and `unmap_low`
+ * must be set as well.
+ * 
+ * - The `pack_counts` field may point to an array of at least
+ * `pack_table_size` bytes, with `pack_size` set to the size of a huge page,
+ * to pack small reservations into groups of that size which are already in
+ * use. If this field is NULL, the lowest-addressed free block is taken.
+ * 
+ * - The `colors` field may be set to the number of page colors of the cache,
+ * for use by `reserve_region_colored`.
+ * 
+ * - The `section_size` field may be set to build the heap in sections, so
+ * that initialization takes time proportional to the size of one section.
+ * In this case `map` must remain valid until every section has been built.
+ * 
+ * - The `directory` field may point to an array of at least
+ * `sparse_section_count` elements, with `directory_capacity` set to its size,
+ * to build a sparse heap which leaves out holes in `map`. `section_size` must
+ * then be set, to at least the size of the blocks described by one word of
+ * the bitmap, and storage must be sized with `sparse_bitmap_size`.
+ * 
  * @param heap A pointer to the structure describing the heap
  * @param map A pointer to the structure providing an initial memory layout
  * space
@@ -208,4 +723,129 @@ unsigned long bitmap_size(const memory_map_t *map, unsigned long block_size, uns
  */
 int initialize_heap(bitmap_heap_descriptor_t *heap, memory_map_t *map);
 
+/**
+ * @brief Computes the size in bytes of a snapshot of `heap`, as written by
+ * `save_snapshot`.
+ * 
+ * @param heap A pointer to an initialized heap
+ * @return unsigned long 
+ */
+unsigned long snapshot_size(const bitmap_heap_descriptor_t *heap);
+
+/**
+ * @brief Writes a snapshot of the state of `heap` to `buffer`, so that it
+ * can be taken up again with `restore_snapshot`, for instance after a warm
+ * restart which preserves `buffer`.
+ * 
+ * The snapshot starts with a versioned header describing the heap and where
+ * each of its arrays lies within the snapshot, followed by copies of the
+ * bitmap and summary index, the `metadata`, `owners`, `cache`, `directory`
+ * and `pack_counts` arrays the heap uses, and its counters. Callbacks and
+ * `section_map` are not saved. An array which already lies at its place in
+ * `buffer` is not copied. The caller must have exclusive access to the heap.
+ * 
+ * @param heap A pointer to an initialized heap
+ * @param buffer A word-aligned buffer, or memory-mapped file
+ * @param size The size of `buffer` in bytes
+ * @return unsigned long The size of the snapshot, or 0 if `buffer` is too
+ * small or not aligned.
+ */
+unsigned long save_snapshot(const bitmap_heap_descriptor_t *heap, void *buffer,
+    unsigned long size);
+
+/**
+ * @brief Takes up the heap saved in `buffer` by `save_snapshot`, without
+ * copying it. The arrays of `heap` are pointed into `buffer`, which must stay
+ * valid for as long as the heap is used.
+ * 
+ * The header is validated, along with the placement and size of every array
+ * and the block geometry, but the arrays themselves are not read, so this
+ * takes the same time for any size of heap. The `mmap`, `unmap` and
+ * `section_map` fields of `heap` are kept, and `section_map` must be set if
+ * the saved heap has sections left to build. The scanner is chosen again for
+ * the current CPU.
+ * 
+ * @param heap A pointer to the structure to restore the heap into
+ * @param buffer The snapshot, which must be word-aligned
+ * @param size The size of `buffer` in bytes
+ * @return int 0 upon success, nonzero if `buffer` does not hold a valid
+ * snapshot for this variant of the allocator.
+ */
+int restore_snapshot(bitmap_heap_descriptor_t *heap, void *buffer, unsigned long size);
+
+/**
+ * @brief Builds the next section of a heap which is built in sections. See the
+ * `section_size` field of `bitmap_heap_descriptor_t`.
+ * 
+ * This may be called at any convenient time, such as from a background task,
+ * to avoid building sections during allocation. The caller must have
+ * exclusive access to the heap, even in concurrent mode.
+ * 
+ * @param heap A pointer to the structure describing the heap
+ * @return unsigned long The number of sections which remain to be built.
+ */
+unsigned long initialize_section(bitmap_heap_descriptor_t *heap);
+
+#define BITMAP_ALLOC_CONCAT_(prefix, name) prefix##_##name
+#define BITMAP_ALLOC_CONCAT(prefix, name) BITMAP_ALLOC_CONCAT_(prefix, name)
+
+/**
+ * @brief Declares a family of the functions above specialized for a fixed
+ * `block_bits` and `block_size`, named with the prefix `name`, such as
+ * `name_reserve_region`.
+ * 
+ * The generic functions read the geometry of the blocks from the heap on
+ * every access to the bitmap. In a specialized family it is a constant, so
+ * locating a block's bits takes only shifts and masks. The family is defined
+ * by compiling bitmap_alloc.c in one translation unit as follows:
+ * 
+ *     #define BITMAP_ALLOC_NAME name
+ *     #define BITMAP_ALLOC_BLOCK_BITS 2
+ *     #define BITMAP_ALLOC_BLOCK_SIZE_SHIFT 12
+ *     #include "bitmap_alloc.c"
+ * 
+ * Defining BITMAP_ALLOC_SPLIT_METADATA as 1 specializes the family for heaps
+ * which keep their `metadata` apart from the bitmap.
+ * 
+ * Only one family may be defined per translation unit. `name_initialize_heap`
+ * fails unless the `block_bits`, `block_size` and `metadata` fields of the
+ * heap match the values it was compiled with, and a heap it initializes must
+ * only be used with functions of the same family. The size calculations, such
+ * as `bitmap_size`, are shared with the generic functions.
+ */
+#define BITMAP_ALLOC_DECLARE(name) \
+    unsigned long name##_read_bit(bitmap_heap_descriptor_t *heap, \
+        unsigned long location, unsigned long bit); \
+    int name##_write_bit(bitmap_heap_descriptor_t *heap, \
+        unsigned long location, unsigned long bit, int value); \
+    unsigned long name##_read_bit_range(bitmap_heap_descriptor_t *heap, \
+        unsigned long location, unsigned long size, unsigned long bit); \
+    unsigned long name##_write_bit_range(bitmap_heap_descriptor_t *heap, \
+        unsigned long location, unsigned long size, unsigned long bit, \
+        int value); \
+    unsigned long name##_reserve_region(bitmap_heap_descriptor_t *heap, \
+        unsigned long size); \
+    unsigned long name##_reserve_region_in_range(bitmap_heap_descriptor_t *heap, \
+        unsigned long size, unsigned long min_addr, unsigned long max_addr); \
+    unsigned long name##_reserve_region_colored(bitmap_heap_descriptor_t *heap, \
+        unsigned long size, unsigned long *color); \
+    unsigned long name##_reserve_region_batch(bitmap_heap_descriptor_t *heap, \
+        unsigned long size, unsigned long count, unsigned long *out); \
+    unsigned long name##_reserve_extents(bitmap_heap_descriptor_t *heap, \
+        unsigned long blocks, unsigned long *locations, unsigned long *sizes, \
+        unsigned long max_extents); \
+    void name##_free_region(bitmap_heap_descriptor_t *heap, \
+        unsigned long location, unsigned long size); \
+    void name##_free_region_batch(bitmap_heap_descriptor_t *heap, \
+        unsigned long *locations, const unsigned long *sizes, \
+        unsigned long count); \
+    int name##_initialize_heap(bitmap_heap_descriptor_t *heap, \
+        memory_map_t *map); \
+    unsigned long name##_initialize_section(bitmap_heap_descriptor_t *heap); \
+    unsigned long name##_save_snapshot(const bitmap_heap_descriptor_t *heap, \
+        void *buffer, unsigned long size); \
+    int name##_restore_snapshot(bitmap_heap_descriptor_t *heap, void *buffer, \
+        unsigned long size)
+
+
 #endif
\ No newline at end of file
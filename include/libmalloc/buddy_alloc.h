@@ -4,15 +4,59 @@
 #include "memmap.h"
 #include "common.h"
 
-typedef struct buddy_block_t 
-{
-    struct buddy_block_t *linkb;
+/**
+ * @brief The number of bits in a link between blocks. The bits of each link
+ * word above the link hold half of the state of the block.
+ */
+#define BUDDY_LINK_BITS 29
+
+/**
+ * @brief The largest order a buddy heap may have, so that the indices of its
+ * 2^BUDDY_MAX_KVAL blocks, and BUDDY_NIL, fit in the links of a block.
+ */
+#define BUDDY_MAX_KVAL (BUDDY_LINK_BITS - 1)
+
+/**
+ * @brief The link value marking the end of a list of available blocks.
+ */
+#define BUDDY_NIL ((1U << BUDDY_LINK_BITS) - 1)
 
-    struct buddy_block_t *linkf;
+/**
+ * @brief Read the links and the state of a block out of its entry. The state
+ * is six bits, with the order of the block in the low five and whether it is
+ * free in the top one. Its low three bits sit above the back link, and its
+ * high three above the forward link.
+ */
+#define BUDDY_LINKB(block) ((block).linkb & BUDDY_NIL)
+#define BUDDY_LINKF(block) ((block).linkf & BUDDY_NIL)
+#define BUDDY_STATE(block) ((block).linkb >> BUDDY_LINK_BITS \
+    | ((block).linkf >> BUDDY_LINK_BITS) << 3)
+#define BUDDY_KVAL(block) (BUDDY_STATE(block) & 0x1F)
+#define BUDDY_TAG(block) (BUDDY_STATE(block) >> 5)
 
-    unsigned long kval;
+/**
+ * @brief The mobility types of blocks, which a heap grouping by mobility
+ * keeps in separate pageblocks. Unmovable blocks stay where they are for as
+ * long as they live, reclaimable ones can be freed on demand, and movable
+ * ones can be migrated elsewhere.
+ */
+#define BUDDY_UNMOVABLE 0
+#define BUDDY_RECLAIMABLE 1
+#define BUDDY_MOVABLE 2
+#define BUDDY_MOBILITY_TYPES 3
 
-    unsigned long tag;
+/**
+ * @brief An entry of the block map. The links are the indices of the
+ * neighbouring blocks in the list of available blocks, or BUDDY_NIL at either
+ * end of it. Each link has a word of its own, holding nothing but state a
+ * neighbour in the list shares, so a neighbour can be relinked with a single
+ * store.
+ */
+typedef struct buddy_block_t 
+{
+    unsigned int linkb;
+
+    unsigned int linkf;
 
 } buddy_block_t;
 
@@ -21,7 +65,10 @@ typedef struct buddy_descriptor_t
     /**
      * @brief An array of `buddy_block_t` structs serving as the heads of the
      * lists of available blocks. avail[k] serves as the head of the list of
-     * blocks of size 2^k.
+     * blocks of size 2^k, with `linkf` holding the index of its first block
+     * and the back link that of its last. A heap grouping by mobility keeps
+     * `max_kval + 1` heads for each type, one type after another, so this
+     * must then hold BUDDY_MOBILITY_TYPES * (BUDDY_MAX_KVAL + 1) entries.
      */
     buddy_block_t *avail;
 
@@ -37,19 +84,224 @@ typedef struct buddy_descriptor_t
 
     unsigned long free_block_count;
 
+    /**
+     * @brief For each mobility type, a bitmask of the orders whose lists of
+     * available blocks are not empty, with bit k set if the type's list of
+     * size 2^k holds a block. Only the first is used by a heap which does
+     * not group by mobility. Kept by the allocator.
+     */
+    unsigned long avail_mask[BUDDY_MOBILITY_TYPES];
+
+    /**
+     * @brief Optional array holding the mobility type of each pageblock, the
+     * aligned runs of 2^pageblock_kval blocks. If not NULL, blocks are
+     * grouped by mobility: each free block is listed under the type of the
+     * pageblock it starts in, and a reserve only falls back to the free
+     * blocks of another type once its own has none large enough.
+     *
+     * A fallback takes the largest free block of the first type with one,
+     * trying reclaimable before movable blocks for unmovable reserves,
+     * unmovable before movable for reclaimable ones, and reclaimable before
+     * unmovable for movable ones. If the order of that block is at least
+     * half that of a pageblock, or the reserve is not movable, its whole
+     * pageblock is claimed for the reserve's type along with every free
+     * block in it, so later reserves of that type are served from there. A
+     * block of a pageblock or more claims every pageblock it covers.
+     *
+     * It must be at least as large as reported by `buddy_pageblock_types_size`.
+     * Every pageblock starts out movable.
+     */
+    unsigned char *pageblock_types;
+
+    /**
+     * @brief The order of a pageblock, at most `max_kval`.
+     */
+    unsigned long pageblock_kval;
+
+    /**
+     * @brief The number of reserves which fell back to another mobility
+     * type, and the number of times a pageblock was claimed by another type.
+     */
+    unsigned long fallback_count;
+    unsigned long claim_count;
+
     int (*mmap)(void *location, unsigned long size);
 
 } buddy_descriptor_t;
 
 unsigned long buddy_map_size(const memory_map_t *map, unsigned long block_size);
 
+/**
+ * @brief Computes the size in bytes of the `pageblock_types` array of a heap
+ * over `map` grouping by mobility with pageblocks of order `pageblock_kval`.
+ */
+unsigned long buddy_pageblock_types_size(const memory_map_t *map, unsigned long block_size,
+    unsigned long pageblock_kval);
+
+/**
+ * @brief Reserves a block of at least `size` bytes, as an unmovable one if the
+ * heap groups by mobility. Returns NOMEM if there is none.
+ */
 unsigned long buddy_reserve(buddy_descriptor_t *heap, unsigned long size);
 
+/**
+ * @brief Reserves a block as `buddy_reserve` does, of the mobility type
+ * `type`. The type is ignored if the heap does not group by mobility, and
+ * otherwise NOMEM is returned if it is not below BUDDY_MOBILITY_TYPES.
+ */
+unsigned long buddy_reserve_type(buddy_descriptor_t *heap, unsigned long size,
+    unsigned long type);
+
+/**
+ * @brief Reserves a block as `buddy_reserve` does, but only from within the
+ * addresses [`min_addr`, `max_addr`). Returns NOMEM if there is none.
+ */
+unsigned long buddy_reserve_in_range(buddy_descriptor_t *heap, unsigned long size,
+    unsigned long min_addr, unsigned long max_addr);
+
 unsigned long buddy_free(buddy_descriptor_t *heap, unsigned long location);
 
 unsigned long buddy_free_size(buddy_descriptor_t *heap, unsigned long size, 
     unsigned long location);
 
+/**
+ * @brief Sets up `heap` over the available regions of `map`. Returns nonzero
+ * if the block map cannot be placed, if the heap would need more than
+ * 2^BUDDY_MAX_KVAL blocks, or if `pageblock_kval` is larger than the heap.
+ */
 int buddy_alloc_init(buddy_descriptor_t *heap, memory_map_t *map);
 
+/**
+ * @brief The number of orders, from 0 up, which a per-CPU front end may hold.
+ * At most 8, so that the state bits above the forward link of a reserved
+ * block of these orders are clear.
+ */
+#define BUDDY_PCP_ORDERS 4
+
+/**
+ * @brief The blocks held by one CPU in front of a buddy heap, in a list for
+ * each order. The lists are linked through the `linkf` words of the entries
+ * of their blocks, which the heap sees as reserved, so that each such word
+ * holds the bare index of the next block. Aligned to a cache line, so CPUs
+ * working on their own lists do not share one.
+ */
+typedef struct buddy_pcp_t
+{
+    /**
+     * @brief The index of the first block of each list, or BUDDY_NIL.
+     */
+    CACHE_ALIGNED unsigned int first[BUDDY_PCP_ORDERS];
+
+    unsigned int count[BUDDY_PCP_ORDERS];
+
+} buddy_pcp_t;
+
+/**
+ * @brief A front end to a buddy heap which keeps small blocks in per-CPU
+ * lists, so most reserves and frees of them neither take the heap's lock nor
+ * touch its lists. A list found empty is refilled from the heap with `low`
+ * blocks at once, and a list grown past `high` blocks is drained back to
+ * `low`, keeping the blocks freed last. Larger blocks go to the heap under
+ * its lock.
+ *
+ * Each list must only be used by one thread at a time, which `cpu_id`
+ * must ensure, e.g. by being called with preemption disabled. Blocks held in
+ * the lists are not counted in the heap's `free_block_count`.
+ */
+typedef struct buddy_pcp_descriptor_t
+{
+    buddy_descriptor_t *heap;
+
+    /**
+     * @brief An array of `cpu_count` lists, one for each CPU.
+     */
+    buddy_pcp_t *lists;
+
+    unsigned long cpu_count;
+
+    /**
+     * @brief Blocks of orders below this one are held in the lists. At most
+     * BUDDY_PCP_ORDERS.
+     */
+    unsigned long orders;
+
+    /**
+     * @brief The number of blocks a list is refilled or drained to. At least 1.
+     */
+    unsigned long low;
+
+    /**
+     * @brief The number of blocks a list may hold before it is drained. At
+     * least `low`.
+     */
+    unsigned long high;
+
+    /**
+     * @brief The mobility type the lists are refilled with, and larger blocks
+     * reserved as, if the heap groups by mobility. BUDDY_UNMOVABLE if left 0.
+     * Blocks freed to the lists are handed out again as this type.
+     */
+    unsigned long type;
+
+    /**
+     * @brief Returns the index of the list of the calling CPU, below
+     * `cpu_count`. If NULL, the first list is always used.
+     */
+    unsigned long (*cpu_id)(void);
+
+    /**
+     * @brief Take and release the lock guarding `heap`. Either may be NULL if
+     * the heap is only used from one thread.
+     */
+    void (*lock)(buddy_descriptor_t *heap);
+    void (*unlock)(buddy_descriptor_t *heap);
+
+} buddy_pcp_descriptor_t;
+
+/**
+ * @brief Empties every list of `pcp`, whose other fields must be set. Returns
+ * nonzero if `orders`, `low`, `high` or `type` are out of range.
+ */
+int buddy_pcp_init(buddy_pcp_descriptor_t *pcp);
+
+/**
+ * @brief Reserves a block as `buddy_reserve` does, taking it from the list
+ * of the calling CPU if it is small enough.
+ */
+unsigned long buddy_pcp_reserve(buddy_pcp_descriptor_t *pcp, unsigned long size);
+
+/**
+ * @brief Frees a block as `buddy_free` does, keeping it in the list of the
+ * calling CPU if it is small enough. Returns the size of the block.
+ */
+unsigned long buddy_pcp_free(buddy_pcp_descriptor_t *pcp, unsigned long location);
+
+/**
+ * @brief Gives every block held by the list of CPU `cpu` back to the heap,
+ * e.g. before that CPU goes offline, or before a snapshot is taken. The list
+ * must not be in use meanwhile.
+ */
+void buddy_pcp_drain(buddy_pcp_descriptor_t *pcp, unsigned long cpu);
+
+/**
+ * @brief Computes the size in bytes of a snapshot of `heap`.
+ */
+unsigned long buddy_snapshot_size(const buddy_descriptor_t *heap);
+
+/**
+ * @brief Writes a versioned snapshot of `heap`, holding its counters, avail
+ * lists, block map and pageblock types, to the word-aligned `buffer`. Returns
+ * the size of the snapshot, or 0 if `buffer` is too small.
+ */
+unsigned long buddy_save_snapshot(const buddy_descriptor_t *heap, void *buffer,
+    unsigned long size);
+
+/**
+ * @brief Takes up the heap saved in `buffer` by `buddy_save_snapshot` in
+ * place, keeping the `mmap` field of `heap`. Since the links are block
+ * indices, only the header is read, wherever `buffer` is mapped. Returns
+ * nonzero if `buffer` does not hold a valid snapshot.
+ */
+int buddy_restore_snapshot(buddy_descriptor_t *heap, void *buffer, unsigned long size);
+
 #endif
\ No newline at end of file
@@ -10,4 +10,20 @@
  */
 #define NOMEM ((unsigned long)~0)
 
+/*
+ * The size of a cache line, and a specifier aligning a declaration to one, so
+ * that data written by different CPUs can be kept from sharing a line. Put on
+ * the first member of a struct, it aligns and pads the whole struct. Compilers
+ * with neither the GNU attribute nor C11 alignment get no alignment.
+ */
+#define CACHE_LINE_SIZE 64
+
+#if defined(__GNUC__)
+#define CACHE_ALIGNED __attribute__((aligned(CACHE_LINE_SIZE)))
+#elif defined(__STDC_VERSION__) && __STDC_VERSION__ >= 201112L
+#define CACHE_ALIGNED _Alignas(CACHE_LINE_SIZE)
+#else
+#define CACHE_ALIGNED
+#endif
+
 #endif
\ No newline at end of file
@@ -2,539 +2,3175 @@
 #include "libmalloc/common.h"
 #include "util.h"
 
+#if defined(__x86_64__) && defined(__GNUC__) && __STDC_HOSTED__
+#define SCAN_SIMD 1
+#include <immintrin.h>
+#endif
+
 static const int BIT_AVAIL = 0;
 static const int BIT_USED = 1;
 static const int BIT_MAPPED = 2;
 
 /*
- * Sets all elements in the cache's underlying array to 0.
+ * The number of bits in each word of the bitmap and of its summary index.
  */
-static inline void clear_cache(bitmap_heap_descriptor_t *heap)
-{
-    if(heap->cache == (unsigned long*)0)
-    {
-        return;
-    }
+#define WORD_BITS (8 * sizeof(unsigned long))
 
-    for(int i = 0; i < heap->cache_capacity; i++)
-    {
-        heap->cache[i] = 0;
-    }
-}
+/*
+ * log2(WORD_BITS).
+ */
+#define WORD_SHIFT (__SIZEOF_LONG__ == 8 ? 6 : 5)
 
 /*
- * Clears all bits in the heap's bitmap.
+ * Upper bound on the number of levels in the summary index. Each level
+ * divides the number of words by WORD_BITS, so this covers any bitmap that
+ * fits in the address space.
  */
-static inline void clear_bitmap(bitmap_heap_descriptor_t *heap)
-{
-    for(int i = 0; i < heap->bitmap_size / sizeof(*heap->bitmap); i++)
-    {
-        heap->bitmap[i] = 0;
-    }
-}
+#define MAX_SUMMARY_DEPTH 16
 
 /*
- * Sets bit `index` in the heap's bitmap, marking the underlying block as
- * available.
+ * A mask of the most significant bit of each `bits`-bit field in a word.
+ */
+#define FIELD_MASK(bits) ((~0UL / (~0UL >> (WORD_BITS - (bits)))) << ((bits) - 1))
+
+/*
+ * The geometry of the blocks. BLOCK_BITS is the number of state bits of each
+ * block, and TREE_BITS the number of bits each block occupies in `bitmap`,
+ * which is 1 if the heap keeps the other state bits in `metadata`.
+ * 
+ * When this file is compiled with BITMAP_ALLOC_NAME defined (see
+ * BITMAP_ALLOC_DECLARE), the geometry is fixed at compile time, so the
+ * arithmetic locating a block within the bitmap reduces to constant shifts and
+ * masks. Otherwise it is read from the heap.
+ */
+#ifdef BITMAP_ALLOC_NAME
+
+#if !defined(BITMAP_ALLOC_BLOCK_BITS) || !defined(BITMAP_ALLOC_BLOCK_SIZE_SHIFT)
+#error "BITMAP_ALLOC_BLOCK_BITS and BITMAP_ALLOC_BLOCK_SIZE_SHIFT must be defined"
+#elif BITMAP_ALLOC_BLOCK_BITS <= 0 || BITMAP_ALLOC_BLOCK_BITS > 64 \
+    || (BITMAP_ALLOC_BLOCK_BITS & (BITMAP_ALLOC_BLOCK_BITS - 1)) != 0
+#error "BITMAP_ALLOC_BLOCK_BITS must be a power of two no greater than 64"
+#endif
+
+#ifndef BITMAP_ALLOC_SPLIT_METADATA
+#define BITMAP_ALLOC_SPLIT_METADATA 0
+#endif
+
+#define SPLIT_METADATA(heap) (BITMAP_ALLOC_SPLIT_METADATA)
+#define BLOCK_BITS(heap) ((unsigned long)(BITMAP_ALLOC_BLOCK_BITS))
+#define TREE_BITS(heap) (SPLIT_METADATA(heap) ? 1UL : BLOCK_BITS(heap))
+#define BLOCKS_IN_WORD(heap) (WORD_BITS / TREE_BITS(heap))
+#define BLOCK_SIZE(heap) (1UL << (BITMAP_ALLOC_BLOCK_SIZE_SHIFT))
+#define AVAIL_MASK(heap) FIELD_MASK(TREE_BITS(heap))
+#define PUBLIC(name) BITMAP_ALLOC_CONCAT(BITMAP_ALLOC_NAME, name)
+
+#else
+
+#define SPLIT_METADATA(heap) ((heap)->metadata != (unsigned long*)0)
+#define BLOCK_BITS(heap) ((heap)->block_bits)
+#define TREE_BITS(heap) (SPLIT_METADATA(heap) ? 1UL : BLOCK_BITS(heap))
+#define BLOCKS_IN_WORD(heap) ((heap)->blocks_in_word)
+#define BLOCK_SIZE(heap) ((heap)->block_size)
+#define AVAIL_MASK(heap) ((heap)->mask)
+#define PUBLIC(name) name
+
+#endif
+
+/*
+ * The words holding the state bits of each block other than its availability,
+ * laid out as in `bitmap` when they are not kept separately.
+ */
+#define METADATA(heap) (SPLIT_METADATA(heap) ? (heap)->metadata : (heap)->bitmap)
+
+/*
+ * Finds the first of `count` words in which any bit of `mask` is set.
+ * Returns `count` if there is no such word.
  */
-static inline void set_bit(bitmap_heap_descriptor_t *heap, int index, int bit)
+typedef unsigned long (*scan_func_t)(const unsigned long *words,
+    unsigned long count, unsigned long mask);
+
+static unsigned long scan_scalar(const unsigned long *words, unsigned long count,
+    unsigned long mask)
 {
-    if(bit < heap->block_bits)
+    for(unsigned long i = 0; i < count; i++)
     {
-        int bitmap_index = index / heap->blocks_in_word;
-        int bitmap_offset = index % heap->blocks_in_word;
-        unsigned long mask = (unsigned long)1 << (heap->block_bits * (bitmap_offset + 1) - 1 - bit);
-        heap->bitmap[bitmap_index] |= mask;
+        if(words[i] & mask)
+        {
+            return i;
+        }
     }
+    return count;
 }
 
+#ifdef SCAN_SIMD
+
 /*
- * Clears bit `index` in the heap's bitmap, marking the underlying block as
- * reserved.
+ * SSE2 has no 64-bit comparison, so two words are tested as four 32-bit
+ * lanes and the lowest nonzero lane is used to pick between them.
  */
-static inline void clear_bit(bitmap_heap_descriptor_t *heap, int index, int bit)
+__attribute__((target("sse2")))
+static unsigned long scan_sse2(const unsigned long *words, unsigned long count,
+    unsigned long mask)
 {
-    if(bit < heap->block_bits)
+    __m128i m = _mm_set1_epi64x(mask);
+    __m128i zero = _mm_setzero_si128();
+    unsigned long i = 0;
+    for(; i + 2 <= count; i += 2)
     {
-        int bitmap_index = index / heap->blocks_in_word;
-        int bitmap_offset = index % heap->blocks_in_word;
-        unsigned long mask = ~((unsigned long)1 
-            << (heap->block_bits * (bitmap_offset + 1) - 1 - bit));
-        heap->bitmap[bitmap_index] &= mask;
+        __m128i v = _mm_and_si128(_mm_loadu_si128((const __m128i*)(words + i)), m);
+        int zero_lanes = _mm_movemask_epi8(_mm_cmpeq_epi32(v, zero));
+        if(zero_lanes != 0xFFFF)
+        {
+            return i + ((~zero_lanes & 0xFF) ? 0 : 1);
+        }
     }
+    return i + scan_scalar(words + i, count - i, mask);
 }
 
-/*
- * Tests whether the block at bit `index` is available. If so, returns nonzero,
- * else returns 0.
- */
-static inline int test_bit(bitmap_heap_descriptor_t *heap, int index, int bit)
+__attribute__((target("avx2")))
+static unsigned long scan_avx2(const unsigned long *words, unsigned long count,
+    unsigned long mask)
 {
-    if(bit > (heap->block_bits - 1))
+    __m256i m = _mm256_set1_epi64x(mask);
+    unsigned long i = 0;
+    for(; i + 4 <= count; i += 4)
     {
-        return 1;
+        __m256i v = _mm256_loadu_si256((const __m256i*)(words + i));
+        if(!_mm256_testz_si256(v, m))
+        {
+            __m256i zero_lanes = _mm256_cmpeq_epi64(_mm256_and_si256(v, m),
+                _mm256_setzero_si256());
+            int nonzero = ~_mm256_movemask_pd(_mm256_castsi256_pd(zero_lanes)) & 0xF;
+            return i + __builtin_ctz(nonzero);
+        }
     }
-    unsigned long mask = ((unsigned long)1 
-            << (heap->block_bits * ((index % heap->blocks_in_word) + 1) 
-                - 1 
-                - bit));
-    return (heap->bitmap[index / heap->blocks_in_word] & mask) != 0;
+    return i + scan_scalar(words + i, count - i, mask);
 }
 
-/*
- * Sets bit `index` and its buddy in the heap's bitmap, marking the underlying
- * blocks as available. Operation is used while spltting a block to reserve one
- * of its child blocks.
- */
-static inline void set_pair(bitmap_heap_descriptor_t *heap, int index, int bit)
+__attribute__((target("avx512f")))
+static unsigned long scan_avx512(const unsigned long *words, unsigned long count,
+    unsigned long mask)
 {
-    if(bit < heap->block_bits)
+    __m512i m = _mm512_set1_epi64(mask);
+    unsigned long i = 0;
+    for(; i + 8 <= count; i += 8)
     {
-        int bitmap_index = index / heap->blocks_in_word;
-        int bitmap_offset = index % heap->blocks_in_word;
-
-        unsigned long mask_a = (unsigned long)1 << (heap->block_bits * (bitmap_offset + 1) - 1 - bit);
-        unsigned long mask_b = (unsigned long)1 << (heap->block_bits * ((bitmap_offset ^ 1) + 1) - 1 - bit);
-
-        heap->bitmap[bitmap_index] |= mask_a;
-        heap->bitmap[bitmap_index] |= mask_b;
-    } 
+        __mmask8 nonzero = _mm512_test_epi64_mask(_mm512_loadu_si512(words + i), m);
+        if(nonzero)
+        {
+            return i + __builtin_ctz(nonzero);
+        }
+    }
+    return i + scan_scalar(words + i, count - i, mask);
 }
 
+static const scan_func_t scan_funcs[] = {
+    [BITMAP_SCAN_AUTO] = scan_scalar,
+    [BITMAP_SCAN_SCALAR] = scan_scalar,
+    [BITMAP_SCAN_SSE2] = scan_sse2,
+    [BITMAP_SCAN_AVX2] = scan_avx2,
+    [BITMAP_SCAN_AVX512] = scan_avx512
+};
+
 /*
- * Clears bit `index` and its buddy in the heap's bitmap, marking the underlying
- * blocks as reserved. Used when merging two child blocks into a single parent 
- * block.
+ * Returns nonzero if the CPU supports the given word scanner.
  */
-static inline void clear_pair(bitmap_heap_descriptor_t *heap, int index, int bit)
+static int scan_supported(bitmap_scan_t scan)
 {
-    if(bit < heap->block_bits)
+    __builtin_cpu_init();
+    switch(scan)
     {
-        int bitmap_index = index / heap->blocks_in_word;
-        int bitmap_offset = index % heap->blocks_in_word;
+    case BITMAP_SCAN_SCALAR:
+        return 1;
+    case BITMAP_SCAN_SSE2:
+        return __builtin_cpu_supports("sse2");
+    case BITMAP_SCAN_AVX2:
+        return __builtin_cpu_supports("avx2");
+    case BITMAP_SCAN_AVX512:
+        return __builtin_cpu_supports("avx512f");
+    default:
+        return 0;
+    }
+}
 
-        unsigned long mask_a = ~((unsigned long)1 << (heap->block_bits * (bitmap_offset + 1) - 1 - bit));
-        unsigned long mask_b = ~((unsigned long)1 << (heap->block_bits * ((bitmap_offset ^ 1) + 1) - 1 - bit));
+#else
 
-        heap->bitmap[bitmap_index] &= mask_a;
-        heap->bitmap[bitmap_index] &= mask_b;
-    }
+static const scan_func_t scan_funcs[] = {
+    [BITMAP_SCAN_AUTO] = scan_scalar,
+    [BITMAP_SCAN_SCALAR] = scan_scalar,
+    [BITMAP_SCAN_SSE2] = scan_scalar,
+    [BITMAP_SCAN_AVX2] = scan_scalar,
+    [BITMAP_SCAN_AVX512] = scan_scalar
+};
+
+static int scan_supported(bitmap_scan_t scan)
+{
+    return scan == BITMAP_SCAN_SCALAR;
 }
 
+#endif
+
 /*
- * Computes the location in the cache that `index` would be stored at, if it
- * were cached.
+ * Replaces the heap's requested word scanner with the widest one at or below
+ * it which the CPU supports. BITMAP_SCAN_AUTO requests the widest overall.
  */
-static inline int cache_location_from_index(bitmap_heap_descriptor_t *heap, int index)
+static void select_scan(bitmap_heap_descriptor_t *heap)
 {
-    return llog2(index + 1) - llog2(heap->blocks_in_word) - 1;
+    if(heap->scan == BITMAP_SCAN_AUTO || heap->scan > BITMAP_SCAN_AVX512)
+    {
+        heap->scan = BITMAP_SCAN_AVX512;
+    }
+    while(heap->scan > BITMAP_SCAN_SCALAR && !scan_supported(heap->scan))
+    {
+        heap->scan--;
+    }
 }
 
 /*
- * Computes the location in the cache that blocks at the indicated height are
- * cached at.
+ * Reads a word of the bitmap or its summary index. Other threads may modify
+ * the heap in concurrent mode, so words are always read atomically; a relaxed
+ * load costs the same as a plain one.
  */
-static inline int cache_location_from_height(bitmap_heap_descriptor_t *heap, int height)
+static inline unsigned long load_word(const unsigned long *word)
 {
-    return heap->height - height - llog2(heap->blocks_in_word);
+    return __atomic_load_n(word, __ATOMIC_RELAXED);
 }
 
 /*
- * Returns a cached value from the desired location, removing that value from
- * the cache.
+ * Sets `bits` in `word`, atomically if the heap is in concurrent mode.
  */
-static inline int check_cache(bitmap_heap_descriptor_t *heap, int height)
+static inline void or_word(bitmap_heap_descriptor_t *heap, unsigned long *word,
+    unsigned long bits)
 {
-    if(heap->cache != (unsigned long*)0)
+    if(heap->concurrent)
     {
-        int loc = cache_location_from_height(heap, height);
-        unsigned long n = heap->cache[loc];
-        heap->cache[loc] = 0;
-        return n;
+        __atomic_fetch_or(word, bits, __ATOMIC_SEQ_CST);
     }
     else
     {
-        return 0;
+        *word |= bits;
     }
 }
 
 /*
- * If space in the cache exists, stores the provided index at the appropriate
- * location.
+ * Clears `bits` in `word`, atomically if the heap is in concurrent mode.
  */
-static inline void store_cache(bitmap_heap_descriptor_t *heap, int index)
+static inline void and_not_word(bitmap_heap_descriptor_t *heap, unsigned long *word,
+    unsigned long bits)
 {
-    if(heap->cache != (unsigned long*)0)
+    if(heap->concurrent)
     {
-        int level = cache_location_from_index(heap, index);
-        if(level >= 0 && heap->cache[level] == 0)
-        {
-            heap->cache[level] = index;
-        }
+        __atomic_fetch_and(word, ~bits, __ATOMIC_SEQ_CST);
+    }
+    else
+    {
+        *word &= ~bits;
     }
 }
 
 /*
- * If `index` is stored in the cache, remove it. Otherwise, leave the cache
- * as is.
+ * Adds `count` blocks to the heap's count of free blocks. Negative counts are
+ * passed as their two's complement.
  */
-static inline void uncache(bitmap_heap_descriptor_t *heap, int index)
+static inline void add_free_blocks(bitmap_heap_descriptor_t *heap,
+    unsigned long count)
 {
-    if(heap->cache != (unsigned long*)0)
+    if(heap->concurrent)
     {
-        int level = cache_location_from_index(heap, index);
-        if(level >= 0 && heap->cache[level] == index)
-        {
-            heap->cache[level] = 0;
-        }
+        __atomic_fetch_add(&heap->free_block_count, count, __ATOMIC_RELAXED);
+    }
+    else
+    {
+        heap->free_block_count += count;
     }
 }
 
 /*
- * Computes the bitmap index of the block at `location` and `height`.
+ * Computes the number of words required by the summary index of a bitmap
+ * made up of `bitmap_words` words. Each level of the index holds one bit per
+ * word in the level below it, and levels are added until one fits in a single
+ * word.
  */
-static inline int block_index(bitmap_heap_descriptor_t *heap,
-    unsigned long location, unsigned long height)
+static unsigned long summary_words(unsigned long bitmap_words)
 {
-    return (location / (heap->block_size * ((unsigned long)1 << height))) + (1 << (heap->height - height));
+    unsigned long total = 0;
+    do
+    {
+        bitmap_words = (bitmap_words + WORD_BITS - 1) / WORD_BITS;
+        total += bitmap_words;
+    } while(bitmap_words > 1);
+    return total;
 }
 
 /*
- * Computes the location of the block at `index` and `height`
+ * Concurrent counterpart of update_summary. Bits are set and cleared with
+ * atomic operations, and after clearing a bit the word it describes is read
+ * again; if another thread has made it nonempty in the meantime, the bit is
+ * set again. Either that thread sees the bit cleared and propagates the set
+ * itself, or this one sees its change, so the index may briefly report words
+ * which are empty but never misses one which is not.
  */
-static inline unsigned long block_location(bitmap_heap_descriptor_t *heap,
-    int index, int height)
+static void update_summary_atomic(bitmap_heap_descriptor_t *heap,
+    unsigned long word)
 {
-    return heap->offset 
-        + (heap->block_size << height) 
-            * (index - ((unsigned long)1 << (heap->height - height)));
+    unsigned long *lower = heap->bitmap;
+    unsigned long lower_mask = AVAIL_MASK(heap);
+    unsigned long *level = heap->summary;
+    unsigned long count = heap->bitmap_size / sizeof(*heap->bitmap);
+    while(count > 1)
+    {
+        unsigned long level_words = (count + WORD_BITS - 1) / WORD_BITS;
+        unsigned long *summary_word = &level[word / WORD_BITS];
+        unsigned long bit = 1UL << (word % WORD_BITS);
+        if(load_word(&lower[word]) & lower_mask)
+        {
+            if(__atomic_fetch_or(summary_word, bit, __ATOMIC_SEQ_CST) != 0)
+            {
+                return;
+            }
+        }
+        else
+        {
+            unsigned long remaining = __atomic_and_fetch(summary_word, ~bit, __ATOMIC_SEQ_CST);
+            if(__atomic_load_n(&lower[word], __ATOMIC_SEQ_CST) & lower_mask)
+            {
+                continue;
+            }
+            else if(remaining != 0)
+            {
+                return;
+            }
+        }
+
+        lower = level;
+        lower_mask = ~0UL;
+        word /= WORD_BITS;
+        level += level_words;
+        count = level_words;
+    }
 }
 
 /*
- * Marks the indicated block as unavailable, and marks its children as both
- * available. Stores the right-hand child in the cache, and returns the index
- * of the left-hand child. The caller is expected to either split or allocate
- * the left-hand child.
+ * Recomputes the summary bit describing word `word` of the bitmap. The change
+ * is propagated up through the index only for as long as it changes whether
+ * the word containing it is empty.
  */
-static inline int split_block(bitmap_heap_descriptor_t *heap, int index)
+static inline void update_summary(bitmap_heap_descriptor_t *heap,
+    unsigned long word)
 {
-    if(index)
+    if(heap->concurrent)
     {
-        clear_bit(heap, index, BIT_AVAIL);
-        index *= 2;
-        set_pair(heap, index, BIT_AVAIL);
-        store_cache(heap, index + 1);
+        update_summary_atomic(heap, word);
+        return;
     }
-    return index;
-}
 
-/*
- * If the buddy of the indicated block is marked as available, marks the 
- * indicated block and its buddy as unavailable, and marks their parent
- * as available. If the buddy of the indicated block is cached, it kill be
- * removed from the cache.
- * 
- * If the buddy of the indicated block is marked as unavailable, this function 
- * does nothing. The block indicated by `index` is assumed to be available.
- */
-static int merge_block(bitmap_heap_descriptor_t *heap, int index)
-{
-    while(index > 1 && test_bit(heap, index ^ 1, BIT_AVAIL))
+    unsigned long *level = heap->summary;
+    unsigned long count = heap->bitmap_size / sizeof(*heap->bitmap);
+    int nonempty = (heap->bitmap[word] & AVAIL_MASK(heap)) != 0;
+    while(count > 1)
     {
-        uncache(heap, index ^ 1);
-        clear_pair(heap, index, BIT_AVAIL);
-        index /= 2;
-        set_bit(heap, index, BIT_AVAIL);
+        unsigned long *summary_word = &level[word / WORD_BITS];
+        unsigned long bit = 1UL << (word % WORD_BITS);
+        unsigned long old = *summary_word;
+        *summary_word = nonempty ? old | bit : old & ~bit;
+        if((old != 0) == (*summary_word != 0))
+        {
+            break;
+        }
+        nonempty = *summary_word != 0;
+        word /= WORD_BITS;
+        level += (count + WORD_BITS - 1) / WORD_BITS;
+        count = (count + WORD_BITS - 1) / WORD_BITS;
     }
-    return index;
 }
 
 /*
- * Finds the index of the first available block at `height`. If no such block
- * is available, recursively searches higher blocks and splits them until an
- * appropriate block is available. Returns 0 if no available blocks of sufficient
- * size exist.
+ * Uses the summary index to find the first word of the bitmap in the range
+ * [start, end) which contains an available block. Returns `end` if there is
+ * no such word. Reads at most two words per level of the index.
+ * 
+ * In concurrent mode the index may briefly mark words which are empty, so any
+ * part of the index found to be empty is skipped and the search resumed.
  */
-static int find_free_region(bitmap_heap_descriptor_t *heap, int height)
+static unsigned long summary_find(bitmap_heap_descriptor_t *heap,
+    unsigned long start, unsigned long end)
 {
-    if (height > heap->height || height < 0)
-    {
-        return 0;
-    }
-    else if (height <= heap->height - ilog2(heap->blocks_in_word))
+    unsigned long *levels[MAX_SUMMARY_DEPTH];
+    unsigned long pos = start;
+    while(pos < end)
     {
-        unsigned long cached_index = check_cache(heap, height);
-        if(cached_index)
+        unsigned long *level = heap->summary;
+        unsigned long count = heap->bitmap_size / sizeof(*heap->bitmap);
+        int depth = 0;
+        while(1)
         {
-            return cached_index;
+            unsigned long level_words = (count + WORD_BITS - 1) / WORD_BITS;
+            if(pos >= count)
+            {
+                return end;
+            }
+
+            unsigned long bits = load_word(&level[pos / WORD_BITS]) 
+                & (~0UL << (pos % WORD_BITS));
+            levels[depth] = level;
+            if(bits)
+            {
+                pos = pos - (pos % WORD_BITS) + __builtin_ctzl(bits);
+                break;
+            }
+            else if(level_words == 1)
+            {
+                return end;
+            }
+
+            // Nothing left in this word; continue from the next one a level up.
+            pos = pos / WORD_BITS + 1;
+            level += level_words;
+            count = level_words;
+            depth++;
         }
-        unsigned long start = (1 << (heap->height - height)) / heap->blocks_in_word;
-        unsigned long end = ((1 << (heap->height - height + 1)) / heap->blocks_in_word);
-        for (int index = start; index < end; index++)
+
+        int stale = 0;
+        while(depth > 0 && !stale)
         {
-            unsigned long avail_mask = heap->bitmap[index] & heap->mask;
-            if (avail_mask != 0)
+            depth--;
+            unsigned long bits = load_word(&levels[depth][pos]);
+            if(bits == 0)
+            {
+                stale = 1;
+            }
+            else
             {
-                return heap->blocks_in_word * index + (__builtin_ctzl(avail_mask) / heap->block_bits);
+                pos = pos * WORD_BITS + __builtin_ctzl(bits);
             }
         }
-    }
-    else
-    {
-#if __SIZEOF_LONG__ == 8
-        static const unsigned long bitmasks[] = {0x00000002, 0x0000000C, 0x000000F0, 0x0000FF00, 0xFFFF0000, 0xFFFFFFFF00000000};
-#else
-        static const unsigned long bitmasks[] = {0x00000002, 0x0000000C, 0x000000F0, 0x0000FF00, 0xFFFF0000};
-#endif
-        int bitmask_index = heap->height - height + llog2(heap->block_bits);
-        if (heap->bitmap[0] & bitmasks[bitmask_index] & heap->mask)
+
+        if(stale)
+        {
+            // Skip everything below the empty word and search again.
+            pos = (pos + 1) << (WORD_SHIFT * (depth + 1));
+        }
+        else if(pos >= end || (load_word(&heap->bitmap[pos]) & AVAIL_MASK(heap)))
         {
-            return __builtin_ctzl(heap->bitmap[0] & bitmasks[bitmask_index] & heap->mask) / heap->block_bits;
+            return pos < end ? pos : end;
+        }
+        else
+        {
+            pos++;
         }
     }
-    return split_block(heap, find_free_region(heap, height + 1));
+    return end;
 }
 
-static int map_region(bitmap_heap_descriptor_t *heap, int index, int height)
+/*
+ * Sets all elements in the cache's underlying array to 0.
+ */
+static inline void clear_cache(bitmap_heap_descriptor_t *heap)
 {
-    int status = 0;
-    if(!test_bit(heap, index, BIT_MAPPED) && height > 0)
+    if(heap->cache == (unsigned long*)0)
     {
-        status = map_region(heap, index * 2, height - 1);
-        if(!status)
-        {
-            status = map_region(heap, (index * 2) + 1, height - 1);
-        }
-        set_bit(heap, index, BIT_MAPPED);
+        return;
     }
-    else if(!test_bit(heap, index, BIT_MAPPED) && height == 0)
+
+    for(int i = 0; i < heap->cache_capacity; i++)
     {
-        status = heap->mmap((void*)block_location(heap, index, 0), heap->block_size);
+        heap->cache[i] = 0;
     }
-    return status;
 }
 
-static unsigned long compute_memory_size(const memory_map_t *map)
+/*
+ * Clears all bits in the heap's bitmap, its summary index and its metadata.
+ */
+static inline void clear_bitmap(bitmap_heap_descriptor_t *heap)
 {
-    // Find the last available region in the memory map.
-    int map_index = map->size - 1;
-    while(map->array[map_index].type != M_AVAILABLE)
+    unsigned long words = heap->bitmap_size / sizeof(*heap->bitmap);
+    for(unsigned long i = 0; i < words + summary_words(words); i++)
     {
-        map_index--;
+        heap->bitmap[i] = 0;
+    }
+    if(SPLIT_METADATA(heap))
+    {
+        words = (2UL << heap->height) / (WORD_BITS / BLOCK_BITS(heap));
+        for(unsigned long i = 0; i < words; i++)
+        {
+            heap->metadata[i] = 0;
+        }
     }
-
-    return map->array[map_index].location + map->array[map_index].size;
 }
 
-static unsigned long generate_mask(unsigned long block_bits)
+/*
+ * Returns a pointer to the word holding bit `bit` of the block at `index`.
+ */
+static inline unsigned long *state_word(bitmap_heap_descriptor_t *heap,
+    unsigned long index, int bit)
 {
-    unsigned long blocks_in_word = 8 * sizeof(unsigned long) / block_bits;
-    unsigned long mask = 0;
-    for(unsigned long i = 1; i <= blocks_in_word; i++)
+    if(bit == BIT_AVAIL)
     {
-        mask |= 1UL << (i * block_bits - 1UL);
+        return &heap->bitmap[index / BLOCKS_IN_WORD(heap)];
     }
-    return mask;
+    return &METADATA(heap)[index / (WORD_BITS / BLOCK_BITS(heap))];
 }
 
-static int construct_heap_desc(bitmap_heap_descriptor_t *heap, const memory_map_t *map)
+/*
+ * Returns a mask of bit `bit` of the block at `index` within the word
+ * returned by state_word.
+ */
+static inline unsigned long state_mask(bitmap_heap_descriptor_t *heap,
+    unsigned long index, int bit)
 {
-    if(heap->block_bits == 0 || heap->block_bits > (8 * sizeof(*heap->bitmap)))
-    {
-        return -1;
-    }
-    else if(heap->block_size == 0)
+    unsigned long bits = bit == BIT_AVAIL ? TREE_BITS(heap) : BLOCK_BITS(heap);
+    return 1UL << (bits * (index % (WORD_BITS / bits) + 1) - 1 - bit);
+}
+
+/*
+ * Sets bit `index` in the heap's bitmap, marking the underlying block as
+ * available.
+ */
+static inline void set_bit(bitmap_heap_descriptor_t *heap, unsigned long index, int bit)
+{
+    if(bit < BLOCK_BITS(heap))
     {
-        return -1;
+        or_word(heap, state_word(heap, index, bit), state_mask(heap, index, bit));
+        if(bit == BIT_AVAIL)
+        {
+            update_summary(heap, index / BLOCKS_IN_WORD(heap));
+        }
     }
-    else if((1 << llog2(heap->block_bits)) != heap->block_bits)
+}
+
+/*
+ * Clears bit `index` in the heap's bitmap, marking the underlying block as
+ * reserved.
+ */
+static inline void clear_bit(bitmap_heap_descriptor_t *heap, unsigned long index, int bit)
+{
+    if(bit < BLOCK_BITS(heap))
     {
-        return -1;
+        and_not_word(heap, state_word(heap, index, bit), state_mask(heap, index, bit));
+        if(bit == BIT_AVAIL)
+        {
+            update_summary(heap, index / BLOCKS_IN_WORD(heap));
+        }
+    }
+}
+
+/*
+ * Tests whether the block at bit `index` is available. If so, returns nonzero,
+ * else returns 0.
+ */
+static inline int test_bit(bitmap_heap_descriptor_t *heap, unsigned long index, int bit)
+{
+    if(bit > (BLOCK_BITS(heap) - 1))
+    {
+        return 1;
+    }
+    return (load_word(state_word(heap, index, bit)) & state_mask(heap, index, bit)) != 0;
+}
+
+/*
+ * Sets bit `index` and its buddy in the heap's bitmap, marking the underlying
+ * blocks as available. Operation is used while spltting a block to reserve one
+ * of its child blocks.
+ */
+static inline void set_pair(bitmap_heap_descriptor_t *heap, unsigned long index, int bit)
+{
+    if(bit < BLOCK_BITS(heap))
+    {
+        unsigned long mask = state_mask(heap, index, bit) | state_mask(heap, index ^ 1, bit);
+        or_word(heap, state_word(heap, index, bit), mask);
+        if(bit == BIT_AVAIL)
+        {
+            update_summary(heap, index / BLOCKS_IN_WORD(heap));
+        }
+    } 
+}
+
+/*
+ * Clears bit `index` and its buddy in the heap's bitmap, marking the underlying
+ * blocks as reserved. Used when merging two child blocks into a single parent 
+ * block.
+ */
+static inline void clear_pair(bitmap_heap_descriptor_t *heap, unsigned long index, int bit)
+{
+    if(bit < BLOCK_BITS(heap))
+    {
+        unsigned long mask = state_mask(heap, index, bit) | state_mask(heap, index ^ 1, bit);
+        and_not_word(heap, state_word(heap, index, bit), mask);
+        if(bit == BIT_AVAIL)
+        {
+            update_summary(heap, index / BLOCKS_IN_WORD(heap));
+        }
+    }
+}
+
+/*
+ * Sets bit `bit` of `count` consecutive blocks starting at `index`, one word
+ * of the bitmap at a time. Must not be used for the availability bit.
+ */
+static inline void set_bit_range(bitmap_heap_descriptor_t *heap,
+    unsigned long index, unsigned long count, int bit)
+{
+    if(bit >= BLOCK_BITS(heap))
+    {
+        return;
+    }
+
+    unsigned long blocks_in_word = WORD_BITS / BLOCK_BITS(heap);
+    unsigned long end = index + count;
+    while(index < end)
+    {
+        unsigned long bitmap_index = index / blocks_in_word;
+        unsigned long first = index % blocks_in_word;
+        unsigned long last = end - bitmap_index * blocks_in_word;
+        unsigned long range = ~((1UL << (BLOCK_BITS(heap) * first)) - 1);
+        if(last < blocks_in_word)
+        {
+            range &= (1UL << (BLOCK_BITS(heap) * last)) - 1;
+        }
+        else
+        {
+            last = blocks_in_word;
+        }
+        METADATA(heap)[bitmap_index] |= (FIELD_MASK(BLOCK_BITS(heap)) & range) >> bit;
+        index += last - first;
+    }
+}
+
+/*
+ * Computes the location in the cache that `index` would be stored at, if it
+ * were cached.
+ */
+static inline int cache_location_from_index(bitmap_heap_descriptor_t *heap, unsigned long index)
+{
+    return llog2(index + 1) - llog2(BLOCKS_IN_WORD(heap)) - 1;
+}
+
+/*
+ * Computes the location in the cache that blocks at the indicated height are
+ * cached at.
+ */
+static inline int cache_location_from_height(bitmap_heap_descriptor_t *heap, int height)
+{
+    return heap->height - height - llog2(BLOCKS_IN_WORD(heap));
+}
+
+/*
+ * Returns a pointer to the stack of cached indices for the cache level `level`,
+ * or NULL if that level does not fit in the cache. The first element of each
+ * stack holds the number of indices stored in it.
+ * 
+ * The cache is not used in concurrent mode. It would be a point of contention
+ * shared by every thread, and the summary index already bounds the cost of a
+ * search.
+ */
+static inline unsigned long *cache_stack(bitmap_heap_descriptor_t *heap, int level)
+{
+    if(heap->cache == (unsigned long*)0 || heap->concurrent || level < 0
+        || (level + 1) * (heap->cache_depth + 1) > heap->cache_capacity)
+    {
+        return (unsigned long*)0;
+    }
+    return &heap->cache[level * (heap->cache_depth + 1)];
+}
+
+/*
+ * Pops cached indices for the desired height until one is found which is
+ * still available, and returns it. Entries are not removed when the blocks
+ * they refer to are merged or reserved by other means, so stale entries are
+ * discarded here instead. Returns 0 if no available block was cached.
+ */
+static inline unsigned long check_cache(bitmap_heap_descriptor_t *heap, int height)
+{
+    unsigned long *stack = cache_stack(heap, cache_location_from_height(heap, height));
+    if(stack == (unsigned long*)0)
+    {
+        return 0;
+    }
+
+    while(stack[0] > 0)
+    {
+        unsigned long index = stack[stack[0]];
+        stack[0]--;
+        if(test_bit(heap, index, BIT_AVAIL))
+        {
+            heap->cache_hits++;
+            return index;
+        }
+    }
+    heap->cache_misses++;
+    return 0;
+}
+
+/*
+ * If space in the cache exists, pushes the provided index onto the stack for
+ * its level. Returns nonzero if the index was stored.
+ */
+static inline int store_cache(bitmap_heap_descriptor_t *heap, unsigned long index)
+{
+    unsigned long *stack = cache_stack(heap, cache_location_from_index(heap, index));
+    if(stack != (unsigned long*)0 && stack[0] < heap->cache_depth)
+    {
+        stack[0]++;
+        stack[stack[0]] = index;
+        return 1;
+    }
+    return 0;
+}
+
+/*
+ * Stores as many of the available blocks in `avail_mask`, which was read from
+ * word `word` of the bitmap, as there is space for in the cache. Those with
+ * the lowest indices are kept, and are pushed last so that they are popped
+ * first.
+ */
+static inline void refill_cache(bitmap_heap_descriptor_t *heap,
+    unsigned long word, unsigned long avail_mask)
+{
+    if(avail_mask == 0)
+    {
+        return;
+    }
+
+    unsigned long *stack = cache_stack(heap, 
+        cache_location_from_index(heap, BLOCKS_IN_WORD(heap) * word));
+    if(stack == (unsigned long*)0)
+    {
+        return;
+    }
+
+    unsigned long keep = 0;
+    for(unsigned long i = stack[0]; i < heap->cache_depth && avail_mask; i++)
+    {
+        keep |= avail_mask & -avail_mask;
+        avail_mask &= avail_mask - 1;
+    }
+
+    while(keep != 0)
+    {
+        int bit = WORD_BITS - 1 - __builtin_clzl(keep);
+        keep &= ~(1UL << bit);
+        stack[0]++;
+        stack[stack[0]] = BLOCKS_IN_WORD(heap) * word + bit / TREE_BITS(heap);
+    }
+}
+
+/*
+ * Computes the bitmap index of the block at `location` and `height`.
+ */
+static inline unsigned long block_index(bitmap_heap_descriptor_t *heap,
+    unsigned long location, unsigned long height)
+{
+    return (location / (BLOCK_SIZE(heap) * ((unsigned long)1 << height))) + (1UL << (heap->height - height));
+}
+
+/*
+ * Returns the depth of the roots of the sections a heap is built in, or 0 if
+ * the whole heap is built at once. Sections span at least a whole word at the
+ * lowest level of the tree, so that the words holding their lower levels are
+ * not shared with other sections.
+ */
+static int section_depth(const bitmap_heap_descriptor_t *heap)
+{
+    if(heap->section_size == 0)
+    {
+        return 0;
+    }
+
+    int height = llog2(heap->section_size / BLOCK_SIZE(heap));
+    if(height < ilog2(BLOCKS_IN_WORD(heap)))
+    {
+        height = ilog2(BLOCKS_IN_WORD(heap));
+    }
+    return height < heap->height ? heap->height - height : 0;
+}
+
+/*
+ * Computes the size in bytes of each section of the heap.
+ */
+static inline unsigned long section_bytes(const bitmap_heap_descriptor_t *heap)
+{
+    return BLOCK_SIZE(heap) << (heap->height - section_depth(heap));
+}
+
+/*
+ * Returns the slot in the directory of a sparse heap of the last section
+ * starting at or below `location`, which is relative to the heap's offset, or
+ * ~0 if every section starts above it.
+ */
+static unsigned long section_slot(const bitmap_heap_descriptor_t *heap,
+    unsigned long location)
+{
+    unsigned long low = 0;
+    unsigned long high = heap->directory_size;
+    while(low < high)
+    {
+        unsigned long middle = low + (high - low) / 2;
+        if(heap->directory[middle] <= location)
+        {
+            low = middle + 1;
+        }
+        else
+        {
+            high = middle;
+        }
+    }
+    return low - 1;
+}
+
+/*
+ * Converts `location` to an offset into the memory covered by the tree. In a
+ * sparse heap the tree covers only the sections in the directory, one after
+ * another. Returns NOMEM if `location` lies in a hole between sections.
+ */
+static unsigned long tree_offset(const bitmap_heap_descriptor_t *heap,
+    unsigned long location)
+{
+    location -= heap->offset;
+    if(heap->directory == (unsigned long*)0)
+    {
+        return location;
+    }
+
+    unsigned long slot = section_slot(heap, location);
+    unsigned long size = section_bytes(heap);
+    if(slot == ~0UL || location - heap->directory[slot] >= size)
+    {
+        return NOMEM;
+    }
+    return slot * size + location - heap->directory[slot];
+}
+
+/*
+ * Computes the location of the block at `index` and `height`
+ */
+static inline unsigned long block_location(bitmap_heap_descriptor_t *heap,
+    unsigned long index, int height)
+{
+    unsigned long offset = (BLOCK_SIZE(heap) << height) 
+        * (index - ((unsigned long)1 << (heap->height - height)));
+    if(heap->directory != (unsigned long*)0)
+    {
+        unsigned long size = section_bytes(heap);
+        offset = heap->directory[offset / size] + offset % size;
+    }
+    return heap->offset + offset;
+}
+
+/*
+ * Writes `value` to the owner table entries of every leaf beneath the block
+ * at `index` and `height`. Does nothing if the heap has no owner table.
+ */
+static void record_owner(bitmap_heap_descriptor_t *heap, unsigned long index,
+    int height, unsigned char value)
+{
+    if(heap->owners == (unsigned char*)0)
+    {
+        return;
+    }
+
+    unsigned char *entry = heap->owners + (index << height) - (1UL << heap->height);
+    for(unsigned long i = 0; i < (1UL << height); i++)
+    {
+        entry[i] = value;
+    }
+}
+
+/*
+ * Computes the height of the blocks which make up one group of `pack_size`
+ * bytes, which is no more than the height of the tree.
+ */
+static inline int pack_height(const bitmap_heap_descriptor_t *heap)
+{
+    int height = llog2((heap->pack_size + BLOCK_SIZE(heap) - 1) / BLOCK_SIZE(heap));
+    return height < (int)heap->height ? height : (int)heap->height;
+}
+
+/*
+ * Marks the end of a list of groups in the pack table.
+ */
+#define PACK_NIL (~0UL)
+
+/*
+ * The parts of the pack table. The free block count of each group comes
+ * first, followed by the links of the lists of groups with each count, the
+ * head of each list, a bitmap of the counts whose lists are not empty, and a
+ * summary of that bitmap with one bit for each of its words. Finding the
+ * fullest group with room then takes a few word scans, however many groups
+ * there are.
+ */
+typedef struct pack_table_t
+{
+    unsigned long *counts;
+    unsigned long *next;
+    unsigned long *prev;
+    unsigned long *heads;
+    unsigned long *bits;
+    unsigned long *summary;
+    unsigned long groups;
+    unsigned long values;
+} pack_table_t;
+
+/*
+ * Computes the number of words in a pack table over `groups` groups of
+ * 2^`group_height` blocks each.
+ */
+static inline unsigned long pack_table_words(unsigned long groups, int group_height)
+{
+    unsigned long values = (1UL << group_height) + 1;
+    unsigned long bit_words = (values + WORD_BITS - 1) / WORD_BITS;
+    return 3 * groups + values + bit_words + (bit_words + WORD_BITS - 1) / WORD_BITS;
+}
+
+static inline pack_table_t pack_table(const bitmap_heap_descriptor_t *heap)
+{
+    int group_height = pack_height(heap);
+    pack_table_t table;
+    table.groups = 1UL << (heap->height - group_height);
+    table.values = (1UL << group_height) + 1;
+    table.counts = heap->pack_counts;
+    table.next = table.counts + table.groups;
+    table.prev = table.next + table.groups;
+    table.heads = table.prev + table.groups;
+    table.bits = table.heads + table.values;
+    table.summary = table.bits + (table.values + WORD_BITS - 1) / WORD_BITS;
+    return table;
+}
+
+/*
+ * Puts `group` at the front of the list of groups with its count.
+ */
+static void link_pack_group(pack_table_t *table, unsigned long group)
+{
+    unsigned long count = table->counts[group];
+    unsigned long first = table->heads[count];
+    table->next[group] = first;
+    table->prev[group] = PACK_NIL;
+    if(first != PACK_NIL)
+    {
+        table->prev[first] = group;
+    }
+    table->heads[count] = group;
+    table->bits[count / WORD_BITS] |= 1UL << (count % WORD_BITS);
+    table->summary[count / WORD_BITS / WORD_BITS] |= 1UL << (count / WORD_BITS % WORD_BITS);
+}
+
+/*
+ * Takes `group` off the list of groups with its count.
+ */
+static void unlink_pack_group(pack_table_t *table, unsigned long group)
+{
+    unsigned long count = table->counts[group];
+    unsigned long next = table->next[group];
+    unsigned long prev = table->prev[group];
+    if(prev == PACK_NIL)
+    {
+        table->heads[count] = next;
+    }
+    else
+    {
+        table->next[prev] = next;
+    }
+    if(next != PACK_NIL)
+    {
+        table->prev[next] = prev;
+    }
+    if(table->heads[count] == PACK_NIL)
+    {
+        unsigned long *word = &table->bits[count / WORD_BITS];
+        *word &= ~(1UL << (count % WORD_BITS));
+        if(*word == 0)
+        {
+            table->summary[count / WORD_BITS / WORD_BITS] &= ~(1UL << (count / WORD_BITS % WORD_BITS));
+        }
+    }
+}
+
+/*
+ * Finds the smallest count of at least `from` which some group has, using
+ * the summary to skip over empty words of the bitmap. Returns PACK_NIL if
+ * there is none.
+ */
+static unsigned long next_pack_count(const pack_table_t *table, unsigned long from)
+{
+    unsigned long bit_words = (table->values + WORD_BITS - 1) / WORD_BITS;
+    unsigned long word = from / WORD_BITS;
+    if(word >= bit_words)
+    {
+        return PACK_NIL;
+    }
+    unsigned long bits = table->bits[word] & (~0UL << (from % WORD_BITS));
+    if(bits == 0)
+    {
+        if(++word >= bit_words)
+        {
+            return PACK_NIL;
+        }
+        unsigned long summary_word = word / WORD_BITS;
+        unsigned long summary = table->summary[summary_word] & (~0UL << (word % WORD_BITS));
+        while(summary == 0)
+        {
+            if(++summary_word > (bit_words - 1) / WORD_BITS)
+            {
+                return PACK_NIL;
+            }
+            summary = table->summary[summary_word];
+        }
+        word = summary_word * WORD_BITS + __builtin_ctzl(summary);
+        bits = table->bits[word];
+    }
+    return word * WORD_BITS + __builtin_ctzl(bits);
+}
+
+/*
+ * Sets up the pack table with every group empty.
+ */
+static void clear_pack_table(bitmap_heap_descriptor_t *heap)
+{
+    pack_table_t table = pack_table(heap);
+    unsigned long bit_words = (table.values + WORD_BITS - 1) / WORD_BITS;
+    for(unsigned long i = 0; i < table.values; i++)
+    {
+        table.heads[i] = PACK_NIL;
+    }
+    for(unsigned long i = 0; i < bit_words + (bit_words + WORD_BITS - 1) / WORD_BITS; i++)
+    {
+        table.bits[i] = 0;
+    }
+    for(unsigned long group = table.groups; group-- > 0;)
+    {
+        table.counts[group] = 0;
+        link_pack_group(&table, group);
+    }
+}
+
+/*
+ * Adds `count` leaves, starting with leaf `leaf`, to the free block counts of
+ * the groups holding them if `freed` is nonzero, or removes them otherwise,
+ * moving each group to the list of its new count. Does nothing if the heap is
+ * not packing its reservations.
+ */
+static void count_pack_leaves(bitmap_heap_descriptor_t *heap, unsigned long leaf,
+    unsigned long count, int freed)
+{
+    if(heap->pack_counts == (unsigned long*)0)
+    {
+        return;
+    }
+
+    int height = pack_height(heap);
+    pack_table_t table = pack_table(heap);
+    while(count > 0)
+    {
+        unsigned long group = leaf >> height;
+        unsigned long n = ((group + 1) << height) - leaf;
+        n = n < count ? n : count;
+        unlink_pack_group(&table, group);
+        table.counts[group] += freed ? n : -n;
+        link_pack_group(&table, group);
+        leaf += n;
+        count -= n;
+    }
+}
+
+/*
+ * Finds the reserved block containing `location`, which is relative to the
+ * heap's offset. The tree is searched upward from the block at `*height`
+ * until a block marked as used is found. With an owner table this takes a
+ * single lookup instead, unless `sized` is nonzero, meaning `*height` is the
+ * height the caller expects the reservation to have, as when freeing a region
+ * of a given size. If the heap keeps a used bit, the block there is then
+ * tested before the table is read, so a region freed with its own size is
+ * found without reading the table.
+ * Returns the index of the block and stores its height in `height`, or
+ * returns 0 if no reserved block was found.
+ */
+static unsigned long find_owner(bitmap_heap_descriptor_t *heap, unsigned long location,
+    int *height, int sized)
+{
+    unsigned long index = block_index(heap, location, *height);
+    if(heap->owners != (unsigned char*)0
+        && !(sized && BLOCK_BITS(heap) > BIT_USED && test_bit(heap, index, BIT_USED)))
+    {
+        int owner_height = heap->owners[location / BLOCK_SIZE(heap)] - 1;
+        if(owner_height < 0)
+        {
+            return 0;
+        }
+        *height = owner_height;
+        return block_index(heap, location, owner_height);
+    }
+
+    while(index && !test_bit(heap, index, BIT_USED))
+    {
+        index /= 2;
+        (*height)++;
+    }
+    return index;
+}
+
+/*
+ * Marks the indicated block as unavailable, and marks its children as both
+ * available. Stores the right-hand child in the cache, and returns the index
+ * of the left-hand child. The caller is expected to either split or allocate
+ * the left-hand child.
+ */
+static inline unsigned long split_block(bitmap_heap_descriptor_t *heap, unsigned long index)
+{
+    if(index)
+    {
+        clear_bit(heap, index, BIT_AVAIL);
+        index *= 2;
+        set_pair(heap, index, BIT_AVAIL);
+        store_cache(heap, index + 1);
+    }
+    return index;
+}
+
+/*
+ * If the buddy of the indicated block is marked as available, marks the 
+ * indicated block and its buddy as unavailable, and marks their parent
+ * as available. If the buddy of the indicated block is cached, the entry
+ * becomes stale and is discarded the next time it is popped.
+ * 
+ * If the buddy of the indicated block is marked as unavailable, this function 
+ * does nothing. The block indicated by `index` is assumed to be available.
+ */
+static unsigned long merge_block(bitmap_heap_descriptor_t *heap, unsigned long index)
+{
+    while(index > 1 && test_bit(heap, index ^ 1, BIT_AVAIL))
+    {
+        clear_pair(heap, index, BIT_AVAIL);
+        index /= 2;
+        set_bit(heap, index, BIT_AVAIL);
+    }
+    return index;
+}
+
+/*
+ * Computes a mask of the availability bits of the even-numbered blocks in a
+ * word, which are the left-hand halves of each pair of buddies.
+ */
+static unsigned long even_mask(bitmap_heap_descriptor_t *heap)
+{
+    unsigned long mask = 0;
+    for(unsigned long i = 0; i < BLOCKS_IN_WORD(heap); i += 2)
+    {
+        mask |= 1UL << (TREE_BITS(heap) * (i + 1) - 1);
+    }
+    return mask;
+}
+
+/*
+ * Merges every pair of available buddies in word `word` of the bitmap, which
+ * must lie below the levels packed into word 0, and marks their parents as
+ * available with a single write to the parent word. Returns nonzero if any
+ * pair was merged. The summary index is not updated.
+ */
+static int merge_word(bitmap_heap_descriptor_t *heap, unsigned long word,
+    unsigned long even_mask)
+{
+    unsigned long avail_mask = heap->bitmap[word] & AVAIL_MASK(heap);
+    unsigned long parent_half = AVAIL_MASK(heap) & (word % 2 
+        ? ~((1UL << (WORD_BITS / 2)) - 1) 
+        : (1UL << (WORD_BITS / 2)) - 1);
+    if(avail_mask == AVAIL_MASK(heap))
+    {
+        // Every block is available, so every parent in this half becomes so
+        heap->bitmap[word] &= ~AVAIL_MASK(heap);
+        heap->bitmap[word / 2] |= parent_half;
+        return 1;
+    }
+
+    unsigned long pairs = avail_mask & (avail_mask >> TREE_BITS(heap)) & even_mask;
+    if(pairs == 0)
+    {
+        return 0;
+    }
+
+    unsigned long parents = 0;
+    unsigned long parent_base = (word % 2) * (BLOCKS_IN_WORD(heap) / 2);
+    heap->bitmap[word] &= ~(pairs | (pairs << TREE_BITS(heap)));
+    while(pairs != 0)
+    {
+        unsigned long offset = (__builtin_ctzl(pairs) + 1) / TREE_BITS(heap) - 1;
+        unsigned long parent = parent_base + offset / 2;
+        parents |= 1UL << (TREE_BITS(heap) * (parent + 1) - 1);
+        pairs &= pairs - 1;
+    }
+    heap->bitmap[word / 2] |= parents;
+    return 1;
+}
+
+/*
+ * Finds the index of the first available block at `height` without splitting
+ * larger blocks or consulting the cache. Returns 0 if there is none.
+ */
+static unsigned long locate_free_region(bitmap_heap_descriptor_t *heap, int height)
+{
+    if (height <= heap->height - ilog2(BLOCKS_IN_WORD(heap)))
+    {
+        unsigned long start = (1UL << (heap->height - height)) / BLOCKS_IN_WORD(heap);
+        unsigned long end = ((1UL << (heap->height - height + 1)) / BLOCKS_IN_WORD(heap));
+        unsigned long index;
+        while ((index = summary_find(heap, start, end)) < end)
+        {
+            unsigned long avail_mask = load_word(&heap->bitmap[index]) & AVAIL_MASK(heap);
+            if (avail_mask != 0)
+            {
+                return BLOCKS_IN_WORD(heap) * index + (__builtin_ctzl(avail_mask) / TREE_BITS(heap));
+            }
+            start = index + 1;
+        }
+    }
+    else
+    {
+#if __SIZEOF_LONG__ == 8
+        static const unsigned long bitmasks[] = {0x00000002, 0x0000000C, 0x000000F0, 0x0000FF00, 0xFFFF0000, 0xFFFFFFFF00000000};
+#else
+        static const unsigned long bitmasks[] = {0x00000002, 0x0000000C, 0x000000F0, 0x0000FF00, 0xFFFF0000};
+#endif
+        int bitmask_index = heap->height - height + llog2(TREE_BITS(heap));
+        unsigned long avail_mask = load_word(&heap->bitmap[0]) & bitmasks[bitmask_index] & AVAIL_MASK(heap);
+        if (avail_mask)
+        {
+            return __builtin_ctzl(avail_mask) / TREE_BITS(heap);
+        }
+    }
+    return 0;
+}
+
+/*
+ * Finds the index of the first available block at `height`. If no such block
+ * is available, recursively searches higher blocks and splits them until an
+ * appropriate block is available. Returns 0 if no available blocks of sufficient
+ * size exist.
+ */
+static unsigned long find_free_region(bitmap_heap_descriptor_t *heap, int height)
+{
+    if (height > heap->height || height < 0)
+    {
+        return 0;
+    }
+
+    unsigned long index = check_cache(heap, height);
+    if(index)
+    {
+        return index;
+    }
+
+    index = locate_free_region(heap, height);
+    if(index)
+    {
+        unsigned long word = index / BLOCKS_IN_WORD(heap);
+        if(word > 0)
+        {
+            unsigned long avail_mask = heap->bitmap[word] & AVAIL_MASK(heap);
+            refill_cache(heap, word, avail_mask & (avail_mask - 1));
+        }
+        return index;
+    }
+    return split_block(heap, find_free_region(heap, height + 1));
+}
+
+/*
+ * Atomically marks the block at `index` as unavailable, provided it is still
+ * available. Returns nonzero if this thread claimed the block.
+ */
+static int claim_block(bitmap_heap_descriptor_t *heap, unsigned long index)
+{
+    unsigned long word = index / BLOCKS_IN_WORD(heap);
+    unsigned long avail = 1UL << (TREE_BITS(heap) * (index % BLOCKS_IN_WORD(heap) + 1) - 1);
+    unsigned long old = load_word(&heap->bitmap[word]);
+    do
+    {
+        if(!(old & avail))
+        {
+            return 0;
+        }
+    } while(!__atomic_compare_exchange_n(&heap->bitmap[word], &old, old & ~avail,
+        1, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED));
+    update_summary(heap, word);
+    return 1;
+}
+
+/*
+ * Concurrent counterpart of find_free_region. Each candidate block is claimed
+ * with a compare-and-swap, and searched for again if another thread claims it
+ * first. If there is no block available at `height`, a larger one is claimed
+ * and split, keeping the left-hand child and making the right-hand child
+ * available. Returns the claimed block, which is marked as neither available
+ * nor used, or 0 if there is not enough memory.
+ */
+static unsigned long claim_free_region(bitmap_heap_descriptor_t *heap, int height)
+{
+    if (height > heap->height || height < 0)
+    {
+        return 0;
+    }
+
+    unsigned long index;
+    while((index = locate_free_region(heap, height)) != 0)
+    {
+        if(claim_block(heap, index))
+        {
+            return index;
+        }
+    }
+
+    index = claim_free_region(heap, height + 1);
+    if(index)
+    {
+        index *= 2;
+        set_bit(heap, index + 1, BIT_AVAIL);
+    }
+    return index;
+}
+
+/*
+ * Concurrent counterpart of marking a block as available and calling
+ * merge_block. At each level a single compare-and-swap on the word holding the
+ * block and its buddy either claims the buddy, merging the two, or marks the
+ * block as available. Since both outcomes are decided on the same word, two
+ * buddies freed at the same time are always merged by one of the threads
+ * freeing them. The used bit of the original block is cleared by the first
+ * compare-and-swap, or beforehand if it is kept in `metadata`. Returns the
+ * index of the resulting block.
+ */
+static unsigned long release_block(bitmap_heap_descriptor_t *heap, unsigned long index)
+{
+    unsigned long used = BLOCK_BITS(heap) > BIT_USED && !SPLIT_METADATA(heap);
+    if(SPLIT_METADATA(heap))
+    {
+        clear_bit(heap, index, BIT_USED);
+    }
+    while(1)
+    {
+        unsigned long word = index / BLOCKS_IN_WORD(heap);
+        unsigned long avail = 1UL << (TREE_BITS(heap) * (index % BLOCKS_IN_WORD(heap) + 1) - 1);
+        unsigned long buddy = index > 1 
+            ? 1UL << (TREE_BITS(heap) * ((index ^ 1) % BLOCKS_IN_WORD(heap) + 1) - 1) 
+            : 0;
+        unsigned long used_bit = used ? avail >> BIT_USED : 0;
+        unsigned long old = load_word(&heap->bitmap[word]);
+        unsigned long new;
+        do
+        {
+            new = (old & buddy) ? old & ~(buddy | used_bit) : (old & ~used_bit) | avail;
+        } while(!__atomic_compare_exchange_n(&heap->bitmap[word], &old, new,
+            1, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED));
+        update_summary(heap, word);
+
+        if(!(old & buddy))
+        {
+            return index;
+        }
+        index /= 2;
+        used = 0;
+    }
+}
+
+/*
+ * Marks the leaves in [first, last) as mapped, using the fewest blocks whose
+ * subtrees exactly cover them.
+ */
+static void mark_run(bitmap_heap_descriptor_t *heap, unsigned long first, unsigned long last)
+{
+    while(first < last)
+    {
+        if(first & 1)
+        {
+            set_bit(heap, first++, BIT_MAPPED);
+        }
+        if(last & 1)
+        {
+            set_bit(heap, --last, BIT_MAPPED);
+        }
+        first /= 2;
+        last /= 2;
+    }
+}
+
+/*
+ * Maps the leaves in [first, last) with a single call to the heap's `mmap`
+ * callback, and marks them as mapped if the call succeeds. Returns the
+ * callback's status.
+ */
+static int map_run(bitmap_heap_descriptor_t *heap, unsigned long first, unsigned long last)
+{
+    if(first == last)
+    {
+        return 0;
+    }
+    int status = heap->mmap((void*)block_location(heap, first, 0),
+        (last - first) * BLOCK_SIZE(heap));
+    if(!status)
+    {
+        mark_run(heap, first, last);
+        if(heap->unmap)
+        {
+            heap->dirty_block_count += last - first;
+        }
+    }
+    return status;
+}
+
+/*
+ * Extends the run of unmapped leaves [*first, *last) through the subtree at
+ * `index`, mapping the run and starting a new one whenever a mapped block
+ * interrupts it.
+ */
+static int map_subtree(bitmap_heap_descriptor_t *heap, unsigned long index, int height,
+    unsigned long *first, unsigned long *last)
+{
+    if(test_bit(heap, index, BIT_MAPPED))
+    {
+        int status = map_run(heap, *first, *last);
+        *first = *last = (index + 1) << height;
+        return status;
+    }
+    else if(height == 0)
+    {
+        (*last)++;
+        return 0;
+    }
+    int status = map_subtree(heap, index * 2, height - 1, first, last);
+    if(!status)
+    {
+        status = map_subtree(heap, (index * 2) + 1, height - 1, first, last);
+    }
+    return status;
+}
+
+/*
+ * Makes sure the block at `index` is mapped, calling the heap's `mmap`
+ * callback once for each maximal run of unmapped leaves beneath it. A block is
+ * mapped if it or any block containing it is marked. If a callback fails,
+ * the runs mapped before it stay marked and nothing else is, so the bitmap
+ * still matches what has actually been mapped.
+ */
+static int map_region(bitmap_heap_descriptor_t *heap, unsigned long index, int height)
+{
+    int status = 0;
+    unsigned long ancestor = index;
+    while(ancestor > 0 && !test_bit(heap, ancestor, BIT_MAPPED))
+    {
+        ancestor /= 2;
+    }
+    if(ancestor == 0)
+    {
+        unsigned long first = index << height;
+        unsigned long last = first;
+        status = map_subtree(heap, index, height, &first, &last);
+        if(!status)
+        {
+            status = map_run(heap, first, last);
+        }
+    }
+
+    if(!status && heap->unmap)
+    {
+        heap->dirty_block_count -= 1UL << height;
+    }
+    return status;
+}
+
+/*
+ * Unmaps the leaves in [first, last) with a single call to the heap's `unmap`
+ * callback. If the call fails, the leaves are marked as mapped again.
+ */
+static int unmap_run(bitmap_heap_descriptor_t *heap, unsigned long first, unsigned long last)
+{
+    if(first == last)
+    {
+        return 0;
+    }
+    int status = heap->unmap((void*)block_location(heap, first, 0),
+        (last - first) * BLOCK_SIZE(heap));
+    if(status)
+    {
+        mark_run(heap, first, last);
+    }
+    else
+    {
+        heap->dirty_block_count -= last - first;
+    }
+    return status;
+}
+
+/*
+ * Extends the run of mapped leaves [*first, *last) through the subtree at
+ * `index`, clearing the marks it passes, and unmaps the run whenever an
+ * unmapped leaf interrupts it.
+ */
+static int unmap_subtree(bitmap_heap_descriptor_t *heap, unsigned long index, int height,
+    unsigned long *first, unsigned long *last)
+{
+    if(test_bit(heap, index, BIT_MAPPED))
+    {
+        int status = 0;
+        if(*last != index << height)
+        {
+            status = unmap_run(heap, *first, *last);
+            *first = index << height;
+        }
+        if(!status)
+        {
+            clear_bit(heap, index, BIT_MAPPED);
+            *last = (index + 1) << height;
+        }
+        return status;
+    }
+    else if(height == 0)
+    {
+        return 0;
+    }
+    int status = unmap_subtree(heap, index * 2, height - 1, first, last);
+    if(!status)
+    {
+        status = unmap_subtree(heap, (index * 2) + 1, height - 1, first, last);
+    }
+    return status;
+}
+
+/*
+ * Unmaps every mapped leaf beneath the free block at `index`, calling the
+ * heap's `unmap` callback once for each maximal run. If a block containing
+ * this one is marked, its mark is first moved down to the blocks beside the
+ * path to this one.
+ */
+static int unmap_region(bitmap_heap_descriptor_t *heap, unsigned long index, int height)
+{
+    unsigned long ancestor = index / 2;
+    while(ancestor > 0 && !test_bit(heap, ancestor, BIT_MAPPED))
+    {
+        ancestor /= 2;
+    }
+    if(ancestor > 0)
+    {
+        clear_bit(heap, ancestor, BIT_MAPPED);
+        for(unsigned long i = index; i > ancestor; i /= 2)
+        {
+            set_bit(heap, i ^ 1, BIT_MAPPED);
+        }
+        set_bit(heap, index, BIT_MAPPED);
+    }
+
+    unsigned long first = index << height;
+    unsigned long last = first;
+    int status = unmap_subtree(heap, index, height, &first, &last);
+    return status ? status : unmap_run(heap, first, last);
+}
+
+/*
+ * Unmaps the free block at `index`, which has just been merged with its
+ * buddies, if the heap's high- and low-water marks call for it.
+ */
+static void trim_block(bitmap_heap_descriptor_t *heap, unsigned long index)
+{
+    int height = heap->height - (llog2(index + 1) - 1);
+    if(heap->dirty_block_count >= heap->unmap_high)
+    {
+        heap->unmapping = 1;
+    }
+    if(heap->unmapping && height >= heap->unmap_height)
+    {
+        unmap_region(heap, index, height);
+    }
+    if(heap->dirty_block_count <= heap->unmap_low)
+    {
+        heap->unmapping = 0;
+    }
+}
+
+static unsigned long compute_memory_size(const memory_map_t *map)
+{
+    // Find the last available region in the memory map.
+    int map_index = map->size - 1;
+    while(map->array[map_index].type != M_AVAILABLE)
+    {
+        map_index--;
+    }
+
+    return map->array[map_index].location + map->array[map_index].size;
+}
+
+/*
+ * Rounds `section_size` up to a power of two times `block_size`.
+ */
+static unsigned long sparse_section_bytes(unsigned long block_size,
+    unsigned long section_size)
+{
+    return block_size << llog2((section_size + block_size - 1) / block_size);
+}
+
+/*
+ * Finds each section of `section_bytes` bytes which contains at least one
+ * whole available block in `map`, and writes the locations of the first
+ * `capacity` of them to `directory`, if it is not NULL. Returns the number of
+ * such sections.
+ */
+static unsigned long find_sections(const memory_map_t *map,
+    unsigned long block_size, unsigned long section_bytes,
+    unsigned long *directory, unsigned long capacity)
+{
+    unsigned long count = 0;
+    unsigned long last = ~0UL;
+    for(int i = 0; i < map->size; i++)
+    {
+        if(map->array[i].type != M_AVAILABLE)
+        {
+            continue;
+        }
+
+        unsigned long location = (map->array[i].location + block_size - 1);
+        location -= location % block_size;
+        unsigned long region_end = map->array[i].location + map->array[i].size;
+        while(location < region_end && location + block_size <= region_end)
+        {
+            unsigned long base = location - location % section_bytes;
+            if(base != last)
+            {
+                if(directory && count < capacity)
+                {
+                    directory[count] = base;
+                }
+                count++;
+                last = base;
+            }
+            location = base + section_bytes;
+        }
+    }
+    return count;
+}
+
+#ifndef BITMAP_ALLOC_NAME
+/*
+ * Computes the amount of memory covered by the tree of a heap built from
+ * `map`. For a sparse heap, this is the total size of the sections which hold
+ * available memory, rounded up to a power of two.
+ */
+static unsigned long tree_memory_size(const memory_map_t *map,
+    unsigned long block_size, unsigned long section_size)
+{
+    if(section_size == 0)
+    {
+        return compute_memory_size(map);
+    }
+
+    unsigned long section_bytes = sparse_section_bytes(block_size, section_size);
+    return section_bytes << llog2(find_sections(map, block_size, section_bytes, (unsigned long*)0, 0));
+}
+#endif
+
+static unsigned long generate_mask(unsigned long block_bits)
+{
+    unsigned long blocks_in_word = 8 * sizeof(unsigned long) / block_bits;
+    unsigned long mask = 0;
+    for(unsigned long i = 1; i <= blocks_in_word; i++)
+    {
+        mask |= 1UL << (i * block_bits - 1UL);
+    }
+    return mask;
+}
+
+static int construct_heap_desc(bitmap_heap_descriptor_t *heap, const memory_map_t *map)
+{
+    if(heap->block_bits == 0 || heap->block_bits > (8 * sizeof(*heap->bitmap)))
+    {
+        return -1;
+    }
+    else if(heap->block_size == 0)
+    {
+        return -1;
+    }
+    else if((1 << llog2(heap->block_bits)) != heap->block_bits)
+    {
+        return -1;
+    }
+    else if(heap->block_bits != BLOCK_BITS(heap) || heap->block_size != BLOCK_SIZE(heap)
+        || (heap->metadata != (unsigned long*)0) != SPLIT_METADATA(heap))
+    {
+        // This variant was compiled for a different block geometry
+        return -1;
+    }
+    else if(heap->concurrent && TREE_BITS(heap) > 4 * sizeof(*heap->bitmap))
+    {
+        // Buddies must share a word to be merged with one compare-and-swap
+        return -1;
+    }
+    else if(heap->unmap && (!heap->mmap || BLOCK_BITS(heap) <= BIT_MAPPED || heap->concurrent))
+    {
+        // Unmapped blocks must be tracked to be mapped again
+        return -1;
+    }
+    else if(heap->pack_counts && (heap->pack_size == 0 || heap->concurrent))
+    {
+        return -1;
+    }
+    else if(heap->colors && ((heap->colors & (heap->colors - 1)) || heap->concurrent))
+    {
+        return -1;
+    }
+
+    if(heap->cache_depth == 0)
+    {
+        heap->cache_depth = 1;
     }
 
     unsigned long memory_size = compute_memory_size(map);
-    heap->blocks_in_word = 8 * sizeof(*heap->bitmap) / heap->block_bits;
-    heap->bitmap_size = heap->block_bits * (memory_size / heap->block_size) / 4;
-    heap->bitmap_size = 1 << llog2(heap->bitmap_size);
-    heap->height = llog2(memory_size / heap->block_size);
+    heap->blocks_in_word = 8 * sizeof(*heap->bitmap) / TREE_BITS(heap);
+    if(heap->directory != (unsigned long*)0)
+    {
+        unsigned long section_size = sparse_section_bytes(BLOCK_SIZE(heap), heap->section_size);
+        if(heap->section_size == 0 || section_size < BLOCKS_IN_WORD(heap) * BLOCK_SIZE(heap)
+            || section_size < heap->colors * BLOCK_SIZE(heap))
+        {
+            return -1;
+        }
+
+        heap->directory_size = find_sections(map, BLOCK_SIZE(heap), section_size,
+            heap->directory, heap->directory_capacity);
+        if(heap->directory_size == 0 || heap->directory_size > heap->directory_capacity)
+        {
+            return -1;
+        }
+        memory_size = section_size << llog2(heap->directory_size);
+    }
+    heap->bitmap_size = TREE_BITS(heap) * (memory_size / BLOCK_SIZE(heap)) / 4;
+    heap->bitmap_size = 1UL << llog2(heap->bitmap_size);
+    heap->height = llog2(memory_size / BLOCK_SIZE(heap));
     heap->free_block_count = 0;
-    heap->mask = generate_mask(heap->block_bits);
+    heap->dirty_block_count = 0;
+    heap->unmapping = 0;
+    heap->pack_group = 0;
+    heap->mask = generate_mask(TREE_BITS(heap));
+
+    if(heap->bitmap_size <= sizeof(*heap->bitmap))
+    {
+        return -1;
+    }
+    else if(heap->bitmap_size >= memory_size && heap->bitmap == (unsigned long*)0)
+    {
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Clears the words of `words`, which holds `blocks_in_word` blocks per word,
+ * holding the levels of the subtree under `root`, at `depth`, which are not
+ * shared with other subtrees.
+ */
+static void clear_subtree(bitmap_heap_descriptor_t *heap, unsigned long *words,
+    unsigned long blocks_in_word, unsigned long root, int depth)
+{
+    for(int level = depth + ilog2(blocks_in_word); level <= heap->height; level++)
+    {
+        unsigned long word = (root << (level - depth)) / blocks_in_word;
+        unsigned long end = ((root + 1) << (level - depth)) / blocks_in_word;
+        for(; word < end; word++)
+        {
+            words[word] = 0;
+        }
+    }
+}
+
+/*
+ * Marks every block in `map` which lies within [start, end) as available at
+ * the lowest level of the tree, and adds them to the heap's free block count.
+ * The block at `start` is the one at offset `tree_start` into the memory
+ * covered by the tree.
+ */
+static void fill_leaves(bitmap_heap_descriptor_t *heap, const memory_map_t *map,
+    unsigned long start, unsigned long end, unsigned long tree_start)
+{
+    for(int i = 0; i < map->size; i++)
+    {
+        if(map->array[i].type != M_AVAILABLE)
+        {
+            continue;
+        }
+
+        unsigned long location = (map->array[i].location + BLOCK_SIZE(heap) - 1);
+        location -= location % BLOCK_SIZE(heap);
+        unsigned long region_end = map->array[i].location + map->array[i].size;
+        if(location < start)
+        {
+            location = start;
+        }
+        if(region_end > end)
+        {
+            region_end = end;
+        }
+
+        while(location + BLOCK_SIZE(heap) <= region_end)
+        {
+            unsigned long leaf = (location - start + tree_start) / BLOCK_SIZE(heap);
+            unsigned long free_blocks = heap->free_block_count;
+            int bit_offset = leaf % BLOCKS_IN_WORD(heap);
+            unsigned long bitmap_index = ((1UL << (heap->height - 0)) / BLOCKS_IN_WORD(heap)) + leaf / BLOCKS_IN_WORD(heap);
+            unsigned long chunk_size = (BLOCKS_IN_WORD(heap) - bit_offset) * BLOCK_SIZE(heap);
+            if(bit_offset == 0 && (region_end - location) >= chunk_size)
+            {
+                // Set all bits in the word
+                heap->bitmap[bitmap_index] = AVAIL_MASK(heap) & ~0;
+                heap->free_block_count += BLOCKS_IN_WORD(heap);
+            }
+            else if(bit_offset == 0)
+            {
+                // Set the first 'count' bits
+                int count = (region_end - location) / BLOCK_SIZE(heap);
+                heap->bitmap[bitmap_index] |= AVAIL_MASK(heap) & ((1UL << (TREE_BITS(heap) * count)) - 1);
+                heap->free_block_count += count;
+            }
+            else if((region_end - location) >= chunk_size)
+            {
+                // Set all bits starting at 'bit_offset'
+                heap->bitmap[bitmap_index] |= AVAIL_MASK(heap) & ~((1UL << (TREE_BITS(heap) * bit_offset)) - 1);
+                heap->free_block_count += BLOCKS_IN_WORD(heap) - bit_offset;
+            }
+            else
+            {
+                // Set all bits starting at 'bit_offset' up to 'count'
+                int count = bit_offset + (region_end - location) / BLOCK_SIZE(heap);
+                heap->bitmap[bitmap_index] |= AVAIL_MASK(heap) & ((1UL << (TREE_BITS(heap) * count)) - 1) & ~((1UL << (TREE_BITS(heap) * bit_offset)) - 1);
+                heap->free_block_count += count - bit_offset;
+            }
+            count_pack_leaves(heap, leaf, heap->free_block_count - free_blocks, 1);
+            location += chunk_size;
+        }
+    }
+}
+
+/*
+ * Merges available buddies throughout the subtree under `root`, at `depth`,
+ * once its lowest level has been filled in. The levels held in words of their
+ * own are merged a whole level at a time from the bottom up, skipping runs of
+ * words with no available blocks using the heap's word scanner. The levels
+ * which share words with other subtrees are merged block by block, which also
+ * merges the root with its buddy and beyond where possible.
+ */
+static void merge_levels(bitmap_heap_descriptor_t *heap, unsigned long root,
+    int depth)
+{
+    if(BLOCKS_IN_WORD(heap) < 2)
+    {
+        return;
+    }
+
+    scan_func_t scan = scan_funcs[heap->scan];
+    unsigned long pairs_mask = even_mask(heap);
+    int shared = ilog2(BLOCKS_IN_WORD(heap));
+    for(int level = heap->height; level >= depth + shared; level--)
+    {
+        unsigned long word = (root << (level - depth)) / BLOCKS_IN_WORD(heap);
+        unsigned long end = ((root + 1) << (level - depth)) / BLOCKS_IN_WORD(heap);
+        for(; word < end; word++)
+        {
+            if(!(heap->bitmap[word] & AVAIL_MASK(heap)))
+            {
+                word += scan(heap->bitmap + word, end - word, AVAIL_MASK(heap));
+                if(word == end)
+                {
+                    break;
+                }
+            }
+            merge_word(heap, word, pairs_mask);
+        }
+    }
+
+    for(int level = shared - 1; level >= 0; level--)
+    {
+        for(unsigned long index = (root + 1) << level; index > (root << level); index--)
+        {
+            if(test_bit(heap, index - 1, BIT_AVAIL))
+            {
+                merge_block(heap, index - 1);
+            }
+        }
+    }
+}
+
+/*
+ * Builds the summary index over the subtree under `root`, at `depth`, after
+ * it has been filled in, skipping over runs of empty words using the heap's
+ * word scanner.
+ */
+static void build_summary(bitmap_heap_descriptor_t *heap, unsigned long root,
+    int depth)
+{
+    scan_func_t scan = scan_funcs[heap->scan];
+    int shared = ilog2(BLOCKS_IN_WORD(heap));
+    for(int level = 0; level < shared; level++)
+    {
+        update_summary(heap, (root << level) / BLOCKS_IN_WORD(heap));
+    }
+
+    for(int level = depth + shared; level <= heap->height; level++)
+    {
+        unsigned long word = (root << (level - depth)) / BLOCKS_IN_WORD(heap);
+        unsigned long end = ((root + 1) << (level - depth)) / BLOCKS_IN_WORD(heap);
+        for(; word < end; word++)
+        {
+            if(!(heap->bitmap[word] & AVAIL_MASK(heap)))
+            {
+                word += scan(heap->bitmap + word, end - word, AVAIL_MASK(heap));
+                if(word == end)
+                {
+                    break;
+                }
+            }
+            update_summary(heap, word);
+        }
+    }
+}
+
+/*
+ * Builds the next section of a heap which is built in sections. The section's
+ * words are cleared and filled in from the memory map, and its free blocks
+ * are merged with the rest of the tree as they would be when freed. Returns
+ * nonzero if a section was built.
+ */
+static int build_section(bitmap_heap_descriptor_t *heap)
+{
+    int depth = section_depth(heap);
+    unsigned long sections = heap->directory ? heap->directory_size : (1UL << depth);
+    if(depth == 0 || heap->next_section >= sections)
+    {
+        return 0;
+    }
+
+    unsigned long root = (1UL << depth) + heap->next_section;
+    unsigned long size = section_bytes(heap);
+    unsigned long start = heap->directory 
+        ? heap->directory[heap->next_section] 
+        : heap->next_section * size;
+    clear_subtree(heap, heap->bitmap, BLOCKS_IN_WORD(heap), root, depth);
+    if(SPLIT_METADATA(heap))
+    {
+        clear_subtree(heap, heap->metadata, WORD_BITS / BLOCK_BITS(heap), root, depth);
+    }
+    fill_leaves(heap, heap->section_map, start, start + size, heap->next_section * size);
+    merge_levels(heap, root, depth);
+    build_summary(heap, root, depth);
+    record_owner(heap, root, heap->height - depth, 0);
+    heap->next_section++;
+    return 1;
+}
+
+/*
+ * Builds the heap's bitmap from the memory map. If the heap is built in
+ * sections, only the words shared between sections and the first section are
+ * built.
+ */
+static void initialize_bitmap(bitmap_heap_descriptor_t *heap, const memory_map_t *map)
+{
+    int depth = section_depth(heap);
+    heap->section_map = map;
+    heap->next_section = 0;
+    if(depth == 0)
+    {
+        clear_bitmap(heap);
+        if(heap->directory)
+        {
+            fill_leaves(heap, map, heap->directory[0],
+                heap->directory[0] + section_bytes(heap), 0);
+        }
+        else
+        {
+            fill_leaves(heap, map, 0, ~0UL, 0);
+        }
+        merge_levels(heap, 1, 0);
+        build_summary(heap, 1, 0);
+        record_owner(heap, 1, heap->height, 0);
+        return;
+    }
+
+    // The levels shared between sections fill the first 2^depth words
+    unsigned long words = heap->bitmap_size / sizeof(*heap->bitmap);
+    for(unsigned long i = 0; i < (1UL << depth); i++)
+    {
+        heap->bitmap[i] = 0;
+        METADATA(heap)[i] = 0;
+    }
+    for(unsigned long i = 0; i < summary_words(words); i++)
+    {
+        heap->summary[i] = 0;
+    }
+    build_section(heap);
+}
+
+unsigned long PUBLIC(initialize_section)(bitmap_heap_descriptor_t *heap)
+{
+    build_section(heap);
+    int depth = section_depth(heap);
+    unsigned long sections = heap->directory ? heap->directory_size : (1UL << depth);
+    return depth == 0 ? 0 : sections - heap->next_section;
+}
+
+unsigned long PUBLIC(read_bit)(bitmap_heap_descriptor_t *heap, unsigned long location,
+    unsigned long bit)
+{
+    int height = 0;
+    unsigned long offset = tree_offset(heap, location);
+    unsigned long index = offset == NOMEM ? 0 : find_owner(heap, offset, &height, 0);
+    if(index)
+    {
+        return test_bit(heap, index, bit);
+    }
+    else
+    {
+        return 1;
+    }
+}
+
+int PUBLIC(write_bit)(bitmap_heap_descriptor_t *heap, unsigned long location,
+    unsigned long bit, int value)
+{
+    int height = 0;
+    unsigned long offset = tree_offset(heap, location);
+    unsigned long index = offset == NOMEM ? 0 : find_owner(heap, offset, &height, 0);
+    if(index && value)
+    {
+        set_bit(heap, index, bit);
+        return value;
+    }
+    else if(index)
+    {
+        clear_bit(heap, index, bit);
+        return value;
+    }
+    else
+    {
+        return 1;
+    }
+}
+
+/*
+ * Calls `visit` on each reserved block overlapping the `size` bytes at
+ * `location`, and returns the sum of its results.
+ */
+static unsigned long visit_owners(bitmap_heap_descriptor_t *heap,
+    unsigned long location, unsigned long size, unsigned long bit, int value,
+    unsigned long (*visit)(bitmap_heap_descriptor_t*, unsigned long, unsigned long, int))
+{
+    unsigned long end = location - heap->offset + size;
+    unsigned long result = 0;
+    location -= heap->offset;
+
+    // Nothing can be reserved in sections which have not been built
+    unsigned long built = section_depth(heap) > 0 
+        ? heap->next_section * section_bytes(heap) 
+        : ~0UL;
+    while(location < end)
+    {
+        unsigned long offset = tree_offset(heap, location + heap->offset);
+        if(offset == NOMEM)
+        {
+            // Skip the hole up to the next section
+            unsigned long slot = section_slot(heap, location) + 1;
+            if(slot >= heap->directory_size)
+            {
+                break;
+            }
+            location = heap->directory[slot];
+            continue;
+        }
+        else if(offset >= built)
+        {
+            break;
+        }
+
+        int height = 0;
+        unsigned long index = find_owner(heap, offset, &height, 0);
+        if(index)
+        {
+            result += visit(heap, index, bit, value);
+            location = block_location(heap, index, height) - heap->offset
+                + (BLOCK_SIZE(heap) << height);
+        }
+        else
+        {
+            location = (location / BLOCK_SIZE(heap) + 1) * BLOCK_SIZE(heap);
+        }
+    }
+    return result;
+}
+
+/*
+ * Counts the block at `index` if its bit `bit` equals `value`.
+ */
+static unsigned long count_bit(bitmap_heap_descriptor_t *heap, unsigned long index,
+    unsigned long bit, int value)
+{
+    return (test_bit(heap, index, bit) != 0) == value;
+}
+
+static unsigned long assign_bit(bitmap_heap_descriptor_t *heap, unsigned long index,
+    unsigned long bit, int value)
+{
+    if(value)
+    {
+        set_bit(heap, index, bit);
+    }
+    else
+    {
+        clear_bit(heap, index, bit);
+    }
+    return 1;
+}
+
+unsigned long PUBLIC(read_bit_range)(bitmap_heap_descriptor_t *heap,
+    unsigned long location, unsigned long size, unsigned long bit)
+{
+    if(bit >= BLOCK_BITS(heap))
+    {
+        return 0;
+    }
+    return visit_owners(heap, location, size, bit, 1, count_bit);
+}
+
+unsigned long PUBLIC(write_bit_range)(bitmap_heap_descriptor_t *heap,
+    unsigned long location, unsigned long size, unsigned long bit, int value)
+{
+    if(bit >= BLOCK_BITS(heap))
+    {
+        return 0;
+    }
+    return visit_owners(heap, location, size, bit, value, assign_bit);
+}
+
+/*
+ * Gives the reserved block at `index` and `height` back to the heap.
+ */
+static void return_block(bitmap_heap_descriptor_t *heap, unsigned long index, int height)
+{
+    record_owner(heap, index, height, 0);
+    count_pack_leaves(heap, (index << height) - (1UL << heap->height), 1UL << height, 1);
+    if(heap->concurrent)
+    {
+        release_block(heap, index);
+    }
+    else
+    {
+        set_bit(heap, index, BIT_AVAIL);
+        clear_bit(heap, index, BIT_USED);
+        index = merge_block(heap, index);
+        store_cache(heap, index);
+        if(heap->unmap)
+        {
+            trim_block(heap, index);
+        }
+    }
+    add_free_blocks(heap, 1UL << height);
+}
+
+/*
+ * Reserves the block at `index` and `height`, which has been found or claimed
+ * for the caller, and maps it. Returns its location, or NOMEM if it could not
+ * be mapped.
+ */
+static unsigned long take_block(bitmap_heap_descriptor_t *heap, unsigned long index, int height)
+{
+    if(!heap->concurrent)
+    {
+        clear_bit(heap, index, BIT_AVAIL);
+    }
+    set_bit(heap, index, BIT_USED);
+    record_owner(heap, index, height, height + 1);
+    count_pack_leaves(heap, (index << height) - (1UL << heap->height), 1UL << height, 0);
+    add_free_blocks(heap, -(1UL << height));
+    if(heap->mmap && map_region(heap, index, height))
+    {
+        return_block(heap, index, height);
+        return NOMEM;
+    }
+    return block_location(heap, index, height);
+}
+
+/*
+ * Converts `location` to the offset into the memory covered by the tree of the
+ * first byte at or above it which the tree covers.
+ */
+static unsigned long tree_offset_above(const bitmap_heap_descriptor_t *heap,
+    unsigned long location)
+{
+    unsigned long memory_size = BLOCK_SIZE(heap) << heap->height;
+    if(location < heap->offset)
+    {
+        return 0;
+    }
+    location -= heap->offset;
+    if(heap->directory == (unsigned long*)0)
+    {
+        return location < memory_size ? location : memory_size;
+    }
+
+    unsigned long slot = section_slot(heap, location);
+    unsigned long size = section_bytes(heap);
+    if(slot == ~0UL)
+    {
+        return 0;
+    }
+    else if(location - heap->directory[slot] >= size)
+    {
+        // Within the hole after this section
+        return (slot + 1) * size;
+    }
+    return slot * size + location - heap->directory[slot];
+}
+
+/*
+ * Finds the first available block with an index in [first, last), all of
+ * which must be at the same height, skipping empty words with the summary
+ * index. Returns 0 if there is none.
+ */
+static unsigned long find_avail_between(bitmap_heap_descriptor_t *heap,
+    unsigned long first, unsigned long last)
+{
+    unsigned long end = (last + BLOCKS_IN_WORD(heap) - 1) / BLOCKS_IN_WORD(heap);
+    unsigned long word = first / BLOCKS_IN_WORD(heap);
+    while((word = summary_find(heap, word, end)) < end)
+    {
+        unsigned long base = word * BLOCKS_IN_WORD(heap);
+        unsigned long low = first > base ? first - base : 0;
+        unsigned long high = last - base < BLOCKS_IN_WORD(heap) ? last - base : BLOCKS_IN_WORD(heap);
+        unsigned long range = (~0UL << (TREE_BITS(heap) * low))
+            & (~0UL >> (WORD_BITS - TREE_BITS(heap) * high));
+        unsigned long avail_mask = load_word(&heap->bitmap[word]) & AVAIL_MASK(heap) & range;
+        if(avail_mask)
+        {
+            return base + __builtin_ctzl(avail_mask) / TREE_BITS(heap);
+        }
+        word++;
+    }
+    return 0;
+}
+
+/*
+ * Finds an available block at `height` or above containing a block at
+ * `height` which lies within the tree offsets [low, high), and writes the
+ * index of that smaller block to `target`. Blocks lying wholly within the
+ * window are found with a scan of each level between its ends; only the two
+ * blocks straddling the ends are considered on their own. Blocks at lower
+ * heights are preferred. Returns 0 if there is none.
+ */
+static unsigned long find_in_window(bitmap_heap_descriptor_t *heap, int height,
+    unsigned long low, unsigned long high, unsigned long *target)
+{
+    unsigned long target_size = BLOCK_SIZE(heap) << height;
+    unsigned long first = (low + target_size - 1) / target_size;
+    if(first >= high / target_size)
+    {
+        return 0;
+    }
+
+    for(int level = height; level <= (int)heap->height; level++)
+    {
+        unsigned long size = BLOCK_SIZE(heap) << level;
+        unsigned long base = 1UL << (heap->height - level);
+        unsigned long index = find_avail_between(heap, base + (low + size - 1) / size,
+            base + high / size);
+        if(index)
+        {
+            *target = (index - base) << (level - height);
+            return index;
+        }
+
+        // A block straddling either end may still hold a whole target block
+        unsigned long ends[2] = {low / size, (high - 1) / size};
+        for(int i = 0; i < 2 && level > height; i++)
+        {
+            unsigned long start = ends[i] * size;
+            unsigned long offset = first * target_size > start ? first * target_size : start;
+            unsigned long end = start + size < high ? start + size : high;
+            if(offset + target_size <= end && test_bit(heap, base + ends[i], BIT_AVAIL))
+            {
+                *target = offset / target_size;
+                return base + ends[i];
+            }
+        }
+    }
+    return 0;
+}
+
+/*
+ * Finds a block at `height` within the tree offsets [low, high) and splits
+ * the blocks above it. The result is left in the same state as one returned
+ * by find_free_region, or by claim_free_region in concurrent mode. Returns 0
+ * if there is no such block.
+ */
+static unsigned long find_region_in_window(bitmap_heap_descriptor_t *heap, int height,
+    unsigned long low, unsigned long high)
+{
+    unsigned long target;
+    unsigned long index;
+    do
+    {
+        index = find_in_window(heap, height, low, high, &target);
+    } while(index && heap->concurrent && !claim_block(heap, index));
+    if(!index)
+    {
+        return 0;
+    }
+
+    target += 1UL << (heap->height - height);
+    int level = heap->height - (llog2(index + 1) - 1);
+    for(; level > height; level--)
+    {
+        unsigned long child = target >> (level - 1 - height);
+        if(heap->concurrent)
+        {
+            set_bit(heap, child ^ 1, BIT_AVAIL);
+        }
+        else
+        {
+            clear_bit(heap, index, BIT_AVAIL);
+            set_pair(heap, child, BIT_AVAIL);
+            store_cache(heap, child ^ 1);
+        }
+        index = child;
+    }
+    return index;
+}
+
+unsigned long PUBLIC(reserve_region_in_range)(bitmap_heap_descriptor_t *heap, unsigned long size,
+    unsigned long min_addr, unsigned long max_addr)
+{
+    int height = llog2((size - 1) / BLOCK_SIZE(heap) + 1);
+    if(height > (int)heap->height
+        || (heap->directory && height > heap->height - section_depth(heap)))
+    {
+        return NOMEM;
+    }
+
+    unsigned long low = tree_offset_above(heap, min_addr);
+    unsigned long high = tree_offset_above(heap, max_addr);
+    unsigned long index;
+    while(!(index = find_region_in_window(heap, height, low, high))
+        && !heap->concurrent && build_section(heap));
+    return index ? take_block(heap, index, height) : NOMEM;
+}
+
+/*
+ * Finds the partly used group with the fewest free blocks, among those with
+ * at least 2^`height` free blocks which come after group `after` - 1 in order
+ * of their counts and then of their lists, or after none if `after` is 0.
+ * Returns one more than the number of the group, or 0 if there is none.
+ */
+static unsigned long find_fullest_group(bitmap_heap_descriptor_t *heap, int height,
+    unsigned long after)
+{
+    pack_table_t table = pack_table(heap);
+    unsigned long from = 1UL << height;
+    if(after)
+    {
+        if(table.next[after - 1] != PACK_NIL)
+        {
+            return table.next[after - 1] + 1;
+        }
+        from = table.counts[after - 1] + 1;
+    }
+
+    // Wholly free groups have a count of values - 1, and are kept whole
+    unsigned long count = next_pack_count(&table, from);
+    return count < table.values - 1 ? table.heads[count] + 1 : 0;
+}
+
+/*
+ * The number of groups tried in turn when the group being packed into has no
+ * room. A group may have enough free blocks but none at the height wanted.
+ */
+#define PACK_ATTEMPTS 4
+
+/*
+ * Finds a block at `height` within a partly used group of `pack_size` bytes,
+ * trying the group the last block was packed into first, and then the fullest
+ * groups which may have room. The blocks above it are split as by
+ * find_free_region. Returns 0 if the heap is not packing its reservations, if
+ * such blocks are as large as a group, or if none was found.
+ */
+static unsigned long find_packed_region(bitmap_heap_descriptor_t *heap, int height)
+{
+    int group_height = pack_height(heap);
+    if(heap->pack_counts == (unsigned long*)0 || height >= group_height)
+    {
+        return 0;
+    }
+
+    unsigned long group_size = BLOCK_SIZE(heap) << group_height;
+    unsigned long group = heap->pack_group;
+    if(group && heap->pack_counts[group - 1] >= (1UL << group_height))
+    {
+        // The group has since been freed entirely, and should be kept whole
+        group = 0;
+    }
+    for(int i = 0; i <= PACK_ATTEMPTS; i++)
+    {
+        if(group)
+        {
+            unsigned long index = find_region_in_window(heap, height,
+                (group - 1) * group_size, group * group_size);
+            if(index)
+            {
+                heap->pack_group = group;
+                return index;
+            }
+        }
+        group = find_fullest_group(heap, height, i == 0 ? 0 : group);
+        if(!group)
+        {
+            break;
+        }
+    }
+    return 0;
+}
+
+unsigned long PUBLIC(reserve_region)(bitmap_heap_descriptor_t *heap, unsigned long size)
+{
+    int height = llog2((size - 1) / BLOCK_SIZE(heap) + 1);
+    unsigned long index;
+    if(heap->directory && height > heap->height - section_depth(heap))
+    {
+        // Blocks larger than a section may span a hole
+        return NOMEM;
+    }
+    else if(heap->concurrent)
+    {
+        index = claim_free_region(heap, height);
+    }
+    else
+    {
+        // Build further sections of the heap only once the rest is exhausted
+        while(!(index = find_packed_region(heap, height))
+            && !(index = find_free_region(heap, height)) && build_section(heap));
+    }
+
+    return index ? take_block(heap, index, height) : NOMEM;
+}
+
+/*
+ * Finds the index of the first available block at `height` whose first leaf
+ * lies at a tree offset equal to `color` modulo the number of colors, ignoring
+ * the colors below its height. Only every `stride`th block of the level has
+ * that color, so in each word they are picked out with a mask, and when fewer
+ * than one in a word has it, only every few words are read. Returns 0 if there
+ * is none.
+ */
+static unsigned long locate_colored_region(bitmap_heap_descriptor_t *heap, int height,
+    unsigned long color)
+{
+    unsigned long first = 1UL << (heap->height - height);
+    unsigned long stride = (heap->colors >> height) ? heap->colors >> height : 1;
+    unsigned long residue = (color >> height) & (stride - 1);
+    if(first < BLOCKS_IN_WORD(heap))
+    {
+        for(unsigned long block = residue; block < first; block += stride)
+        {
+            if(test_bit(heap, first + block, BIT_AVAIL))
+            {
+                return first + block;
+            }
+        }
+        return 0;
+    }
+
+    unsigned long start = first / BLOCKS_IN_WORD(heap);
+    unsigned long end = 2 * first / BLOCKS_IN_WORD(heap);
+    if(stride > BLOCKS_IN_WORD(heap))
+    {
+        unsigned long offset = residue % BLOCKS_IN_WORD(heap);
+        unsigned long bit = 1UL << (TREE_BITS(heap) * (offset + 1) - 1);
+        for(unsigned long word = start + residue / BLOCKS_IN_WORD(heap); word < end;
+            word += stride / BLOCKS_IN_WORD(heap))
+        {
+            // Words left empty, or not yet built, are skipped by the summary
+            if(summary_find(heap, word, word + 1) == word
+                && (load_word(&heap->bitmap[word]) & bit))
+            {
+                return BLOCKS_IN_WORD(heap) * word + offset;
+            }
+        }
+        return 0;
+    }
+
+    unsigned long pattern = 0;
+    for(unsigned long offset = residue; offset < BLOCKS_IN_WORD(heap); offset += stride)
+    {
+        pattern |= 1UL << (TREE_BITS(heap) * (offset + 1) - 1);
+    }
+    unsigned long word;
+    while((word = summary_find(heap, start, end)) < end)
+    {
+        unsigned long avail_mask = load_word(&heap->bitmap[word]) & pattern;
+        if(avail_mask != 0)
+        {
+            return BLOCKS_IN_WORD(heap) * word + (__builtin_ctzl(avail_mask) / TREE_BITS(heap));
+        }
+        start = word + 1;
+    }
+    return 0;
+}
+
+/*
+ * Splits the available block `index`, at `level`, down to its block at
+ * `height` whose first leaf lies at a tree offset equal to `color` modulo the
+ * number of colors, as far as its offset allows. The result is left in the
+ * same state as one returned by find_free_region.
+ */
+static unsigned long split_to_color(bitmap_heap_descriptor_t *heap, unsigned long index,
+    int level, int height, unsigned long color)
+{
+    for(; level > height; level--)
+    {
+        // Take the child starting at the color, if the children differ in it
+        unsigned long child = 2 * index;
+        if((1UL << (level - 1)) < heap->colors && ((color >> (level - 1)) & 1))
+        {
+            child++;
+        }
+        clear_bit(heap, index, BIT_AVAIL);
+        set_pair(heap, child, BIT_AVAIL);
+        store_cache(heap, child ^ 1);
+        index = child;
+    }
+    return index;
+}
+
+/*
+ * Finds a block at `height` whose first leaf lies at a tree offset equal to
+ * `color` modulo the number of colors, splitting the smallest block which
+ * holds one. The result is left in the same state as one returned by
+ * find_free_region. Returns 0 if there is none.
+ */
+static unsigned long find_colored_region(bitmap_heap_descriptor_t *heap, int height,
+    unsigned long color)
+{
+    int level = height;
+    unsigned long index = 0;
+    for(; level <= (int)heap->height && !index; level++)
+    {
+        index = locate_colored_region(heap, level, color);
+    }
+    return index ? split_to_color(heap, index, level - 1, height, color) : 0;
+}
+
+/*
+ * Finds a block as find_colored_region does, looking only at the section
+ * built last and at the blocks above it, which are the only ones its free
+ * blocks can have been merged into. The blocks of the section which have the
+ * color are tested one by one, so this takes time in proportion to the size
+ * of the section rather than of the heap.
+ */
+static unsigned long find_colored_in_section(bitmap_heap_descriptor_t *heap,
+    int height, unsigned long color)
+{
+    int top = heap->height - section_depth(heap);
+    unsigned long root = (1UL << section_depth(heap)) + heap->next_section - 1;
+    for(int level = height; level <= (int)heap->height; level++)
+    {
+        unsigned long first = 1UL << (heap->height - level);
+        unsigned long stride = (heap->colors >> level) ? heap->colors >> level : 1;
+        unsigned long residue = (color >> level) & (stride - 1);
+        unsigned long low = level <= top ? root << (top - level) : root >> (level - top);
+        unsigned long high = level <= top ? (root + 1) << (top - level) : low + 1;
+        for(unsigned long index = low + ((residue - (low - first)) & (stride - 1));
+            index < high; index += stride)
+        {
+            if(test_bit(heap, index, BIT_AVAIL))
+            {
+                return split_to_color(heap, index, level, height, color);
+            }
+        }
+    }
+    return 0;
+}
+
+unsigned long PUBLIC(reserve_region_colored)(bitmap_heap_descriptor_t *heap, unsigned long size,
+    unsigned long *color)
+{
+    int height = llog2((size - 1) / BLOCK_SIZE(heap) + 1);
+    if((1UL << height) >= heap->colors || height > (int)heap->height
+        || (heap->directory && height > heap->height - section_depth(heap)))
+    {
+        return PUBLIC(reserve_region)(heap, size);
+    }
+
+    // Colors are given by location, and found by offset into the tree
+    unsigned long target = (*color - heap->offset / BLOCK_SIZE(heap)) & (heap->colors - 1);
+    unsigned long index = find_colored_region(heap, height, target);
+    while(!index && build_section(heap))
+    {
+        index = find_colored_in_section(heap, height, target);
+    }
+    unsigned long location = index ? take_block(heap, index, height)
+        : PUBLIC(reserve_region)(heap, size);
+    if(location != NOMEM)
+    {
+        *color = (location / BLOCK_SIZE(heap) + (1UL << height)) & (heap->colors - 1);
+    }
+    return location;
+}
+
+/*
+ * Reserves every available block at `height` in word `word` of the bitmap,
+ * up to `count` of them, with a single update to the word. Writes their
+ * indices to `out` and returns how many were reserved.
+ */
+static unsigned long reserve_from_word(bitmap_heap_descriptor_t *heap,
+    unsigned long word, unsigned long count, unsigned long *out)
+{
+    unsigned long avail_mask = heap->bitmap[word] & AVAIL_MASK(heap);
+    unsigned long taken = avail_mask;
+    if(__builtin_popcountl(avail_mask) > count)
+    {
+        taken = 0;
+        for(unsigned long i = 0; i < count; i++)
+        {
+            taken |= avail_mask & -avail_mask;
+            avail_mask &= avail_mask - 1;
+        }
+    }
+
+    heap->bitmap[word] &= ~taken;
+    if(BLOCK_BITS(heap) > BIT_USED && !SPLIT_METADATA(heap))
+    {
+        heap->bitmap[word] |= taken >> BIT_USED;
+    }
+    update_summary(heap, word);
+
+    unsigned long n = 0;
+    while(taken != 0)
+    {
+        out[n] = BLOCKS_IN_WORD(heap) * word + __builtin_ctzl(taken) / TREE_BITS(heap);
+        if(SPLIT_METADATA(heap))
+        {
+            set_bit(heap, out[n], BIT_USED);
+        }
+        n++;
+        taken &= taken - 1;
+    }
+    return n;
+}
+
+/*
+ * Reserves a free block at `height + levels` and all 2^`levels` of its
+ * descendants at `height`, without splitting it one level at a time. Since a
+ * free block's descendants are all marked as neither available nor used, the
+ * levels in between are already in the state they would be left in after
+ * splitting the block and reserving every child. Writes the indices of the
+ * reserved blocks to `out` and returns how many were reserved.
+ */
+static unsigned long reserve_subtree(bitmap_heap_descriptor_t *heap,
+    int height, int levels, unsigned long *out)
+{
+    unsigned long index = find_free_region(heap, height + levels);
+    if(!index)
+    {
+        return 0;
+    }
 
-    if(heap->bitmap_size <= sizeof(*heap->bitmap))
+    clear_bit(heap, index, BIT_AVAIL);
+    unsigned long first = index << levels;
+    unsigned long count = 1UL << levels;
+    if(levels == 0)
     {
-        return -1;
+        set_bit(heap, index, BIT_USED);
     }
-    else if(heap->bitmap_size >= memory_size && heap->bitmap == (unsigned long*)0)
+    else
     {
-        return -1;
+        set_bit_range(heap, first, count, BIT_USED);
     }
-    return 0;
+
+    for(unsigned long i = 0; i < count; i++)
+    {
+        out[i] = first + i;
+    }
+    return count;
 }
 
-static void initialize_bitmap(bitmap_heap_descriptor_t *heap, const memory_map_t *map)
+unsigned long PUBLIC(reserve_region_batch)(bitmap_heap_descriptor_t *heap,
+    unsigned long size, unsigned long count, unsigned long *out)
 {
-    clear_bitmap(heap);
-    for(int i = 0; i < map->size; i++)
+    int height = llog2((size - 1) / BLOCK_SIZE(heap) + 1);
+    if(height > heap->height)
     {
-        if(map->array[i].type != M_AVAILABLE)
+        return 0;
+    }
+    else if(heap->directory && height > heap->height - section_depth(heap))
+    {
+        return 0;
+    }
+    else if(heap->concurrent || heap->pack_counts)
+    {
+        unsigned long n = 0;
+        while(n < count && (out[n] = PUBLIC(reserve_region)(heap, size)) != NOMEM)
         {
-            continue;
+            n++;
         }
+        return n;
+    }
 
-        unsigned long location = (map->array[i].location + heap->block_size - 1);
-        location -= location % heap->block_size;
-        unsigned long region_end = map->array[i].location + map->array[i].size;
-
-        while(location + heap->block_size <= region_end)
+    int word_levels = height <= heap->height - ilog2(BLOCKS_IN_WORD(heap));
+    unsigned long start = word_levels 
+        ? ((1UL << (heap->height - height)) / BLOCKS_IN_WORD(heap)) : 0;
+    unsigned long end = word_levels 
+        ? ((1UL << (heap->height - height + 1)) / BLOCKS_IN_WORD(heap)) : 0;
+    unsigned long n = 0;
+    while(n < count)
+    {
+        // Take whole words of free blocks at this height first
+        unsigned long reserved = 0;
+        unsigned long word = word_levels ? summary_find(heap, start, end) : end;
+        if(word < end)
         {
-            int bit_offset = (location / heap->block_size) % heap->blocks_in_word;
-            int bitmap_index = ((1UL << (heap->height - 0)) / heap->blocks_in_word) + (location / heap->block_size) / heap->blocks_in_word;
-            unsigned long chunk_size = (heap->blocks_in_word - bit_offset) * heap->block_size;
-            if(bit_offset == 0 && (region_end - location) >= chunk_size)
-            {
-                // Set all bits in the word
-                heap->bitmap[bitmap_index] = heap->mask & ~0;
-                heap->free_block_count += heap->blocks_in_word;
-            }
-            else if(bit_offset == 0)
-            {
-                // Set the first 'count' bits
-                int count = (region_end - location) / heap->block_size;
-                heap->bitmap[bitmap_index] |= heap->mask & ((1UL << (heap->block_bits * count)) - 1);
-                heap->free_block_count += count;
-            }
-            else if((region_end - location) >= chunk_size)
+            reserved = reserve_from_word(heap, word, count - n, out + n);
+            start = word;
+        }
+        else
+        {
+            // Otherwise claim the largest block the rest of the request fills
+            int levels = llog2(count - n + 1) - 1;
+            if(levels > heap->height - height)
             {
-                // Set all bits starting at 'bit_offset'
-                heap->bitmap[bitmap_index] |= heap->mask & ~((1UL << (heap->block_bits * bit_offset)) - 1);
-                heap->free_block_count += heap->blocks_in_word - bit_offset;
+                levels = heap->height - height;
             }
-            else
+            for(; levels >= 0 && reserved == 0; levels--)
             {
-                // Set all bits starting at 'bit_offset' up to 'count'
-                int count = (region_end - location) / heap->block_size;
-                heap->bitmap[bitmap_index] |= heap->mask & ((1UL << (heap->block_bits * count)) - 1) & ~((1UL << (heap->block_bits * bit_offset)) - 1);
-                heap->free_block_count += count - bit_offset;
+                reserved = reserve_subtree(heap, height, levels, out + n);
             }
+        }
+
+        if(reserved == 0 && build_section(heap))
+        {
+            continue;
+        }
+        else if(reserved == 0)
+        {
+            break;
+        }
 
-            // Merge 'buddies' when both available
-            unsigned long mask = ((1UL << (2 * heap->block_bits)) - 1) & heap->mask;
-            for(int j = 0; j < heap->blocks_in_word / 2; j++)
+        for(unsigned long i = n; i < n + reserved; i++)
+        {
+            record_owner(heap, out[i], height, height + 1);
+        }
+
+        for(unsigned long i = n; i < n + reserved; i++)
+        {
+            if(heap->mmap && map_region(heap, out[i], height))
             {
-                if((heap->bitmap[bitmap_index] & mask) == mask)
+                // Give back everything from the failed block onward
+                heap->free_block_count -= i << height;
+                for(unsigned long j = i; j < n + reserved; j++)
                 {
-                    merge_block(heap, bitmap_index * heap->blocks_in_word + j * 2);
+                    record_owner(heap, out[j], height, 0);
+                    set_bit(heap, out[j], BIT_AVAIL);
+                    clear_bit(heap, out[j], BIT_USED);
+                    merge_block(heap, out[j]);
                 }
-                mask <<= 2 * heap->block_bits;
+                return i;
             }
-            
-            location += chunk_size;
+            out[i] = block_location(heap, out[i], height);
         }
+        n += reserved;
     }
+
+    heap->free_block_count -= n << height;
+    return n;
 }
 
-unsigned long read_bit(bitmap_heap_descriptor_t *heap, unsigned long location,
-    unsigned long bit)
+void PUBLIC(free_region)(bitmap_heap_descriptor_t *heap, unsigned long location, unsigned long size)
 {
-    int index = block_index(heap, location, 0);
-    while(index && !test_bit(heap, index, BIT_USED))
+    int height = llog2(size / BLOCK_SIZE(heap));
+    unsigned long offset = tree_offset(heap, location);
+    unsigned long index = offset == NOMEM ? 0 : find_owner(heap, offset, &height, 1);
+    if(!index)
     {
-        index /= 2;
+        return;
     }
 
-    if(index)
+    if(heap->unmap)
     {
-        return test_bit(heap, index, bit);
+        heap->dirty_block_count += 1UL << height;
     }
-    else
+    return_block(heap, index, height);
+}
+
+unsigned long PUBLIC(reserve_extents)(bitmap_heap_descriptor_t *heap, unsigned long blocks,
+    unsigned long *locations, unsigned long *sizes, unsigned long max_extents)
+{
+    if(blocks == 0 || (blocks > heap->free_block_count && !heap->section_size))
     {
-        return 1;
+        return 0;
+    }
+
+    // A failure at some height means no block at that height or above is free
+    int height = llog2(blocks + 1) - 1;
+    if(height > (int)heap->height)
+    {
+        height = heap->height;
+    }
+    unsigned long n = 0;
+    while(blocks > 0 && n < max_extents && height >= 0)
+    {
+        unsigned long size = BLOCK_SIZE(heap) << height;
+        unsigned long location = (1UL << height) <= blocks
+            ? PUBLIC(reserve_region)(heap, size)
+            : NOMEM;
+        if(location == NOMEM)
+        {
+            height--;
+            continue;
+        }
+        locations[n] = location;
+        sizes[n++] = size;
+        blocks -= 1UL << height;
+    }
+
+    if(blocks > 0)
+    {
+        for(unsigned long i = 0; i < n; i++)
+        {
+            PUBLIC(free_region)(heap, locations[i], sizes[i]);
+        }
+        return 0;
     }
+    return n;
 }
 
-int write_bit(bitmap_heap_descriptor_t *heap, unsigned long location,
-    unsigned long bit, int value)
+/*
+ * Restores the max-heap property of the first `count` elements of `array`
+ * below element `i`.
+ */
+static void sift_down(unsigned long *array, unsigned long count, unsigned long i)
 {
-    int index = block_index(heap, location, 0);
-    while(index && !test_bit(heap, index, BIT_USED))
+    while(2 * i + 1 < count)
     {
-        index /= 2;
+        unsigned long child = 2 * i + 1;
+        if(child + 1 < count && array[child + 1] > array[child])
+        {
+            child++;
+        }
+        if(array[i] >= array[child])
+        {
+            break;
+        }
+        unsigned long tmp = array[i];
+        array[i] = array[child];
+        array[child] = tmp;
+        i = child;
     }
+}
 
-    if(index && value)
+/*
+ * Restores the max-heap property of `array` above element `i`.
+ */
+static void sift_up(unsigned long *array, unsigned long i)
+{
+    while(i > 0 && array[(i - 1) / 2] < array[i])
     {
-        set_bit(heap, index, bit);
-        return value;
+        unsigned long tmp = array[i];
+        array[i] = array[(i - 1) / 2];
+        array[(i - 1) / 2] = tmp;
+        i = (i - 1) / 2;
     }
-    else if(index)
+}
+
+/*
+ * Sorts the first `count` elements of `array` in ascending order, in place.
+ */
+static void sort_indices(unsigned long *array, unsigned long count)
+{
+    for(unsigned long i = count / 2; i > 0; i--)
     {
-        clear_bit(heap, index, bit);
-        return value;
+        sift_down(array, count, i - 1);
     }
-    else
+    for(unsigned long i = count; i > 1; i--)
     {
-        return 1;
+        unsigned long tmp = array[0];
+        array[0] = array[i - 1];
+        array[i - 1] = tmp;
+        sift_down(array, i - 1, 0);
     }
 }
 
-unsigned long reserve_region(bitmap_heap_descriptor_t *heap, unsigned long size)
+void PUBLIC(free_region_batch)(bitmap_heap_descriptor_t *heap, unsigned long *locations,
+    const unsigned long *sizes, unsigned long count)
 {
-    int height = llog2((size - 1) / heap->block_size + 1);
-    int index = find_free_region(heap, height);
-    if(index)
+    if(BLOCKS_IN_WORD(heap) < 2 || heap->concurrent || heap->unmap || heap->pack_counts)
     {
-        clear_bit(heap, index, BIT_AVAIL);
-        set_bit(heap, index, BIT_USED);
-        heap->free_block_count -= 1 << height;
-        if(heap->mmap && map_region(heap, index, height))
+        for(unsigned long i = 0; i < count; i++)
         {
-            return NOMEM;
+            PUBLIC(free_region)(heap, locations[i], sizes ? sizes[i] : 0);
         }
-        else
+        return;
+    }
+
+    /*
+     * Free the blocks with one write per run of blocks sharing a word, and
+     * replace the locations with the list of words touched.
+     */
+    unsigned long words = 0;
+    unsigned long word = ~0UL;
+    unsigned long avail_bits = 0;
+    for(unsigned long i = 0; i <= count; i++)
+    {
+        unsigned long index = 0;
+        if(i < count)
+        {
+            int height = llog2((sizes ? sizes[i] : 0) / BLOCK_SIZE(heap));
+            unsigned long offset = tree_offset(heap, locations[i]);
+            index = offset == NOMEM ? 0 : find_owner(heap, offset, &height, sizes != 0);
+            if(!index)
+            {
+                continue;
+            }
+            record_owner(heap, index, height, 0);
+            heap->free_block_count += 1UL << height;
+            if(SPLIT_METADATA(heap))
+            {
+                clear_bit(heap, index, BIT_USED);
+            }
+        }
+
+        if(word != ~0UL && (i == count || index / BLOCKS_IN_WORD(heap) != word))
+        {
+            heap->bitmap[word] |= avail_bits;
+            if(BLOCK_BITS(heap) > BIT_USED && !SPLIT_METADATA(heap))
+            {
+                heap->bitmap[word] &= ~(avail_bits >> BIT_USED);
+            }
+            update_summary(heap, word);
+            locations[words++] = word;
+            avail_bits = 0;
+        }
+
+        if(i < count)
         {
-            return block_location(heap, index, height);
+            unsigned long offset = index % BLOCKS_IN_WORD(heap);
+            word = index / BLOCKS_IN_WORD(heap);
+            avail_bits |= 1UL << (TREE_BITS(heap) * (offset + 1) - 1);
         }
     }
-    else
+    sort_indices(locations, words);
+
+    /*
+     * Parents always lie in lower words than their children, so merging the
+     * touched words in descending order handles the tree one level at a time.
+     * Reversed, the sorted words already form a max-heap. Duplicate words are
+     * skipped as they are popped.
+     */
+    for(unsigned long i = 0; i < words / 2; i++)
     {
-        return NOMEM;
+        unsigned long tmp = locations[i];
+        locations[i] = locations[words - 1 - i];
+        locations[words - 1 - i] = tmp;
+    }
+
+    unsigned long pairs_mask = even_mask(heap);
+    unsigned long last = ~0UL;
+    while(words > 0)
+    {
+        unsigned long word = locations[0];
+        locations[0] = locations[--words];
+        sift_down(locations, words, 0);
+        if(word == last)
+        {
+            continue;
+        }
+
+        last = word;
+        if(word == 0)
+        {
+            // The top levels share word 0, so merge them block by block
+            for(unsigned long index = BLOCKS_IN_WORD(heap) - 1; index > 1; index--)
+            {
+                if(test_bit(heap, index, BIT_AVAIL))
+                {
+                    merge_block(heap, index);
+                }
+            }
+        }
+        else if(merge_word(heap, word, pairs_mask))
+        {
+            update_summary(heap, word);
+            update_summary(heap, word / 2);
+            locations[words] = word / 2;
+            sift_up(locations, words++);
+        }
     }
 }
 
-void free_region(bitmap_heap_descriptor_t *heap, unsigned long location, unsigned long size)
+/*
+ * Identifies a snapshot made by `save_snapshot`, and the version of its
+ * layout, which changes whenever the header or the descriptor does.
+ */
+#define SNAPSHOT_MAGIC 0x424d5053UL
+#define SNAPSHOT_VERSION 2UL
+
+/*
+ * The arrays a heap may use, in the order they are copied into a snapshot.
+ */
+enum
+{
+    SNAPSHOT_BITMAP,
+    SNAPSHOT_METADATA,
+    SNAPSHOT_OWNERS,
+    SNAPSHOT_CACHE,
+    SNAPSHOT_DIRECTORY,
+    SNAPSHOT_PACKS,
+    SNAPSHOT_ARRAYS
+};
+
+/*
+ * The header at the start of a snapshot. It holds a copy of the descriptor
+ * with its pointers cleared, and the offset from the start of the snapshot
+ * and length in bytes of each array, which is 0 for arrays the heap does not
+ * use. The checksum covers the header only, so that restoring takes the same
+ * time whatever the size of the heap.
+ */
+typedef struct snapshot_header_t
 {
-    location -= heap->offset;
-    int height = llog2(size / heap->block_size);
-    int index = block_index(heap, location, height);
-    while(!test_bit(heap, index, BIT_USED))
+    unsigned long magic;
+    unsigned long version;
+    unsigned long header_size;
+    unsigned long size;
+    unsigned long checksum;
+    unsigned long offsets[SNAPSHOT_ARRAYS];
+    unsigned long lengths[SNAPSHOT_ARRAYS];
+    bitmap_heap_descriptor_t heap;
+} snapshot_header_t;
+
+/*
+ * Computes the length in bytes of each array used by `heap`, rounded up to a
+ * whole number of words, and returns their total.
+ */
+static unsigned long snapshot_lengths(const bitmap_heap_descriptor_t *heap,
+    unsigned long *lengths)
+{
+    unsigned long word = sizeof(unsigned long);
+    unsigned long words = heap->bitmap_size / word;
+    lengths[SNAPSHOT_BITMAP] = word * (words + summary_words(words));
+    lengths[SNAPSHOT_METADATA] = SPLIT_METADATA(heap)
+        ? word * ((2UL << heap->height) / (WORD_BITS / BLOCK_BITS(heap)))
+        : 0;
+    lengths[SNAPSHOT_OWNERS] = heap->owners
+        ? ((1UL << heap->height) + word - 1) & ~(word - 1)
+        : 0;
+    lengths[SNAPSHOT_CACHE] = heap->cache ? word * heap->cache_capacity : 0;
+    lengths[SNAPSHOT_DIRECTORY] = heap->directory ? word * heap->directory_size : 0;
+    lengths[SNAPSHOT_PACKS] = heap->pack_counts
+        ? word * pack_table_words(1UL << (heap->height - pack_height(heap)), pack_height(heap))
+        : 0;
+
+    unsigned long total = 0;
+    for(int i = 0; i < SNAPSHOT_ARRAYS; i++)
     {
-        height++;
-        index /= 2;
+        total += lengths[i];
+    }
+    return total;
+}
+
+/*
+ * Computes the checksum of a snapshot's header, leaving out the checksum
+ * itself.
+ */
+static unsigned long snapshot_checksum(const snapshot_header_t *header)
+{
+    const unsigned char *bytes = (const unsigned char*)header;
+    unsigned long skip = (const unsigned char*)&header->checksum - bytes;
+    unsigned long hash = 0xcbf29ce4UL;
+    for(unsigned long i = 0; i < sizeof(*header); i++)
+    {
+        if(i - skip >= sizeof(header->checksum))
+        {
+            hash = (hash ^ bytes[i]) * 0x01000193UL;
+        }
     }
-    set_bit(heap, index, BIT_AVAIL);
-    clear_bit(heap, index, BIT_USED);
-    index = merge_block(heap, index);
-    store_cache(heap, index);
-    heap->free_block_count += 1 << height;
+    return hash;
 }
 
+#ifndef BITMAP_ALLOC_NAME
+
+/*
+ * The size calculations take the geometry as arguments, so a specialized
+ * variant shares these with the generic one.
+ */
 unsigned long bitmap_size(const memory_map_t *map, unsigned long block_size, unsigned long block_bits)
 {
-    return 1UL << llog2((block_bits * compute_memory_size(map) / block_size) / 4);
+    return sparse_bitmap_size(map, block_size, block_bits, 0);
+}
+
+unsigned long owner_table_size(const memory_map_t *map, unsigned long block_size)
+{
+    return sparse_owner_table_size(map, block_size, 0);
+}
+
+unsigned long metadata_size(const memory_map_t *map, unsigned long block_size,
+    unsigned long block_bits)
+{
+    return sparse_metadata_size(map, block_size, block_bits, 0);
+}
+
+unsigned long sparse_bitmap_size(const memory_map_t *map, unsigned long block_size,
+    unsigned long block_bits, unsigned long section_size)
+{
+    unsigned long size = sparse_metadata_size(map, block_size, block_bits, section_size);
+    return size + sizeof(unsigned long) * summary_words(size / sizeof(unsigned long));
+}
+
+unsigned long sparse_metadata_size(const memory_map_t *map, unsigned long block_size,
+    unsigned long block_bits, unsigned long section_size)
+{
+    unsigned long memory_size = tree_memory_size(map, block_size, section_size);
+    return 1UL << llog2((block_bits * memory_size / block_size) / 4);
+}
+
+unsigned long sparse_owner_table_size(const memory_map_t *map,
+    unsigned long block_size, unsigned long section_size)
+{
+    return 1UL << llog2(tree_memory_size(map, block_size, section_size) / block_size);
+}
+
+unsigned long pack_table_size(const memory_map_t *map, unsigned long block_size,
+    unsigned long section_size, unsigned long pack_size)
+{
+    int height = llog2(tree_memory_size(map, block_size, section_size) / block_size);
+    int group_height = llog2((pack_size + block_size - 1) / block_size);
+    group_height = group_height < height ? group_height : height;
+    return sizeof(unsigned long) * pack_table_words(1UL << (height - group_height), group_height);
+}
+
+unsigned long snapshot_size(const bitmap_heap_descriptor_t *heap)
+{
+    unsigned long lengths[SNAPSHOT_ARRAYS];
+    return sizeof(snapshot_header_t) + snapshot_lengths(heap, lengths);
+}
+
+unsigned long sparse_section_count(const memory_map_t *map,
+    unsigned long block_size, unsigned long section_size)
+{
+    return find_sections(map, block_size, 
+        sparse_section_bytes(block_size, section_size), (unsigned long*)0, 0);
 }
 
-int initialize_heap(bitmap_heap_descriptor_t *heap, memory_map_t *map)
+#endif
+
+int PUBLIC(initialize_heap)(bitmap_heap_descriptor_t *heap, memory_map_t *map)
 {
     if(construct_heap_desc(heap, map))
     {
         return -1;
     }
 
+    unsigned long bitmap_words = heap->bitmap_size / sizeof(*heap->bitmap);
+    unsigned long storage_size = heap->bitmap_size
+        + sizeof(*heap->bitmap) * summary_words(bitmap_words);
     if(heap->bitmap == (unsigned long*)0)
     {
         int map_index = 0;
         while(map->array[map_index].type != M_AVAILABLE 
-            || map->array[map_index].size < heap->bitmap_size)
+            || map->array[map_index].size < storage_size)
         {
             map_index++;
             if(map_index >= map->size)
@@ -544,14 +3180,167 @@ int initialize_heap(bitmap_heap_descriptor_t *heap, memory_map_t *map)
         }
 
         heap->bitmap = (unsigned long*)(heap->offset + map->array[map_index].location);
-        memmap_insert_region(map, map->array[map_index].location, heap->bitmap_size, M_UNAVAILABLE);
-        if(heap->mmap && heap->mmap(heap->bitmap, heap->bitmap_size))
+        memmap_insert_region(map, map->array[map_index].location, storage_size, M_UNAVAILABLE);
+        if(heap->mmap && heap->mmap(heap->bitmap, storage_size))
         {
             return -1;
         }
     }
+
+    heap->summary = heap->bitmap + bitmap_words;
+    if(heap->pack_counts)
+    {
+        clear_pack_table(heap);
+    }
     
+    select_scan(heap);
     initialize_bitmap(heap, map);
     clear_cache(heap);
+    heap->cache_hits = 0;
+    heap->cache_misses = 0;
+    return 0;
+}
+
+unsigned long PUBLIC(save_snapshot)(const bitmap_heap_descriptor_t *heap, void *buffer,
+    unsigned long size)
+{
+    snapshot_header_t *header = (snapshot_header_t*)buffer;
+    unsigned long lengths[SNAPSHOT_ARRAYS];
+    unsigned long total = sizeof(*header) + snapshot_lengths(heap, lengths);
+    if(total > size || (unsigned long)buffer % sizeof(unsigned long) != 0)
+    {
+        return 0;
+    }
+
+    const void *arrays[SNAPSHOT_ARRAYS] = {
+        heap->bitmap, heap->metadata, heap->owners, heap->cache, heap->directory,
+        heap->pack_counts
+    };
+    unsigned long offset = sizeof(*header);
+    for(int i = 0; i < SNAPSHOT_ARRAYS; i++)
+    {
+        const unsigned char *source = (const unsigned char*)arrays[i];
+        unsigned char *target = (unsigned char*)buffer + offset;
+        unsigned long length = lengths[i];
+        if(i == SNAPSHOT_OWNERS)
+        {
+            // The table itself need not fill its last word
+            length = heap->owners ? 1UL << heap->height : 0;
+        }
+        if(source != target && length % sizeof(unsigned long) == 0)
+        {
+            for(unsigned long j = 0; j < length / sizeof(unsigned long); j++)
+            {
+                ((unsigned long*)target)[j] = ((const unsigned long*)source)[j];
+            }
+        }
+        else if(source != target)
+        {
+            for(unsigned long j = 0; j < length; j++)
+            {
+                target[j] = source[j];
+            }
+        }
+        header->offsets[i] = offset;
+        header->lengths[i] = lengths[i];
+        offset += lengths[i];
+    }
+
+    header->magic = SNAPSHOT_MAGIC;
+    header->version = SNAPSHOT_VERSION;
+    header->header_size = sizeof(*header);
+    header->size = total;
+    header->heap = *heap;
+    header->heap.bitmap = (unsigned long*)0;
+    header->heap.summary = (unsigned long*)0;
+    header->heap.owners = (unsigned char*)0;
+    header->heap.metadata = (unsigned long*)0;
+    header->heap.cache = (unsigned long*)0;
+    header->heap.directory = (unsigned long*)0;
+    header->heap.pack_counts = (unsigned long*)0;
+    header->heap.section_map = (const memory_map_t*)0;
+    header->heap.mmap = 0;
+    header->heap.unmap = 0;
+    header->checksum = snapshot_checksum(header);
+    return total;
+}
+
+int PUBLIC(restore_snapshot)(bitmap_heap_descriptor_t *heap, void *buffer,
+    unsigned long size)
+{
+    snapshot_header_t *header = (snapshot_header_t*)buffer;
+    if(buffer == (void*)0 || (unsigned long)buffer % sizeof(unsigned long) != 0
+        || size < sizeof(*header))
+    {
+        return -1;
+    }
+    else if(header->magic != SNAPSHOT_MAGIC || header->version != SNAPSHOT_VERSION
+        || header->header_size != sizeof(*header) || header->size > size
+        || header->checksum != snapshot_checksum(header))
+    {
+        return -1;
+    }
+
+    // Point the restored descriptor into the snapshot, then check that the
+    // arrays it needs are all there
+    bitmap_heap_descriptor_t restored = header->heap;
+    unsigned long *pointers[SNAPSHOT_ARRAYS];
+    for(int i = 0; i < SNAPSHOT_ARRAYS; i++)
+    {
+        if(header->offsets[i] % sizeof(unsigned long) != 0
+            || header->offsets[i] < sizeof(*header)
+            || header->offsets[i] > header->size
+            || header->lengths[i] > header->size - header->offsets[i])
+        {
+            return -1;
+        }
+        pointers[i] = header->lengths[i]
+            ? (unsigned long*)((unsigned char*)buffer + header->offsets[i])
+            : (unsigned long*)0;
+    }
+    restored.bitmap = pointers[SNAPSHOT_BITMAP];
+    restored.metadata = pointers[SNAPSHOT_METADATA];
+    restored.owners = (unsigned char*)pointers[SNAPSHOT_OWNERS];
+    restored.cache = pointers[SNAPSHOT_CACHE];
+    restored.directory = pointers[SNAPSHOT_DIRECTORY];
+    restored.directory_capacity = restored.directory_size;
+    restored.pack_counts = pointers[SNAPSHOT_PACKS];
+    restored.section_map = heap->section_map;
+    restored.mmap = heap->mmap;
+    restored.unmap = heap->unmap;
+
+    unsigned long lengths[SNAPSHOT_ARRAYS];
+    snapshot_lengths(&restored, lengths);
+    for(int i = 0; i < SNAPSHOT_ARRAYS; i++)
+    {
+        if(lengths[i] != header->lengths[i])
+        {
+            return -1;
+        }
+    }
+    if(restored.bitmap == (unsigned long*)0
+        || restored.block_bits != BLOCK_BITS(&restored)
+        || restored.block_size != BLOCK_SIZE(&restored)
+        || restored.blocks_in_word != WORD_BITS / TREE_BITS(&restored)
+        || restored.mask != generate_mask(TREE_BITS(&restored))
+        || (restored.cache_capacity && !restored.cache))
+    {
+        // Made by a variant compiled for a different block geometry
+        return -1;
+    }
+
+    int depth = section_depth(&restored);
+    unsigned long sections = restored.directory ? restored.directory_size : (1UL << depth);
+    if(depth > 0 && restored.next_section < sections && !restored.section_map)
+    {
+        // The remaining sections cannot be built without the memory map
+        return -1;
+    }
+
+    restored.summary = restored.bitmap
+        + restored.bitmap_size / sizeof(*restored.bitmap);
+    select_scan(&restored);
+    *heap = restored;
     return 0;
 }
+
@@ -4,6 +4,36 @@
 #define BLOCK_RESERVED 0
 #define BLOCK_FREE 1
 
+/*
+ * The number of bits in a word, and so in each mask of available orders.
+ */
+#define WORD_BITS (8 * sizeof(unsigned long))
+
+/*
+ * Identifies a snapshot made by `buddy_save_snapshot`, and the version of its
+ * layout.
+ */
+#define SNAPSHOT_MAGIC 0x42445353UL
+#define SNAPSHOT_VERSION 4UL
+
+/*
+ * The header at the start of a snapshot, followed by the avail list heads,
+ * the block map and then the pageblock types if the heap has them, in which
+ * case `pageblock_types_offset` is not 0. The checksum covers the header only.
+ */
+typedef struct snapshot_header_t
+{
+    unsigned long magic;
+    unsigned long version;
+    unsigned long header_size;
+    unsigned long size;
+    unsigned long checksum;
+    unsigned long avail_offset;
+    unsigned long block_map_offset;
+    unsigned long pageblock_types_offset;
+    buddy_descriptor_t heap;
+} snapshot_header_t;
+
 static unsigned long compute_memory_size(const memory_map_t *map)
 {
     // Find the last available region in the memory map.
@@ -16,6 +46,100 @@ static unsigned long compute_memory_size(const memory_map_t *map)
     return map->array[map_index].location + map->array[map_index].size;
 }
 
+/*
+ * Packs an order and a tag into a state, and a link and its half of a state
+ * into a link word. ENTRY builds a whole entry out of both links and a state.
+ */
+#define STATE(kval, tag) ((unsigned int)(tag) << 5 | (unsigned int)(kval))
+#define LINKB(link, state) ((unsigned int)(link) | ((state) & 7) << BUDDY_LINK_BITS)
+#define LINKF(link, state) ((unsigned int)(link) | ((state) >> 3) << BUDDY_LINK_BITS)
+#define ENTRY(back, forward, state) \
+    ((buddy_block_t){ .linkb = LINKB(back, state), .linkf = LINKF(forward, state) })
+
+/*
+ * Tells whether `block` has the state `state`, comparing the bits above both
+ * links at once rather than putting the state back together.
+ */
+static inline int has_state(buddy_block_t block, unsigned int state)
+{
+    return ((block.linkb ^ LINKB(0, state)) | (block.linkf ^ LINKF(0, state))) <= BUDDY_NIL;
+}
+
+/*
+ * The list heads of the blocks of mobility type `type`.
+ */
+static inline buddy_block_t *avail_of(const buddy_descriptor_t *heap, unsigned long type)
+{
+    return heap->avail + type * (heap->max_kval + 1);
+}
+
+/*
+ * The mobility type of the pageblock holding the block at `index`, under
+ * which a free block starting there is listed.
+ */
+static inline unsigned long block_type(const buddy_descriptor_t *heap, unsigned long index)
+{
+    return heap->pageblock_types ? heap->pageblock_types[index >> heap->pageblock_kval] : 0;
+}
+
+/*
+ * Takes the free block of size 2^k at `index` off the list of available
+ * blocks of that size and of mobility type `type`. The head of the list
+ * stands in for the neighbour at either end, and since a neighbour is free
+ * with the same size, the link words of the block, state bits and all, are
+ * copied into it without reading it. Returns nonzero if the list is left
+ * empty, leaving the caller to update the mask of available orders.
+ */
+static inline int unlink_block(buddy_descriptor_t *heap, unsigned long index,
+    unsigned long k, unsigned long type)
+{
+    buddy_block_t *avail = avail_of(heap, type);
+    buddy_block_t block = heap->block_map[index];
+    unsigned long linkb = BUDDY_LINKB(block);
+    unsigned long linkf = BUDDY_LINKF(block);
+    if(linkb == BUDDY_NIL)
+    {
+        avail[k].linkf = block.linkf;
+    }
+    else
+    {
+        heap->block_map[linkb].linkf = block.linkf;
+    }
+    if(linkf == BUDDY_NIL)
+    {
+        avail[k].linkb = block.linkb;
+    }
+    else
+    {
+        heap->block_map[linkf].linkb = block.linkb;
+    }
+    return linkb == BUDDY_NIL && linkf == BUDDY_NIL;
+}
+
+/*
+ * Marks the block at `index` as free with size 2^k, and puts it at the front
+ * of the list of available blocks of that size and of its pageblock's type.
+ */
+static inline void push_block(buddy_descriptor_t *heap, unsigned long index,
+    unsigned long k)
+{
+    unsigned long type = block_type(heap, index);
+    buddy_block_t *avail = avail_of(heap, type);
+    unsigned int state = STATE(k, BLOCK_FREE);
+    unsigned long first = BUDDY_LINKF(avail[k]);
+    heap->block_map[index] = ENTRY(BUDDY_NIL, first, state);
+    if(first == BUDDY_NIL)
+    {
+        avail[k].linkb = LINKB(index, state);
+    }
+    else
+    {
+        heap->block_map[first].linkb = LINKB(index, state);
+    }
+    avail[k].linkf = LINKF(index, state);
+    heap->avail_mask[type] |= 1UL << k;
+}
+
 static void insert_block(buddy_descriptor_t *heap, unsigned long index,
     unsigned long k)
 {
@@ -23,27 +147,23 @@ static void insert_block(buddy_descriptor_t *heap, unsigned long index,
     while(k < heap->max_kval)
     {
         unsigned long buddy_index = index ^ (1UL << k);
-        if(heap->block_map[buddy_index].tag != BLOCK_FREE 
-            || heap->block_map[buddy_index].kval != k)
+        if(!has_state(heap->block_map[buddy_index], STATE(k, BLOCK_FREE)))
         {
             break;
         }
-        heap->block_map[buddy_index].linkb->linkf = heap->block_map[buddy_index].linkf;
-        heap->block_map[buddy_index].linkf->linkb = heap->block_map[buddy_index].linkb;
-        heap->block_map[buddy_index].tag = BLOCK_RESERVED;
+        unsigned long type = block_type(heap, buddy_index);
+        if(unlink_block(heap, buddy_index, k, type))
+        {
+            heap->avail_mask[type] &= ~(1UL << k);
+        }
+        heap->block_map[buddy_index] = ENTRY(BUDDY_NIL, BUDDY_NIL, STATE(0, BLOCK_RESERVED));
         k++;
         if(buddy_index < index)
         {
             index = buddy_index;
         }
     }
-    heap->block_map[index].tag = BLOCK_FREE;
-    buddy_block_t *p = heap->avail[k].linkf;
-    heap->block_map[index].linkf = p;
-    heap->block_map[index].linkb = &heap->avail[k];
-    p->linkb = &heap->block_map[index];
-    heap->avail[k].linkf = &heap->block_map[index];
-    heap->block_map[index].kval = k;
+    push_block(heap, index, k);
 }
 
 unsigned long buddy_map_size(const memory_map_t *map, unsigned long block_size)
@@ -52,30 +172,297 @@ unsigned long buddy_map_size(const memory_map_t *map, unsigned long block_size)
     return 1UL << llog2(sizeof(buddy_block_t) * memory_size / block_size);
 }
 
+unsigned long buddy_pageblock_types_size(const memory_map_t *map, unsigned long block_size,
+    unsigned long pageblock_kval)
+{
+    unsigned long count = buddy_map_size(map, block_size) / sizeof(buddy_block_t);
+    return count >> pageblock_kval ? count >> pageblock_kval : 1;
+}
+
+/*
+ * The mobility types a reserve of each type falls back to, in order.
+ */
+static const unsigned char fallbacks[BUDDY_MOBILITY_TYPES][BUDDY_MOBILITY_TYPES - 1] = {
+    [BUDDY_UNMOVABLE] = {BUDDY_RECLAIMABLE, BUDDY_MOVABLE},
+    [BUDDY_RECLAIMABLE] = {BUDDY_UNMOVABLE, BUDDY_MOVABLE},
+    [BUDDY_MOVABLE] = {BUDDY_RECLAIMABLE, BUDDY_UNMOVABLE}
+};
+
+/*
+ * Sets the type of the pageblock `pageblock` to `type`, moving each free
+ * block starting in it over to the lists of that type. The pageblock must be
+ * split, so the entry at the start of each block in it gives the size of
+ * the block, which is enough to walk from one block to the next.
+ */
+static void claim_pageblock(buddy_descriptor_t *heap, unsigned long pageblock,
+    unsigned long type)
+{
+    unsigned long old = heap->pageblock_types[pageblock];
+    unsigned long index = pageblock << heap->pageblock_kval;
+    unsigned long end = index + (1UL << heap->pageblock_kval);
+    heap->pageblock_types[pageblock] = type;
+    heap->claim_count++;
+    while(index < end)
+    {
+        buddy_block_t block = heap->block_map[index];
+        unsigned long k = BUDDY_KVAL(block);
+        if(BUDDY_TAG(block) == BLOCK_FREE)
+        {
+            if(unlink_block(heap, index, k, old))
+            {
+                heap->avail_mask[old] &= ~(1UL << k);
+            }
+            push_block(heap, index, k);
+        }
+        index += 1UL << k;
+    }
+}
+
+/*
+ * Reserves a block of size 2^k and of mobility type `type` from a heap which
+ * groups by mobility, falling back to the other types as described for
+ * `pageblock_types`.
+ */
+static unsigned long reserve_grouped(buddy_descriptor_t *heap, unsigned long k,
+    unsigned long type)
+{
+    unsigned long from = type;
+    unsigned long orders = heap->avail_mask[type] & (~0UL << k);
+    unsigned long j;
+    if(orders != 0)
+    {
+        j = __builtin_ctzl(orders);
+    }
+    else
+    {
+        for(int i = 0; i < BUDDY_MOBILITY_TYPES - 1 && orders == 0; i++)
+        {
+            from = fallbacks[type][i];
+            orders = heap->avail_mask[from] & (~0UL << k);
+        }
+        if(orders == 0)
+        {
+            return NOMEM;
+        }
+        // The largest block, so fewer reserves need to fall back again
+        j = WORD_BITS - 1 - __builtin_clzl(orders);
+        heap->fallback_count++;
+    }
+
+    unsigned long index = BUDDY_LINKB(avail_of(heap, from)[j]);
+    if(from != type && j < heap->pageblock_kval
+        && (type != BUDDY_MOVABLE || j >= heap->pageblock_kval / 2))
+    {
+        claim_pageblock(heap, index >> heap->pageblock_kval, type);
+        from = type;
+    }
+    if(unlink_block(heap, index, j, from))
+    {
+        heap->avail_mask[from] &= ~(1UL << j);
+    }
+
+    // Whole pageblocks are taken over along with the block covering them
+    if(j >= heap->pageblock_kval)
+    {
+        unsigned long first = index >> heap->pageblock_kval;
+        for(unsigned long p = first; p < first + (1UL << (j - heap->pageblock_kval)); p++)
+        {
+            heap->claim_count += heap->pageblock_types[p] != type;
+            heap->pageblock_types[p] = type;
+        }
+    }
+
+    heap->block_map[index] = ENTRY(BUDDY_NIL, BUDDY_NIL, STATE(k, BLOCK_RESERVED));
+    while(j > k)
+    {
+        j--;
+        push_block(heap, index + (1UL << j), j);
+    }
+    heap->free_block_count -= 1UL << k;
+    return (unsigned long)heap->offset + index * heap->block_size;
+}
+
 unsigned long buddy_reserve(buddy_descriptor_t *heap, unsigned long size)
 {
     unsigned long k = llog2((size - 1) / heap->block_size + 1);
-    for(unsigned long j = k; j <= heap->max_kval; j++)
+    if(k > heap->max_kval)
+    {
+        return NOMEM;
+    }
+    if(heap->pageblock_types)
+    {
+        return reserve_grouped(heap, k, BUDDY_UNMOVABLE);
+    }
+
+    // The smallest order at least k with an available block
+    unsigned long orders = heap->avail_mask[0] & (~0UL << k);
+    if(orders == 0)
+    {
+        return NOMEM;
+    }
+    unsigned long j = __builtin_ctzl(orders);
+
+    unsigned long index = BUDDY_LINKB(heap->avail[j]);
+    buddy_block_t *block = &heap->block_map[index];
+    unsigned long mask = heap->avail_mask[0];
+    if(unlink_block(heap, index, j, 0))
+    {
+        mask &= ~(1UL << j);
+    }
+    *block = ENTRY(BUDDY_NIL, BUDDY_NIL, STATE(k, BLOCK_RESERVED));
+    while(j > k)
+    {
+        // Each list below j was empty, so each buddy is alone in its list
+        j--;
+        unsigned int state = STATE(j, BLOCK_FREE);
+        block[1UL << j] = ENTRY(BUDDY_NIL, BUDDY_NIL, state);
+        heap->avail[j] = ENTRY(index + (1UL << j), index + (1UL << j), state);
+        mask |= 1UL << j;
+    }
+    heap->avail_mask[0] = mask;
+    heap->free_block_count -= 1UL << k;
+    return (unsigned long)heap->offset + index * heap->block_size;
+}
+
+unsigned long buddy_reserve_type(buddy_descriptor_t *heap, unsigned long size,
+    unsigned long type)
+{
+    unsigned long k = llog2((size - 1) / heap->block_size + 1);
+    if(!heap->pageblock_types)
+    {
+        return buddy_reserve(heap, size);
+    }
+    if(k > heap->max_kval || type >= BUDDY_MOBILITY_TYPES)
+    {
+        return NOMEM;
+    }
+    return reserve_grouped(heap, k, type);
+}
+
+/*
+ * Tests whether the entry at `index` stands for a free block of size 2^j,
+ * rather than lying unset inside a larger free block. Each block enclosing it
+ * must then be split, which is read from the entries of those blocks from the
+ * largest down, each of which is set if its parent is split.
+ */
+static int is_free_block(const buddy_descriptor_t *heap, unsigned long index, unsigned long j)
+{
+    for(unsigned long m = heap->max_kval; m > j; m--)
+    {
+        if(BUDDY_KVAL(heap->block_map[index & ~((1UL << m) - 1)]) >= m)
+        {
+            return 0;
+        }
+    }
+    return has_state(heap->block_map[index], STATE(j, BLOCK_FREE));
+}
+
+/*
+ * Finds a free block of size 2^j containing an aligned run of 2^k blocks
+ * within the block indices [low, high), and writes the index of that run to
+ * `target`. The free blocks which may hold such a run are those starting
+ * within the window, plus the one straddling its start, so either the avail
+ * list under `avail` or the block map over the window is searched, whichever
+ * turns out to be shorter. Returns NULL if there is none.
+ */
+static buddy_block_t *find_in_window(buddy_descriptor_t *heap, const buddy_block_t *avail,
+    unsigned long j, unsigned long k, unsigned long low, unsigned long high,
+    unsigned long *target)
+{
+    unsigned long size = 1UL << j;
+    unsigned long first = low & ~(size - 1);
+    unsigned long positions = (high - first + size - 1) >> j;
+    unsigned long visited = 0;
+    unsigned long index = BUDDY_LINKF(avail[j]);
+    for(; index != BUDDY_NIL && visited < positions;
+        index = BUDDY_LINKF(heap->block_map[index]), visited++)
     {
-        if(heap->avail[j].linkf != &heap->avail[j])
+        unsigned long start = index > low ? index : (low + (1UL << k) - 1) & ~((1UL << k) - 1);
+        unsigned long end = index + size < high ? index + size : high;
+        if(start + (1UL << k) <= end)
         {
-            buddy_block_t *block = heap->avail[j].linkb;
-            heap->avail[j].linkb = block->linkb;
-            heap->avail[j].linkb->linkf = &heap->avail[j];
-            block->tag = BLOCK_RESERVED;
+            *target = start;
+            return &heap->block_map[index];
+        }
+    }
+    if(index == BUDDY_NIL)
+    {
+        return (buddy_block_t*)0;
+    }
+
+    for(index = first; index < high; index += size)
+    {
+        if(!has_state(heap->block_map[index], STATE(j, BLOCK_FREE))
+            || !is_free_block(heap, index, j))
+        {
+            continue;
+        }
+        unsigned long start = index > low ? index : (low + (1UL << k) - 1) & ~((1UL << k) - 1);
+        unsigned long end = index + size < high ? index + size : high;
+        if(start + (1UL << k) <= end)
+        {
+            *target = start;
+            return &heap->block_map[index];
+        }
+    }
+    return (buddy_block_t*)0;
+}
+
+unsigned long buddy_reserve_in_range(buddy_descriptor_t *heap, unsigned long size,
+    unsigned long min_addr, unsigned long max_addr)
+{
+    unsigned long k = llog2((size - 1) / heap->block_size + 1);
+    unsigned long count = 1UL << heap->max_kval;
+    unsigned long low = min_addr > heap->offset
+        ? (min_addr - heap->offset + heap->block_size - 1) / heap->block_size
+        : 0;
+    unsigned long high = max_addr > heap->offset ? (max_addr - heap->offset) / heap->block_size : 0;
+    if(high > count)
+    {
+        high = count;
+    }
+    if(k > heap->max_kval || low >= high)
+    {
+        return NOMEM;
+    }
+
+    // Any type will do, so the lists of each are searched in turn
+    unsigned long types = heap->pageblock_types ? BUDDY_MOBILITY_TYPES : 1;
+    for(unsigned long type = 0; type < types; type++)
+    {
+        for(unsigned long orders = heap->avail_mask[type] & (~0UL << k); orders; orders &= orders - 1)
+        {
+            unsigned long j = __builtin_ctzl(orders);
+            unsigned long target;
+            buddy_block_t *block = find_in_window(heap, avail_of(heap, type), j, k, low, high,
+                &target);
+            if(!block)
+            {
+                continue;
+            }
+
+            // The block map may turn up a block listed under another type
+            unsigned long index = block - heap->block_map;
+            unsigned long from = block_type(heap, index);
+            if(unlink_block(heap, index, j, from))
+            {
+                heap->avail_mask[from] &= ~(1UL << j);
+            }
+            *block = ENTRY(BUDDY_NIL, BUDDY_NIL, STATE(0, BLOCK_RESERVED));
+
+            // Give back the half not containing the target at each level
             while(j > k)
             {
                 j--;
-                buddy_block_t *buddy = block + (1UL << j);
-                buddy->tag = BLOCK_FREE;
-                buddy->kval = j;
-                block->kval = j;
-                buddy->linkb = &heap->avail[j];
-                buddy->linkf = &heap->avail[j];
-                heap->avail[j].linkb = buddy;
-                heap->avail[j].linkf = buddy;
+                unsigned long buddy_index = index ^ (1UL << j);
+                if(target & (1UL << j))
+                {
+                    buddy_index = index;
+                    index |= 1UL << j;
+                }
+                push_block(heap, buddy_index, j);
             }
-            unsigned long index = block - heap->block_map;
+            heap->block_map[index] = ENTRY(BUDDY_NIL, BUDDY_NIL, STATE(k, BLOCK_RESERVED));
             heap->free_block_count -= 1UL << k;
             return (unsigned long)heap->offset + index * heap->block_size;
         }
@@ -86,7 +473,7 @@ unsigned long buddy_reserve(buddy_descriptor_t *heap, unsigned long size)
 unsigned long buddy_free(buddy_descriptor_t *heap, unsigned long location)
 {
     unsigned long index = (location - (unsigned long)heap->offset) / heap->block_size;
-    unsigned long k = llog2((heap->block_size * (1UL << heap->block_map[index].kval)) / heap->block_size);
+    unsigned long k = BUDDY_KVAL(heap->block_map[index]);
     insert_block(heap, index, k);
     return (1UL << k) * heap->block_size;
 }
@@ -100,15 +487,66 @@ unsigned long buddy_free_size(buddy_descriptor_t *heap, unsigned long location,
     return (1UL << k) * heap->block_size;
 }
 
+/*
+ * Splits the blocks [first, end) into their largest aligned blocks, and
+ * writes an entry at the start of each, marking it as free or reserved. The
+ * entries inside them are left unset, as they are only read once the block
+ * enclosing them has been split.
+ */
+static void insert_range(buddy_descriptor_t *heap, unsigned long first, unsigned long end,
+    unsigned long tag)
+{
+    while(first < end)
+    {
+        unsigned long k = WORD_BITS - 1 - __builtin_clzl(end - first);
+        if(first != 0 && __builtin_ctzl(first) < k)
+        {
+            k = __builtin_ctzl(first);
+        }
+        if(tag == BLOCK_FREE)
+        {
+            push_block(heap, first, k);
+            heap->free_block_count += 1UL << k;
+        }
+        else
+        {
+            heap->block_map[first] = ENTRY(BUDDY_NIL, BUDDY_NIL, STATE(k, BLOCK_RESERVED));
+        }
+        first += 1UL << k;
+    }
+}
+
 int buddy_alloc_init(buddy_descriptor_t *heap, memory_map_t *map)
 {
     heap->block_map_size = buddy_map_size(map, heap->block_size);
     heap->max_kval = llog2(heap->block_map_size / sizeof(buddy_block_t));
+    if(heap->max_kval > BUDDY_MAX_KVAL)
+    {
+        return -1;
+    }
+    unsigned long types = 1;
+    if(heap->pageblock_types)
+    {
+        if(heap->pageblock_kval > heap->max_kval)
+        {
+            return -1;
+        }
+        types = BUDDY_MOBILITY_TYPES;
+        for(unsigned long i = 0; i < 1UL << (heap->max_kval - heap->pageblock_kval); i++)
+        {
+            heap->pageblock_types[i] = BUDDY_MOVABLE;
+        }
+    }
     heap->free_block_count = 0;
-    for(int i = 0; i <= heap->max_kval; i++)
+    heap->fallback_count = 0;
+    heap->claim_count = 0;
+    for(unsigned long type = 0; type < BUDDY_MOBILITY_TYPES; type++)
+    {
+        heap->avail_mask[type] = 0;
+    }
+    for(unsigned long i = 0; i < types * (heap->max_kval + 1); i++)
     {
-        heap->avail[i].linkf = &heap->avail[i];
-        heap->avail[i].linkb = &heap->avail[i];
+        heap->avail[i] = ENTRY(BUDDY_NIL, BUDDY_NIL, STATE(i % (heap->max_kval + 1), BLOCK_FREE));
     }
 
     if(heap->block_map == (buddy_block_t*)0)
@@ -132,14 +570,9 @@ int buddy_alloc_init(buddy_descriptor_t *heap, memory_map_t *map)
         }
     }
 
-    for(int i = 0; i < heap->block_map_size / sizeof(buddy_block_t); i++)
-    {
-        heap->block_map[i].tag = BLOCK_RESERVED;
-        heap->block_map[i].kval = 0;
-        heap->block_map[i].linkf = 0;
-        heap->block_map[i].linkb = 0;
-    }
-
+    // Each gap between available blocks is marked reserved, as blocks of it
+    unsigned long count = 1UL << heap->max_kval;
+    unsigned long gap = 0;
     for(int i = 0; i < map->size; i++)
     {
         if(map->array[i].type != M_AVAILABLE)
@@ -147,17 +580,294 @@ int buddy_alloc_init(buddy_descriptor_t *heap, memory_map_t *map)
             continue;
         }
 
-        unsigned long location = (map->array[i].location + heap->block_size - 1);
-        location -= location % heap->block_size;
-        unsigned long region_end = map->array[i].location + map->array[i].size;
-        while(location + heap->block_size <= region_end)
+        unsigned long first = (map->array[i].location + heap->block_size - 1) / heap->block_size;
+        unsigned long end = (map->array[i].location + map->array[i].size) / heap->block_size;
+        if(first < gap)
+        {
+            first = gap;
+        }
+        if(first < end)
+        {
+            insert_range(heap, gap, first, BLOCK_RESERVED);
+            insert_range(heap, first, end, BLOCK_FREE);
+            gap = end;
+        }
+    }
+    insert_range(heap, gap, count, BLOCK_RESERVED);
+    return 0;
+}
+
+static inline void lock_heap(buddy_pcp_descriptor_t *pcp)
+{
+    if(pcp->lock)
+    {
+        pcp->lock(pcp->heap);
+    }
+}
+
+static inline void unlock_heap(buddy_pcp_descriptor_t *pcp)
+{
+    if(pcp->unlock)
+    {
+        pcp->unlock(pcp->heap);
+    }
+}
+
+static inline buddy_pcp_t *cpu_list(buddy_pcp_descriptor_t *pcp)
+{
+    return pcp->cpu_id ? &pcp->lists[pcp->cpu_id()] : &pcp->lists[0];
+}
+
+int buddy_pcp_init(buddy_pcp_descriptor_t *pcp)
+{
+    if(pcp->orders > BUDDY_PCP_ORDERS || pcp->low == 0 || pcp->high < pcp->low
+        || pcp->type >= BUDDY_MOBILITY_TYPES)
+    {
+        return -1;
+    }
+    for(unsigned long cpu = 0; cpu < pcp->cpu_count; cpu++)
+    {
+        for(unsigned long k = 0; k < BUDDY_PCP_ORDERS; k++)
         {
-            unsigned long index = location / heap->block_size;
-            unsigned long k = 0;
-            insert_block(heap, index, k);
-            location += heap->block_size;
-            heap->free_block_count++;
+            pcp->lists[cpu].first[k] = BUDDY_NIL;
+            pcp->lists[cpu].count[k] = 0;
         }
     }
     return 0;
 }
+
+/*
+ * Gives the blocks of the list of order k after its first `keep` back to the
+ * heap, under a single hold of the lock.
+ */
+static void drain_list(buddy_pcp_descriptor_t *pcp, buddy_pcp_t *list, unsigned long k,
+    unsigned long keep)
+{
+    buddy_descriptor_t *heap = pcp->heap;
+    unsigned long index = list->first[k];
+    unsigned int *link = &list->first[k];
+    for(unsigned long i = 0; i < keep; i++)
+    {
+        link = &heap->block_map[index].linkf;
+        index = *link;
+    }
+    *link = BUDDY_NIL;
+    list->count[k] = keep;
+
+    lock_heap(pcp);
+    while(index != BUDDY_NIL)
+    {
+        unsigned long next = heap->block_map[index].linkf;
+        insert_block(heap, index, k);
+        index = next;
+    }
+    unlock_heap(pcp);
+}
+
+unsigned long buddy_pcp_reserve(buddy_pcp_descriptor_t *pcp, unsigned long size)
+{
+    buddy_descriptor_t *heap = pcp->heap;
+    unsigned long k = llog2((size - 1) / heap->block_size + 1);
+    if(k >= pcp->orders)
+    {
+        lock_heap(pcp);
+        unsigned long location = buddy_reserve_type(heap, size, pcp->type);
+        unlock_heap(pcp);
+        return location;
+    }
+
+    buddy_pcp_t *list = cpu_list(pcp);
+    if(list->count[k] == 0)
+    {
+        // Refill the list in address order, as the heap hands blocks out
+        unsigned int *link = &list->first[k];
+        unsigned long count = 0;
+        lock_heap(pcp);
+        while(count < pcp->low)
+        {
+            unsigned long location = buddy_reserve_type(heap, heap->block_size << k,
+                pcp->type);
+            if(location == NOMEM)
+            {
+                break;
+            }
+            *link = (location - (unsigned long)heap->offset) / heap->block_size;
+            link = &heap->block_map[*link].linkf;
+            count++;
+        }
+        unlock_heap(pcp);
+        *link = BUDDY_NIL;
+        list->count[k] = count;
+        if(count == 0)
+        {
+            return NOMEM;
+        }
+    }
+
+    unsigned long index = list->first[k];
+    list->first[k] = heap->block_map[index].linkf;
+    list->count[k]--;
+    return (unsigned long)heap->offset + index * heap->block_size;
+}
+
+unsigned long buddy_pcp_free(buddy_pcp_descriptor_t *pcp, unsigned long location)
+{
+    buddy_descriptor_t *heap = pcp->heap;
+    unsigned long index = (location - (unsigned long)heap->offset) / heap->block_size;
+    unsigned long k = BUDDY_KVAL(heap->block_map[index]);
+    if(k >= pcp->orders)
+    {
+        lock_heap(pcp);
+        unsigned long size = buddy_free(heap, location);
+        unlock_heap(pcp);
+        return size;
+    }
+
+    buddy_pcp_t *list = cpu_list(pcp);
+    heap->block_map[index].linkf = list->first[k];
+    list->first[k] = index;
+    if(++list->count[k] > pcp->high)
+    {
+        drain_list(pcp, list, k, pcp->low);
+    }
+    return (1UL << k) * heap->block_size;
+}
+
+void buddy_pcp_drain(buddy_pcp_descriptor_t *pcp, unsigned long cpu)
+{
+    for(unsigned long k = 0; k < pcp->orders; k++)
+    {
+        if(pcp->lists[cpu].count[k] != 0)
+        {
+            drain_list(pcp, &pcp->lists[cpu], k, 0);
+        }
+    }
+}
+
+/*
+ * Computes the checksum of a snapshot's header, leaving out the checksum
+ * itself.
+ */
+static unsigned long snapshot_checksum(const snapshot_header_t *header)
+{
+    const unsigned char *bytes = (const unsigned char*)header;
+    unsigned long skip = (const unsigned char*)&header->checksum - bytes;
+    unsigned long hash = 0xcbf29ce4UL;
+    for(unsigned long i = 0; i < sizeof(*header); i++)
+    {
+        if(i - skip >= sizeof(header->checksum))
+        {
+            hash = (hash ^ bytes[i]) * 0x01000193UL;
+        }
+    }
+    return hash;
+}
+
+/*
+ * The sizes in bytes of the avail list heads and of the pageblock types of
+ * `heap`.
+ */
+static unsigned long avail_size(const buddy_descriptor_t *heap)
+{
+    unsigned long types = heap->pageblock_types ? BUDDY_MOBILITY_TYPES : 1;
+    return sizeof(buddy_block_t) * types * (heap->max_kval + 1);
+}
+
+static unsigned long pageblock_types_size(const buddy_descriptor_t *heap)
+{
+    return heap->pageblock_types ? 1UL << (heap->max_kval - heap->pageblock_kval) : 0;
+}
+
+unsigned long buddy_snapshot_size(const buddy_descriptor_t *heap)
+{
+    return sizeof(snapshot_header_t) + avail_size(heap) + heap->block_map_size
+        + pageblock_types_size(heap);
+}
+
+unsigned long buddy_save_snapshot(const buddy_descriptor_t *heap, void *buffer,
+    unsigned long size)
+{
+    snapshot_header_t *header = (snapshot_header_t*)buffer;
+    unsigned long total = buddy_snapshot_size(heap);
+    if(total > size || (unsigned long)buffer % sizeof(unsigned long) != 0)
+    {
+        return 0;
+    }
+
+    header->magic = SNAPSHOT_MAGIC;
+    header->version = SNAPSHOT_VERSION;
+    header->header_size = sizeof(*header);
+    header->size = total;
+    header->avail_offset = sizeof(*header);
+    header->block_map_offset = sizeof(*header) + avail_size(heap);
+    header->pageblock_types_offset = heap->pageblock_types
+        ? header->block_map_offset + heap->block_map_size
+        : 0;
+    header->heap = *heap;
+    header->heap.avail = (buddy_block_t*)0;
+    header->heap.block_map = (buddy_block_t*)0;
+    header->heap.pageblock_types = (unsigned char*)0;
+    header->heap.mmap = 0;
+
+    // The links are indices, so the list heads and block map copy as they are
+    buddy_block_t *avail = (buddy_block_t*)((unsigned char*)buffer + header->avail_offset);
+    buddy_block_t *block_map = (buddy_block_t*)((unsigned char*)buffer + header->block_map_offset);
+    unsigned long count = heap->block_map_size / sizeof(buddy_block_t);
+    for(unsigned long i = 0; i < avail_size(heap) / sizeof(buddy_block_t); i++)
+    {
+        avail[i] = heap->avail[i];
+    }
+    for(unsigned long i = 0; i < count; i++)
+    {
+        block_map[i] = heap->block_map[i];
+    }
+    unsigned char *types = (unsigned char*)buffer + header->pageblock_types_offset;
+    for(unsigned long i = 0; i < pageblock_types_size(heap); i++)
+    {
+        types[i] = heap->pageblock_types[i];
+    }
+    header->checksum = snapshot_checksum(header);
+    return total;
+}
+
+int buddy_restore_snapshot(buddy_descriptor_t *heap, void *buffer, unsigned long size)
+{
+    snapshot_header_t *header = (snapshot_header_t*)buffer;
+    if(buffer == (void*)0 || (unsigned long)buffer % sizeof(unsigned long) != 0
+        || size < sizeof(*header))
+    {
+        return -1;
+    }
+    else if(header->magic != SNAPSHOT_MAGIC || header->version != SNAPSHOT_VERSION
+        || header->header_size != sizeof(*header) || header->size > size
+        || header->checksum != snapshot_checksum(header))
+    {
+        return -1;
+    }
+
+    buddy_descriptor_t restored = header->heap;
+    if(restored.max_kval > BUDDY_MAX_KVAL
+        || (header->pageblock_types_offset != 0 && restored.pageblock_kval > restored.max_kval))
+    {
+        return -1;
+    }
+    restored.avail = (buddy_block_t*)((unsigned char*)buffer + header->avail_offset);
+    restored.block_map = (buddy_block_t*)((unsigned char*)buffer + header->block_map_offset);
+    if(header->pageblock_types_offset != 0)
+    {
+        restored.pageblock_types = (unsigned char*)buffer + header->pageblock_types_offset;
+    }
+    if(header->avail_offset != sizeof(*header)
+        || header->block_map_offset != header->avail_offset + avail_size(&restored)
+        || (header->pageblock_types_offset != 0
+            && header->pageblock_types_offset != header->block_map_offset + restored.block_map_size)
+        || header->size != buddy_snapshot_size(&restored)
+        || restored.block_map_size != sizeof(buddy_block_t) << restored.max_kval)
+    {
+        return -1;
+    }
+    restored.mmap = heap->mmap;
+
+    *heap = restored;
+    return 0;
+}
@@ -0,0 +1,999 @@
+#include "libmalloc/bitmap_alloc.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <time.h>
+#include <pthread.h>
+#include <string.h>
+
+#if defined(__linux__)
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+BITMAP_ALLOC_DECLARE(fixed);
+
+static double elapsed_ns(const struct timespec *start, const struct timespec *end)
+{
+    return (end->tv_sec - start->tv_sec) * 1e9 + (end->tv_nsec - start->tv_nsec);
+}
+
+/*
+ * Fills a heap one block at a time up to 99% of its capacity, reporting the
+ * average latency of an allocation within each band of occupancy.
+ */
+void bench_fill(unsigned long memory_size, unsigned long block_size)
+{
+    printf("[BENCH] Bitmap allocator fill: memory=%lX, block_size=%lu\n", memory_size, block_size);
+    const int memory_map_capacity = 8;
+    static const int bands[] = {10, 20, 30, 40, 50, 60, 70, 80, 90, 95, 99};
+    memory_region_t arr[memory_map_capacity];
+    memory_map_t memory_map = {
+        .array = arr,
+        .capacity = memory_map_capacity,
+        .size = 0
+    };
+    memmap_insert_region(&memory_map, 0, memory_size, M_AVAILABLE);
+
+    bitmap_heap_descriptor_t heap = {
+        .bitmap = malloc(bitmap_size(&memory_map, block_size, 1)),
+        .block_size = block_size,
+        .cache = NULL,
+        .cache_capacity = 0,
+        .block_bits = 1,
+        .offset = 0,
+        .mmap = NULL
+    };
+    if(initialize_heap(&heap, &memory_map))
+    {
+        printf("\tFailed to initialize heap.\n");
+        free(heap.bitmap);
+        return;
+    }
+
+    unsigned long total_blocks = heap.free_block_count;
+    unsigned long used = 0;
+    int start_band = 0;
+    for(int i = 0; i < sizeof(bands) / sizeof(*bands); i++)
+    {
+        unsigned long target = total_blocks * bands[i] / 100;
+        unsigned long count = target - used;
+        struct timespec start, end;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        for(; used < target; used++)
+        {
+            if(reserve_region(&heap, block_size) == NOMEM)
+            {
+                break;
+            }
+        }
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        printf("\t%2i%%-%2i%% full: %8.1f ns/alloc\n", start_band, bands[i],
+            count ? elapsed_ns(&start, &end) / count : 0.0);
+        start_band = bands[i];
+    }
+    free(heap.bitmap);
+}
+
+/*
+ * Fragments a heap so that every other block is free, then measures how
+ * quickly the remaining blocks are reserved one at a time and how often the
+ * cache satisfies those reservations.
+ */
+void bench_cache(unsigned long memory_size, unsigned long block_size,
+    unsigned long depth)
+{
+    printf("[BENCH] Bitmap allocator cache: memory=%lX, block_size=%lu, cache_depth=%lu\n",
+        memory_size, block_size, depth);
+    const int memory_map_capacity = 8;
+    const int cache_capacity = 1024;
+    memory_region_t arr[memory_map_capacity];
+    unsigned long heap_cache[cache_capacity];
+    memory_map_t memory_map = {
+        .array = arr,
+        .capacity = memory_map_capacity,
+        .size = 0
+    };
+    memmap_insert_region(&memory_map, 0, memory_size, M_AVAILABLE);
+
+    bitmap_heap_descriptor_t heap = {
+        .bitmap = malloc(bitmap_size(&memory_map, block_size, 1)),
+        .block_size = block_size,
+        .cache = heap_cache,
+        .cache_capacity = cache_capacity,
+        .cache_depth = depth,
+        .block_bits = 1,
+        .offset = 0,
+        .mmap = NULL
+    };
+    if(initialize_heap(&heap, &memory_map))
+    {
+        printf("\tFailed to initialize heap.\n");
+        free(heap.bitmap);
+        return;
+    }
+
+    unsigned long total_blocks = heap.free_block_count;
+    for(unsigned long i = 0; i < total_blocks; i++)
+    {
+        reserve_region(&heap, block_size);
+    }
+    for(unsigned long i = 0; i < total_blocks; i += 2)
+    {
+        free_region(&heap, i * block_size, block_size);
+    }
+    heap.cache_hits = 0;
+    heap.cache_misses = 0;
+
+    unsigned long count = heap.free_block_count;
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for(unsigned long i = 0; i < count; i++)
+    {
+        reserve_region(&heap, block_size);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    printf("\t%8.1f ns/alloc, hit rate %5.1f%%\n", elapsed_ns(&start, &end) / count,
+        100.0 * heap.cache_hits / (heap.cache_hits + heap.cache_misses));
+    free(heap.bitmap);
+}
+
+/*
+ * Compares reserving and freeing `count` blocks with loops of `reserve_region`
+ * and `free_region` calls against single calls to `reserve_region_batch` and
+ * `free_region_batch`.
+ */
+void bench_batch(unsigned long memory_size, unsigned long block_size,
+    unsigned long count)
+{
+    printf("[BENCH] Bitmap allocator batch: memory=%lX, block_size=%lu, count=%lu\n",
+        memory_size, block_size, count);
+    const int memory_map_capacity = 8;
+    const int rounds = 256;
+    memory_region_t arr[memory_map_capacity];
+    memory_map_t memory_map = {
+        .array = arr,
+        .capacity = memory_map_capacity,
+        .size = 0
+    };
+    memmap_insert_region(&memory_map, 0, memory_size, M_AVAILABLE);
+
+    bitmap_heap_descriptor_t heap = {
+        .bitmap = malloc(bitmap_size(&memory_map, block_size, 2)),
+        .block_size = block_size,
+        .cache = NULL,
+        .cache_capacity = 0,
+        .block_bits = 2,
+        .offset = 0,
+        .mmap = NULL
+    };
+    if(initialize_heap(&heap, &memory_map))
+    {
+        printf("\tFailed to initialize heap.\n");
+        free(heap.bitmap);
+        return;
+    }
+
+    unsigned long *locations = malloc(sizeof(unsigned long) * count);
+    double loop_ns = 0, batch_ns = 0, free_loop_ns = 0, free_batch_ns = 0;
+    for(int round = 0; round < rounds; round++)
+    {
+        struct timespec start, end;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        for(unsigned long i = 0; i < count; i++)
+        {
+            locations[i] = reserve_region(&heap, block_size);
+        }
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        loop_ns += elapsed_ns(&start, &end);
+
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        for(unsigned long i = 0; i < count; i++)
+        {
+            free_region(&heap, locations[i], 0);
+        }
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        free_loop_ns += elapsed_ns(&start, &end);
+
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        reserve_region_batch(&heap, block_size, count, locations);
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        batch_ns += elapsed_ns(&start, &end);
+
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        free_region_batch(&heap, locations, NULL, count);
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        free_batch_ns += elapsed_ns(&start, &end);
+    }
+    printf("\treserve loop: %8.1f ns/block, batch: %8.1f ns/block, speedup %.1fx\n",
+        loop_ns / (rounds * count), batch_ns / (rounds * count), loop_ns / batch_ns);
+    printf("\tfree loop:    %8.1f ns/block, batch: %8.1f ns/block, speedup %.1fx\n",
+        free_loop_ns / (rounds * count), free_batch_ns / (rounds * count),
+        free_loop_ns / free_batch_ns);
+    free(locations);
+    free(heap.bitmap);
+}
+
+/*
+ * Measures how long each word scanner takes to initialize a heap. A sparse
+ * heap has a few small available regions spread across a large address
+ * range, so most words scanned are empty; a dense heap is entirely available.
+ */
+void bench_scan(unsigned long memory_size, unsigned long block_size,
+    unsigned long bits, int sparse)
+{
+    printf("[BENCH] Bitmap allocator scanners: memory=%lX, block_size=%lu, block_bits=%lu, %s\n",
+        memory_size, block_size, bits, sparse ? "sparse" : "dense");
+    static const char *names[] = {"auto", "scalar", "sse2", "avx2", "avx512"};
+    const int memory_map_capacity = 64;
+    const int rounds = 16;
+    memory_region_t arr[memory_map_capacity];
+    memory_map_t memory_map = {
+        .array = arr,
+        .capacity = memory_map_capacity,
+        .size = 0
+    };
+    if(sparse)
+    {
+        for(unsigned long i = 1; i <= 16; i++)
+        {
+            memmap_insert_region(&memory_map, i * (memory_size / 16) - (1UL << 20),
+                1UL << 20, M_AVAILABLE);
+        }
+    }
+    else
+    {
+        memmap_insert_region(&memory_map, 0, memory_size, M_AVAILABLE);
+    }
+
+    unsigned long *bitmap = malloc(bitmap_size(&memory_map, block_size, bits));
+    for(bitmap_scan_t scan = BITMAP_SCAN_SCALAR; scan <= BITMAP_SCAN_AVX512; scan++)
+    {
+        bitmap_heap_descriptor_t heap;
+        double total_ns = 0;
+        for(int round = 0; round < rounds; round++)
+        {
+            bitmap_heap_descriptor_t init = {
+                .bitmap = bitmap,
+                .block_size = block_size,
+                .cache = NULL,
+                .cache_capacity = 0,
+                .block_bits = bits,
+                .offset = 0,
+                .scan = scan,
+                .mmap = NULL
+            };
+            heap = init;
+            struct timespec start, end;
+            clock_gettime(CLOCK_MONOTONIC, &start);
+            initialize_heap(&heap, &memory_map);
+            clock_gettime(CLOCK_MONOTONIC, &end);
+            total_ns += elapsed_ns(&start, &end);
+        }
+        if(heap.scan == scan)
+        {
+            printf("\t%-8s %10.1f us/init\n", names[scan], total_ns / rounds / 1000);
+        }
+        else
+        {
+            printf("\t%-8s unsupported\n", names[scan]);
+        }
+    }
+    free(bitmap);
+}
+
+typedef struct scaling_args_t
+{
+    bitmap_heap_descriptor_t *heap;
+    pthread_spinlock_t *lock;
+    unsigned long operations;
+} scaling_args_t;
+
+static void *scaling_thread(void *arg)
+{
+    scaling_args_t *args = arg;
+    unsigned long held[32];
+    unsigned long count = 0;
+    unsigned long block_size = args->heap->block_size;
+    for(unsigned long i = 0; i < args->operations; i++)
+    {
+        if(args->lock != NULL)
+        {
+            pthread_spin_lock(args->lock);
+        }
+        if(count == 32 || (count > 16 && (i & 1)))
+        {
+            free_region(args->heap, held[--count], block_size);
+        }
+        else
+        {
+            unsigned long location = reserve_region(args->heap, block_size);
+            if(location != NOMEM)
+            {
+                held[count++] = location;
+            }
+        }
+        if(args->lock != NULL)
+        {
+            pthread_spin_unlock(args->lock);
+        }
+    }
+    while(count > 0)
+    {
+        free_region(args->heap, held[--count], block_size);
+    }
+    return NULL;
+}
+
+/*
+ * Measures the throughput of single-block reservations and frees made from
+ * several threads at once, comparing concurrent mode with a heap protected
+ * by a global spinlock.
+ */
+void bench_concurrent(unsigned long memory_size, unsigned long block_size,
+    int max_threads)
+{
+    printf("[BENCH] Bitmap allocator concurrent mode: memory=%lX, block_size=%lu\n",
+        memory_size, block_size);
+    const int memory_map_capacity = 8;
+    const unsigned long operations = 1UL << 20;
+    memory_region_t arr[memory_map_capacity];
+    memory_map_t memory_map = {
+        .array = arr,
+        .capacity = memory_map_capacity,
+        .size = 0
+    };
+    memmap_insert_region(&memory_map, 0, memory_size, M_AVAILABLE);
+
+    for(int threads = 1; threads <= max_threads; threads *= 2)
+    {
+        double mops[2];
+        for(int concurrent = 0; concurrent < 2; concurrent++)
+        {
+            bitmap_heap_descriptor_t heap = {
+                .bitmap = malloc(bitmap_size(&memory_map, block_size, 2)),
+                .block_size = block_size,
+                .cache = NULL,
+                .cache_capacity = 0,
+                .block_bits = 2,
+                .offset = 0,
+                .concurrent = concurrent,
+                .mmap = NULL
+            };
+            if(initialize_heap(&heap, &memory_map))
+            {
+                printf("\tFailed to initialize heap.\n");
+                free(heap.bitmap);
+                return;
+            }
+
+            pthread_spinlock_t lock;
+            pthread_spin_init(&lock, PTHREAD_PROCESS_PRIVATE);
+            pthread_t handles[threads];
+            scaling_args_t args = {
+                .heap = &heap,
+                .lock = concurrent ? NULL : &lock,
+                .operations = operations / threads
+            };
+            struct timespec start, end;
+            clock_gettime(CLOCK_MONOTONIC, &start);
+            for(int i = 0; i < threads; i++)
+            {
+                pthread_create(&handles[i], NULL, scaling_thread, &args);
+            }
+            for(int i = 0; i < threads; i++)
+            {
+                pthread_join(handles[i], NULL);
+            }
+            clock_gettime(CLOCK_MONOTONIC, &end);
+            mops[concurrent] = 1e3 * operations / elapsed_ns(&start, &end);
+            pthread_spin_destroy(&lock);
+            free(heap.bitmap);
+        }
+        printf("\t%2i threads: locked %6.2f Mops/s, concurrent %6.2f Mops/s\n",
+            threads, mops[0], mops[1]);
+    }
+}
+
+/*
+ * Measures the latency of read_bit on random blocks of a heap filled with
+ * regions of `region_blocks` blocks, with and without an owner table.
+ */
+void bench_owners(unsigned long memory_size, unsigned long block_size,
+    unsigned long region_blocks)
+{
+    printf("[BENCH] Bitmap allocator owner lookup: memory=%lX, block_size=%lu, region_blocks=%lu\n",
+        memory_size, block_size, region_blocks);
+    const int memory_map_capacity = 8;
+    const unsigned long lookups = 1UL << 22;
+    memory_region_t arr[memory_map_capacity];
+    memory_map_t memory_map = {
+        .array = arr,
+        .capacity = memory_map_capacity,
+        .size = 0
+    };
+    memmap_insert_region(&memory_map, 0, memory_size, M_AVAILABLE);
+
+    double ns[2];
+    for(int table = 0; table < 2; table++)
+    {
+        bitmap_heap_descriptor_t heap = {
+            .bitmap = malloc(bitmap_size(&memory_map, block_size, 4)),
+            .owners = table ? malloc(owner_table_size(&memory_map, block_size)) : NULL,
+            .block_size = block_size,
+            .cache = NULL,
+            .cache_capacity = 0,
+            .block_bits = 4,
+            .offset = 0,
+            .mmap = NULL
+        };
+        if(initialize_heap(&heap, &memory_map))
+        {
+            printf("\tFailed to initialize heap.\n");
+            free(heap.bitmap);
+            free(heap.owners);
+            return;
+        }
+        while(reserve_region(&heap, region_blocks * block_size) != NOMEM);
+
+        unsigned long blocks = memory_size / block_size;
+        unsigned long seed = 1, sum = 0;
+        struct timespec start, end;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        for(unsigned long i = 0; i < lookups; i++)
+        {
+            seed = seed * 6364136223846793005UL + 1442695040888963407UL;
+            sum += read_bit(&heap, ((seed >> 20) % blocks) * block_size, 3);
+        }
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        ns[table] = elapsed_ns(&start, &end) / lookups;
+        if(sum > lookups)
+        {
+            printf("\tUnexpected result.\n");
+        }
+        free(heap.bitmap);
+        free(heap.owners);
+    }
+    printf("\ttree walk: %6.1f ns/lookup, owner table: %6.1f ns/lookup\n", ns[0], ns[1]);
+}
+
+/*
+ * Compares the time taken to initialize a heap all at once with the time
+ * taken to initialize only its first section, and to build the remaining
+ * sections one at a time.
+ */
+void bench_sections(unsigned long memory_size, unsigned long block_size,
+    unsigned long section_size)
+{
+    printf("[BENCH] Bitmap allocator sections: memory=%lX, block_size=%lu, section_size=%lX\n",
+        memory_size, block_size, section_size);
+    const int memory_map_capacity = 8;
+    memory_region_t arr[memory_map_capacity];
+    memory_map_t memory_map = {
+        .array = arr,
+        .capacity = memory_map_capacity,
+        .size = 0
+    };
+    memmap_insert_region(&memory_map, 0, memory_size, M_AVAILABLE);
+
+    double init_ns[2], build_ns = 0;
+    unsigned long sections = 0;
+    for(int sectioned = 0; sectioned < 2; sectioned++)
+    {
+        bitmap_heap_descriptor_t heap = {
+            .bitmap = malloc(bitmap_size(&memory_map, block_size, 2)),
+            .block_size = block_size,
+            .cache = NULL,
+            .cache_capacity = 0,
+            .block_bits = 2,
+            .offset = 0,
+            .section_size = sectioned ? section_size : 0,
+            .mmap = NULL
+        };
+
+        struct timespec start, end;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        if(initialize_heap(&heap, &memory_map))
+        {
+            printf("\tFailed to initialize heap.\n");
+            free(heap.bitmap);
+            return;
+        }
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        init_ns[sectioned] = elapsed_ns(&start, &end);
+
+        if(sectioned)
+        {
+            clock_gettime(CLOCK_MONOTONIC, &start);
+            while(initialize_section(&heap) > 0);
+            clock_gettime(CLOCK_MONOTONIC, &end);
+            build_ns = elapsed_ns(&start, &end);
+            sections = heap.next_section;
+        }
+        free(heap.bitmap);
+    }
+    printf("\tall at once: %8.3f ms, first section: %8.3f ms, remaining %lu sections: %8.3f ms\n",
+        init_ns[0] / 1e6, init_ns[1] / 1e6, sections - 1, build_ns / 1e6);
+}
+
+/*
+ * Compares the generic functions with the variant specialized for 2 bits per
+ * 4 KiB block, filling the heap one block at a time, reading the metadata of
+ * random blocks and freeing every block again.
+ */
+void bench_specialized(unsigned long memory_size)
+{
+    printf("[BENCH] Bitmap allocator specialized variant: memory=%lX, block_size=4096, block_bits=2\n",
+        memory_size);
+    const int memory_map_capacity = 8;
+    const unsigned long block_size = 4096;
+    memory_region_t arr[memory_map_capacity];
+    memory_map_t memory_map = {
+        .array = arr,
+        .capacity = memory_map_capacity,
+        .size = 0
+    };
+    memmap_insert_region(&memory_map, 0, memory_size, M_AVAILABLE);
+
+    unsigned long blocks = memory_size / block_size;
+    unsigned long *locations = malloc(sizeof(unsigned long) * blocks);
+    for(int fixed = 0; fixed < 2; fixed++)
+    {
+        bitmap_heap_descriptor_t heap = {
+            .bitmap = malloc(bitmap_size(&memory_map, block_size, 2)),
+            .block_size = block_size,
+            .cache = NULL,
+            .cache_capacity = 0,
+            .block_bits = 2,
+            .offset = 0,
+            .mmap = NULL
+        };
+        if(fixed ? fixed_initialize_heap(&heap, &memory_map) : initialize_heap(&heap, &memory_map))
+        {
+            printf("\tFailed to initialize heap.\n");
+            free(heap.bitmap);
+            break;
+        }
+
+        struct timespec start, end;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        for(unsigned long i = 0; i < blocks; i++)
+        {
+            locations[i] = fixed ? fixed_reserve_region(&heap, block_size)
+                : reserve_region(&heap, block_size);
+        }
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        double reserve_ns = elapsed_ns(&start, &end) / blocks;
+
+        unsigned long seed = 1, sum = 0;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        for(unsigned long i = 0; i < blocks; i++)
+        {
+            seed = seed * 6364136223846793005UL + 1442695040888963407UL;
+            unsigned long location = locations[(seed >> 20) % blocks];
+            sum += fixed ? fixed_read_bit(&heap, location, 1) : read_bit(&heap, location, 1);
+        }
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        double read_ns = elapsed_ns(&start, &end) / blocks;
+
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        for(unsigned long i = 0; i < blocks; i++)
+        {
+            if(fixed)
+            {
+                fixed_free_region(&heap, locations[i], block_size);
+            }
+            else
+            {
+                free_region(&heap, locations[i], block_size);
+            }
+        }
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        double free_ns = elapsed_ns(&start, &end) / blocks;
+
+        if(sum > blocks || heap.free_block_count != blocks)
+        {
+            printf("\tUnexpected result.\n");
+        }
+        printf("\t%-11s reserve: %6.1f ns/op, read_bit: %6.1f ns/op, free: %6.1f ns/op\n",
+            fixed ? "specialized" : "generic", reserve_ns, read_ns, free_ns);
+        free(heap.bitmap);
+    }
+    free(locations);
+}
+
+/*
+ * Compares a heap with its metadata interleaved in the bitmap with one which
+ * keeps it separately, by the time taken to build the tree, which scans every
+ * word, and to reserve every block one at a time.
+ */
+void bench_split(unsigned long memory_size, unsigned long block_size,
+    unsigned long bits)
+{
+    printf("[BENCH] Bitmap allocator split metadata: memory=%lX, block_size=%lu, block_bits=%lu\n",
+        memory_size, block_size, bits);
+    const int memory_map_capacity = 8;
+    const int rounds = 8;
+    memory_region_t arr[memory_map_capacity];
+    memory_map_t memory_map = {
+        .array = arr,
+        .capacity = memory_map_capacity,
+        .size = 0
+    };
+    memmap_insert_region(&memory_map, 0, memory_size, M_AVAILABLE);
+
+    unsigned long blocks = memory_size / block_size;
+    for(int split = 0; split < 2; split++)
+    {
+        unsigned long storage_size = bitmap_size(&memory_map, block_size, split ? 1 : bits);
+        bitmap_heap_descriptor_t heap = {
+            .bitmap = malloc(storage_size),
+            .metadata = split ? malloc(metadata_size(&memory_map, block_size, bits)) : NULL,
+            .block_size = block_size,
+            .cache = NULL,
+            .cache_capacity = 0,
+            .block_bits = bits,
+            .offset = 0,
+            .mmap = NULL
+        };
+        bitmap_heap_descriptor_t init = heap;
+
+        double init_ns = 0;
+        for(int round = 0; round < rounds; round++)
+        {
+            heap = init;
+            struct timespec start, end;
+            clock_gettime(CLOCK_MONOTONIC, &start);
+            initialize_heap(&heap, &memory_map);
+            clock_gettime(CLOCK_MONOTONIC, &end);
+            init_ns += elapsed_ns(&start, &end) / rounds;
+        }
+
+        struct timespec start, end;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        for(unsigned long i = 0; i < blocks; i++)
+        {
+            reserve_region(&heap, block_size);
+        }
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        if(heap.free_block_count != 0)
+        {
+            printf("\tUnexpected result.\n");
+        }
+
+        printf("\t%-11s bitmap: %8lu KiB, init: %8.1f us (%5.2f blocks/ns), fill: %6.1f ns/block\n",
+            split ? "split" : "interleaved", storage_size / 1024, init_ns / 1000,
+            blocks / init_ns, elapsed_ns(&start, &end) / blocks);
+        free(heap.bitmap);
+        free(heap.metadata);
+    }
+}
+
+/*
+ * Compares the time to build a heap from its memory map with the time to save
+ * and restore a snapshot of it, as a warm restart would.
+ */
+void bench_snapshot(unsigned long memory_size, unsigned long block_size,
+    unsigned long bits)
+{
+    printf("[BENCH] Bitmap allocator snapshot: memory=%lX, block_size=%lu, block_bits=%lu\n",
+        memory_size, block_size, bits);
+    const int memory_map_capacity = 8;
+    memory_region_t arr[memory_map_capacity];
+    memory_map_t memory_map = {
+        .array = arr,
+        .capacity = memory_map_capacity,
+        .size = 0
+    };
+    memmap_insert_region(&memory_map, 0, memory_size, M_AVAILABLE);
+    memmap_insert_region(&memory_map, memory_size / 3, memory_size / 10, M_UNAVAILABLE);
+
+    bitmap_heap_descriptor_t heap = {
+        .bitmap = malloc(bitmap_size(&memory_map, block_size, bits)),
+        .block_size = block_size,
+        .cache = NULL,
+        .cache_capacity = 0,
+        .block_bits = bits,
+        .offset = 0,
+        .mmap = NULL
+    };
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    initialize_heap(&heap, &memory_map);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    double init_ns = elapsed_ns(&start, &end);
+
+    unsigned long length = snapshot_size(&heap);
+    void *buffer = malloc(length);
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    save_snapshot(&heap, buffer, length);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    double save_ns = elapsed_ns(&start, &end);
+
+    bitmap_heap_descriptor_t restored = {0};
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    int status = restore_snapshot(&restored, buffer, length);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    if(status || restored.free_block_count != heap.free_block_count)
+    {
+        printf("\tUnexpected result.\n");
+    }
+
+    printf("\tsnapshot: %8lu KiB, init: %9.1f us, save: %9.1f us, restore: %6.1f us\n",
+        length / 1024, init_ns / 1000, save_ns / 1000, elapsed_ns(&start, &end) / 1000);
+    free(buffer);
+    free(heap.bitmap);
+}
+
+#if defined(__linux__)
+/*
+ * Reports the amount of anonymous memory of the process backed by huge
+ * pages, in bytes.
+ */
+static unsigned long huge_page_bytes(void)
+{
+    unsigned long kb = 0;
+    char line[256];
+    FILE *f = fopen("/proc/self/smaps_rollup", "r");
+    while(f && fgets(line, sizeof(line), f))
+    {
+        if(sscanf(line, "AnonHugePages: %lu kB", &kb) == 1)
+        {
+            break;
+        }
+    }
+    if(f)
+    {
+        fclose(f);
+    }
+    return kb * 1024;
+}
+
+/*
+ * Stands in for as many tenants as there are page colors in the L2 cache,
+ * which reserve their working sets one block each in turn, as they would
+ * when running side by side. With `reserve_region` every block a tenant gets
+ * has the same color, so its working set competes for a fraction of the
+ * cache; with `reserve_region_colored` and a color kept by each tenant, its
+ * blocks are spread over every color. The first tenant then reads its
+ * working set, half the size of the L2 cache, a cache line at a time in a
+ * random order which defeats the prefetchers.
+ * 
+ * The heap is placed in memory backed by huge pages, so that within each
+ * huge page the address bits which select a cache set are the same as in
+ * the physical address.
+ */
+void bench_colors(unsigned long block_size, unsigned long bits)
+{
+    long cache_size = sysconf(_SC_LEVEL2_CACHE_SIZE);
+    long ways = sysconf(_SC_LEVEL2_CACHE_ASSOC);
+    if(cache_size <= 0 || ways <= 0)
+    {
+        cache_size = 1L << 20;
+        ways = 16;
+    }
+    unsigned long colors = cache_size / ways / block_size;
+    unsigned long pages = cache_size / 2 / block_size;
+    unsigned long memory_size = 2 * colors * pages * block_size;
+    printf("[BENCH] Bitmap allocator colors: memory=%lX, block_size=%lu, block_bits=%lu, colors=%lu\n",
+        memory_size, block_size, bits, colors);
+
+    const unsigned long huge = 1UL << 21;
+    char *mapping = mmap(NULL, memory_size + huge, PROT_READ | PROT_WRITE,
+        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if(mapping == MAP_FAILED)
+    {
+        printf("\tFailed to map memory.\n");
+        return;
+    }
+    char *memory = (char*)(((unsigned long)mapping + huge - 1) & ~(huge - 1));
+    madvise(memory, memory_size, MADV_HUGEPAGE);
+    memset(memory, 0, memory_size);
+    printf("\t%lu of %lu bytes backed by huge pages\n", huge_page_bytes(), memory_size);
+
+    const int memory_map_capacity = 8;
+    memory_region_t arr[memory_map_capacity];
+    memory_map_t memory_map = {
+        .array = arr,
+        .capacity = memory_map_capacity,
+        .size = 0
+    };
+    memmap_insert_region(&memory_map, 0, memory_size, M_AVAILABLE);
+
+    unsigned long lines_per_page = block_size / 64;
+    unsigned long lines = pages * lines_per_page;
+    unsigned long *locations = malloc(sizeof(unsigned long) * colors * pages);
+    unsigned long *order = malloc(sizeof(unsigned long) * lines);
+    unsigned long *cursors = malloc(sizeof(unsigned long) * colors);
+    unsigned long *per_color = malloc(sizeof(unsigned long) * colors);
+    static const char *names[] = {"lowest", "colored"};
+    for(int colored = 0; colored <= 1; colored++)
+    {
+        bitmap_heap_descriptor_t heap = {
+            .bitmap = malloc(bitmap_size(&memory_map, block_size, bits)),
+            .block_size = block_size,
+            .block_bits = bits,
+            .offset = (unsigned long)memory,
+            .colors = colored ? colors : 0,
+            .mmap = NULL
+        };
+        if(initialize_heap(&heap, &memory_map))
+        {
+            printf("\tFailed to initialize heap.\n");
+            free(heap.bitmap);
+            continue;
+        }
+
+        for(unsigned long tenant = 0; tenant < colors; tenant++)
+        {
+            cursors[tenant] = 0;
+            per_color[tenant] = 0;
+        }
+        for(unsigned long i = 0; i < colors * pages; i++)
+        {
+            unsigned long tenant = i % colors;
+            locations[i] = colored
+                ? reserve_region_colored(&heap, block_size, &cursors[tenant])
+                : reserve_region(&heap, block_size);
+        }
+
+        // Chain the lines of the first tenant's blocks in a random order
+        for(unsigned long i = 0; i < lines; i++)
+        {
+            order[i] = i;
+        }
+        for(unsigned long i = lines - 1; i > 0; i--)
+        {
+            unsigned long j = rand() % (i + 1);
+            unsigned long t = order[i];
+            order[i] = order[j];
+            order[j] = t;
+        }
+        for(unsigned long i = 0; i < lines; i++)
+        {
+            unsigned long from = order[i];
+            unsigned long to = order[(i + 1) % lines];
+            char *line = (char*)locations[(from / lines_per_page) * colors] + (from % lines_per_page) * 64;
+            *(char**)line = (char*)locations[(to / lines_per_page) * colors] + (to % lines_per_page) * 64;
+        }
+        unsigned long most = 0;
+        for(unsigned long p = 0; p < pages; p++)
+        {
+            unsigned long color = (locations[p * colors] / block_size) % colors;
+            per_color[color]++;
+            most = per_color[color] > most ? per_color[color] : most;
+        }
+
+        const unsigned long rounds = 32;
+        char **cursor = (char**)((char*)locations[(order[0] / lines_per_page) * colors]
+            + (order[0] % lines_per_page) * 64);
+        for(unsigned long i = 0; i < lines; i++)
+        {
+            cursor = (char**)*cursor;
+        }
+        struct timespec start, end;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        for(unsigned long i = 0; i < rounds * lines; i++)
+        {
+            cursor = (char**)*cursor;
+        }
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        if(cursor == NULL)
+        {
+            printf("\tBroken chain.\n");
+        }
+        printf("\t%-8s %lu blocks, at most %lu of one color: %5.2f ns/load\n", names[colored],
+            pages, most, elapsed_ns(&start, &end) / (rounds * lines));
+        free(heap.bitmap);
+    }
+    free(per_color);
+    free(cursors);
+    free(order);
+    free(locations);
+    munmap(mapping, memory_size + huge);
+}
+#endif
+
+/*
+ * Reports the latency of single-block reserves and frees in a heap packing
+ * its reservations into groups of `pack_size` bytes, after every other block
+ * was freed at random so that nearly every group is partly used and each
+ * reserve soon has to find the next fullest group.
+ */
+void bench_pack(unsigned long memory_size, unsigned long block_size, unsigned long pack_size)
+{
+    printf("[BENCH] Bitmap allocator packing: memory=%lX, block_size=%lu, pack_size=%lX\n",
+        memory_size, block_size, pack_size);
+    const int memory_map_capacity = 8;
+    const int rounds = 1 << 20;
+    memory_region_t arr[memory_map_capacity];
+    memory_map_t memory_map = {
+        .array = arr,
+        .capacity = memory_map_capacity,
+        .size = 0
+    };
+    memmap_insert_region(&memory_map, 0, memory_size, M_AVAILABLE);
+
+    bitmap_heap_descriptor_t heap = {
+        .bitmap = malloc(bitmap_size(&memory_map, block_size, 2)),
+        .block_size = block_size,
+        .block_bits = 2,
+        .offset = 0,
+        .pack_counts = malloc(pack_table_size(&memory_map, block_size, 0, pack_size)),
+        .pack_size = pack_size,
+        .mmap = NULL
+    };
+    if(initialize_heap(&heap, &memory_map))
+    {
+        printf("\tFailed to initialize heap.\n");
+        free(heap.pack_counts);
+        free(heap.bitmap);
+        return;
+    }
+
+    unsigned long total = heap.free_block_count;
+    unsigned long *locations = malloc(sizeof(unsigned long) * total);
+    unsigned long count = 0;
+    for(unsigned long i = 0; i < total; i++)
+    {
+        locations[count++] = reserve_region(&heap, block_size);
+    }
+    unsigned long seed = 0x9e3779b97f4a7c15UL;
+    while(count > total / 2)
+    {
+        seed ^= seed << 13, seed ^= seed >> 7, seed ^= seed << 17;
+        unsigned long j = seed % count;
+        free_region(&heap, locations[j], block_size);
+        locations[j] = locations[--count];
+    }
+
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for(int i = 0; i < rounds; i++)
+    {
+        seed ^= seed << 13, seed ^= seed >> 7, seed ^= seed << 17;
+        unsigned long j = seed % count;
+        free_region(&heap, locations[j], block_size);
+        locations[j] = reserve_region(&heap, block_size);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    printf("\t%8.1f ns/reserve+free\n", elapsed_ns(&start, &end) / rounds);
+
+    free(locations);
+    free(heap.pack_counts);
+    free(heap.bitmap);
+}
+
+int main(int argc, char **args)
+{
+    bench_fill(1UL << 28, 4096);
+    bench_fill(1UL << 32, 4096);
+    for(unsigned long depth = 1; depth <= 64; depth *= 4)
+    {
+        bench_cache(1UL << 32, 4096, depth);
+    }
+    bench_batch(1UL << 32, 4096, 512);
+    bench_batch(1UL << 32, 4096, 4096);
+    for(unsigned long bits = 1; bits <= 4; bits *= 4)
+    {
+        bench_scan(1UL << 36, 4096, bits, 1);
+        bench_scan(1UL << 36, 4096, bits, 0);
+    }
+    bench_concurrent(1UL << 32, 4096, 16);
+    bench_owners(1UL << 34, 4096, 1);
+    bench_owners(1UL << 34, 4096, 512);
+    bench_sections(1UL << 40, 4096, 1UL << 30);
+    bench_sections(1UL << 40, 4096, 1UL << 34);
+    bench_specialized(1UL << 28);
+    bench_specialized(1UL << 32);
+    for(unsigned long bits = 4; bits <= 16; bits *= 2)
+    {
+        bench_split(1UL << 34, 4096, bits);
+    }
+    bench_snapshot(1UL << 36, 4096, 2);
+    bench_pack(1UL << 30, 4096, 1UL << 21);
+    bench_pack(1UL << 36, 4096, 1UL << 21);
+#if defined(__linux__)
+    bench_colors(4096, 2);
+#endif
+    return 0;
+}
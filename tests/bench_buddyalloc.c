@@ -0,0 +1,477 @@
+#include "libmalloc/buddy_alloc.h"
+#include <pthread.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <time.h>
+
+static double elapsed_ns(const struct timespec *start, const struct timespec *end)
+{
+    return (end->tv_sec - start->tv_sec) * 1e9 + (end->tv_nsec - start->tv_nsec);
+}
+
+/*
+ * Fragments a heap by reserving every block and freeing every other one, so
+ * only the lowest order has blocks left, and then gives back the whole upper
+ * half to leave a single block at the order below the top. Reports the
+ * latency of a reserve and free of each order against that heap, where every
+ * reserve must pass over the empty orders between the one it asks for and
+ * the top, and of reserves which fail outright once the upper half is taken.
+ */
+void bench_orders(unsigned long memory_size, unsigned long block_size)
+{
+    printf("[BENCH] Buddy allocator orders: memory=%lX, block_size=%lu\n", memory_size, block_size);
+    const int memory_map_capacity = 8;
+    const int rounds = 1 << 20;
+    memory_region_t arr[memory_map_capacity];
+    memory_map_t memory_map = {
+        .array = arr,
+        .capacity = memory_map_capacity,
+        .size = 0
+    };
+    memmap_insert_region(&memory_map, 0, memory_size, M_AVAILABLE);
+
+    buddy_descriptor_t heap = {
+        .avail = malloc(sizeof(buddy_block_t) * 64),
+        .block_map = malloc(buddy_map_size(&memory_map, block_size)),
+        .block_size = block_size,
+        .mmap = NULL,
+        .offset = 0
+    };
+    if(buddy_alloc_init(&heap, &memory_map))
+    {
+        printf("\tFailed to initialize heap.\n");
+        free(heap.block_map);
+        free(heap.avail);
+        return;
+    }
+
+    unsigned long total = heap.free_block_count;
+    unsigned long *locations = malloc(sizeof(unsigned long) * total);
+    for(unsigned long i = 0; i < total; i++)
+    {
+        locations[i] = buddy_reserve(&heap, block_size);
+    }
+    for(unsigned long i = 0; i < total; i += 2)
+    {
+        buddy_free(&heap, locations[i]);
+    }
+    for(unsigned long i = total / 2 + 1; i < total; i += 2)
+    {
+        buddy_free(&heap, locations[i]);
+    }
+
+    for(unsigned long k = 1; k < heap.max_kval; k += 4)
+    {
+        struct timespec start, end;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        for(int i = 0; i < rounds; i++)
+        {
+            buddy_free(&heap, buddy_reserve(&heap, block_size << k));
+        }
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        printf("\torder %2lu: %8.1f ns/reserve+free\n", k, elapsed_ns(&start, &end) / rounds);
+    }
+
+    unsigned long upper = buddy_reserve(&heap, block_size << (heap.max_kval - 1));
+    struct timespec start, end;
+    unsigned long failures = 0;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for(int i = 0; i < rounds; i++)
+    {
+        failures += buddy_reserve(&heap, block_size << 1) == NOMEM;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    printf("\tfailed:   %8.1f ns/reserve (%lu/%i failed)\n", elapsed_ns(&start, &end) / rounds,
+        failures, rounds);
+    buddy_free(&heap, upper);
+
+    free(locations);
+    free(heap.block_map);
+    free(heap.avail);
+}
+
+/*
+ * Half fills a heap with blocks of random orders, and then reports the
+ * latency of reserves and frees of random orders at random places in it,
+ * where the size of the block map decides how much of it stays cached.
+ */
+void bench_random(unsigned long memory_size, unsigned long block_size)
+{
+    printf("[BENCH] Buddy allocator random: memory=%lX, block_size=%lu\n", memory_size, block_size);
+    const int memory_map_capacity = 8;
+    const int rounds = 1 << 22;
+    memory_region_t arr[memory_map_capacity];
+    memory_map_t memory_map = {
+        .array = arr,
+        .capacity = memory_map_capacity,
+        .size = 0
+    };
+    memmap_insert_region(&memory_map, 0, memory_size, M_AVAILABLE);
+
+    buddy_descriptor_t heap = {
+        .avail = malloc(sizeof(buddy_block_t) * 64),
+        .block_map = malloc(buddy_map_size(&memory_map, block_size)),
+        .block_size = block_size,
+        .mmap = NULL,
+        .offset = 0
+    };
+    if(buddy_alloc_init(&heap, &memory_map))
+    {
+        printf("\tFailed to initialize heap.\n");
+        free(heap.block_map);
+        free(heap.avail);
+        return;
+    }
+    printf("\tblock map: %lu KiB\n", heap.block_map_size >> 10);
+
+    unsigned long total = memory_size / block_size;
+    unsigned long *locations = malloc(sizeof(unsigned long) * total);
+    unsigned long count = 0;
+    unsigned long seed = 0x9e3779b97f4a7c15UL;
+    while(heap.free_block_count > total / 2)
+    {
+        seed ^= seed << 13, seed ^= seed >> 7, seed ^= seed << 17;
+        unsigned long location = buddy_reserve(&heap, block_size << (seed % 4));
+        if(location != NOMEM)
+        {
+            locations[count++] = location;
+        }
+    }
+
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for(int i = 0; i < rounds; i++)
+    {
+        seed ^= seed << 13, seed ^= seed >> 7, seed ^= seed << 17;
+        if(seed & 1)
+        {
+            unsigned long j = (seed >> 1) % count;
+            buddy_free(&heap, locations[j]);
+            locations[j] = locations[--count];
+        }
+        else
+        {
+            unsigned long location = buddy_reserve(&heap, block_size << ((seed >> 1) % 4));
+            if(location != NOMEM)
+            {
+                locations[count++] = location;
+            }
+        }
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    printf("\t%8.1f ns/op\n", elapsed_ns(&start, &end) / rounds);
+
+    free(locations);
+    free(heap.block_map);
+    free(heap.avail);
+}
+
+/*
+ * Reports how long setting up a heap takes, over a memory map with a few
+ * holes in it, where the heap is much larger than the caches.
+ */
+void bench_init(unsigned long memory_size, unsigned long block_size)
+{
+    printf("[BENCH] Buddy allocator init: memory=%lX, block_size=%lu\n", memory_size, block_size);
+    const int memory_map_capacity = 16;
+    const int rounds = 4;
+    memory_region_t arr[memory_map_capacity];
+    memory_map_t memory_map = {
+        .array = arr,
+        .capacity = memory_map_capacity,
+        .size = 0
+    };
+    memmap_insert_region(&memory_map, 0, memory_size, M_AVAILABLE);
+    for(int i = 1; i < 4; i++)
+    {
+        memmap_insert_region(&memory_map, memory_size / 4 * i + 0x12345, 0x100000, M_UNAVAILABLE);
+    }
+
+    buddy_descriptor_t heap = {
+        .avail = malloc(sizeof(buddy_block_t) * 64),
+        .block_map = malloc(buddy_map_size(&memory_map, block_size)),
+        .block_size = block_size,
+        .mmap = NULL,
+        .offset = 0
+    };
+
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for(int i = 0; i < rounds; i++)
+    {
+        if(buddy_alloc_init(&heap, &memory_map))
+        {
+            printf("\tFailed to initialize heap.\n");
+            break;
+        }
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    printf("\tblock map: %lu KiB\n", heap.block_map_size >> 10);
+    printf("\t%8.3f ms/init\n", elapsed_ns(&start, &end) / rounds / 1e6);
+
+    free(heap.block_map);
+    free(heap.avail);
+}
+
+static pthread_spinlock_t heap_lock;
+static __thread unsigned long thread_cpu;
+
+static unsigned long bench_cpu_id(void)
+{
+    return thread_cpu;
+}
+
+static void bench_lock(buddy_descriptor_t *heap)
+{
+    pthread_spin_lock(&heap_lock);
+}
+
+static void bench_unlock(buddy_descriptor_t *heap)
+{
+    pthread_spin_unlock(&heap_lock);
+}
+
+typedef struct scaling_args_t
+{
+    buddy_pcp_descriptor_t *pcp;
+    unsigned long cpu;
+    unsigned long operations;
+} scaling_args_t;
+
+static void *scaling_thread(void *arg)
+{
+    scaling_args_t *args = arg;
+    unsigned long held[32];
+    unsigned long count = 0;
+    unsigned long block_size = args->pcp->heap->block_size;
+    thread_cpu = args->cpu;
+    for(unsigned long i = 0; i < args->operations; i++)
+    {
+        if(count == 32 || (count > 16 && (i & 1)))
+        {
+            buddy_pcp_free(args->pcp, held[--count]);
+        }
+        else
+        {
+            unsigned long location = buddy_pcp_reserve(args->pcp, block_size);
+            if(location != NOMEM)
+            {
+                held[count++] = location;
+            }
+        }
+    }
+    while(count > 0)
+    {
+        buddy_pcp_free(args->pcp, held[--count]);
+    }
+    return NULL;
+}
+
+/*
+ * Measures the throughput of single-block reserves and frees made from
+ * several threads at once, each standing in for a CPU, comparing a heap
+ * behind a global spinlock with the same heap behind per-CPU lists.
+ */
+void bench_pcp(unsigned long memory_size, unsigned long block_size, int max_threads)
+{
+    printf("[BENCH] Buddy allocator per-CPU lists: memory=%lX, block_size=%lu\n",
+        memory_size, block_size);
+    const int memory_map_capacity = 8;
+    const unsigned long operations = 1UL << 22;
+    memory_region_t arr[memory_map_capacity];
+    memory_map_t memory_map = {
+        .array = arr,
+        .capacity = memory_map_capacity,
+        .size = 0
+    };
+    memmap_insert_region(&memory_map, 0, memory_size, M_AVAILABLE);
+
+    for(int threads = 1; threads <= max_threads; threads *= 2)
+    {
+        double mops[2];
+        for(int cached = 0; cached < 2; cached++)
+        {
+            buddy_descriptor_t heap = {
+                .avail = malloc(sizeof(buddy_block_t) * 64),
+                .block_map = malloc(buddy_map_size(&memory_map, block_size)),
+                .block_size = block_size,
+                .mmap = NULL,
+                .offset = 0
+            };
+            if(buddy_alloc_init(&heap, &memory_map))
+            {
+                printf("\tFailed to initialize heap.\n");
+                free(heap.block_map);
+                free(heap.avail);
+                return;
+            }
+
+            // Without caching, every block goes straight to the heap
+            buddy_pcp_t *lists = aligned_alloc(64, sizeof(buddy_pcp_t) * threads);
+            buddy_pcp_descriptor_t pcp = {
+                .heap = &heap,
+                .lists = lists,
+                .cpu_count = threads,
+                .orders = cached ? 1 : 0,
+                .low = 32,
+                .high = 96,
+                .cpu_id = bench_cpu_id,
+                .lock = bench_lock,
+                .unlock = bench_unlock
+            };
+            buddy_pcp_init(&pcp);
+            pthread_spin_init(&heap_lock, PTHREAD_PROCESS_PRIVATE);
+            pthread_t handles[threads];
+            scaling_args_t args[threads];
+            struct timespec start, end;
+            clock_gettime(CLOCK_MONOTONIC, &start);
+            for(int i = 0; i < threads; i++)
+            {
+                args[i] = (scaling_args_t){
+                    .pcp = &pcp,
+                    .cpu = i,
+                    .operations = operations / threads
+                };
+                pthread_create(&handles[i], NULL, scaling_thread, &args[i]);
+            }
+            for(int i = 0; i < threads; i++)
+            {
+                pthread_join(handles[i], NULL);
+            }
+            clock_gettime(CLOCK_MONOTONIC, &end);
+            mops[cached] = 1e3 * operations / elapsed_ns(&start, &end);
+            pthread_spin_destroy(&heap_lock);
+            free(lists);
+            free(heap.block_map);
+            free(heap.avail);
+        }
+        printf("\t%2i threads: locked %6.2f Mops/s, per-CPU %6.2f Mops/s\n",
+            threads, mops[0], mops[1]);
+    }
+}
+
+/*
+ * Ages a heap through rounds of filling it nearly full with single blocks
+ * of mixed mobility, mostly movable and a few long-lived unmovable ones, and
+ * freeing a random share of them, with and without grouping by mobility.
+ * Then reports how many pageblock-sized reserves still succeed once every
+ * movable and reclaimable block is given back, as compaction and reclaim
+ * would, leaving only the unmovable ones pinned in place.
+ */
+void bench_mobility(unsigned long memory_size, unsigned long block_size,
+    unsigned long pageblock_kval)
+{
+    printf("[BENCH] Buddy allocator mobility: memory=%lX, block_size=%lu, pageblock_kval=%lu\n",
+        memory_size, block_size, pageblock_kval);
+    const int memory_map_capacity = 8;
+    const int rounds = 64;
+    memory_region_t arr[memory_map_capacity];
+    memory_map_t memory_map = {
+        .array = arr,
+        .capacity = memory_map_capacity,
+        .size = 0
+    };
+    memmap_insert_region(&memory_map, 0, memory_size, M_AVAILABLE);
+
+    for(int grouped = 0; grouped < 2; grouped++)
+    {
+        buddy_descriptor_t heap = {
+            .avail = malloc(sizeof(buddy_block_t) * BUDDY_MOBILITY_TYPES * (BUDDY_MAX_KVAL + 1)),
+            .block_map = malloc(buddy_map_size(&memory_map, block_size)),
+            .block_size = block_size,
+            .mmap = NULL,
+            .offset = 0,
+            .pageblock_types = grouped
+                ? malloc(buddy_pageblock_types_size(&memory_map, block_size, pageblock_kval))
+                : NULL,
+            .pageblock_kval = pageblock_kval
+        };
+        if(buddy_alloc_init(&heap, &memory_map))
+        {
+            printf("\tFailed to initialize heap.\n");
+            free(heap.pageblock_types);
+            free(heap.block_map);
+            free(heap.avail);
+            return;
+        }
+
+        unsigned long total = heap.free_block_count;
+        unsigned long *locations = malloc(sizeof(unsigned long) * total);
+        unsigned char *types = malloc(total);
+        unsigned long count = 0;
+        unsigned long seed = 0x9e3779b97f4a7c15UL;
+        for(int round = 0; round < rounds; round++)
+        {
+            while(heap.free_block_count > total / 16)
+            {
+                seed ^= seed << 13, seed ^= seed >> 7, seed ^= seed << 17;
+                unsigned long type = seed % 100 < 4 ? BUDDY_UNMOVABLE
+                    : seed % 100 < 12 ? BUDDY_RECLAIMABLE
+                    : BUDDY_MOVABLE;
+                unsigned long location = buddy_reserve_type(&heap, block_size, type);
+                if(location == NOMEM)
+                {
+                    break;
+                }
+                locations[count] = location;
+                types[count++] = type;
+            }
+            for(unsigned long i = 0; i < count; i++)
+            {
+                seed ^= seed << 13, seed ^= seed >> 7, seed ^= seed << 17;
+                if(seed % 100 < (types[i] == BUDDY_UNMOVABLE ? 10 : 50))
+                {
+                    buddy_free(&heap, locations[i]);
+                    count--;
+                    locations[i] = locations[count];
+                    types[i--] = types[count];
+                }
+            }
+        }
+
+        unsigned long pinned = 0;
+        for(unsigned long i = 0; i < count; i++)
+        {
+            if(types[i] == BUDDY_UNMOVABLE)
+            {
+                pinned++;
+            }
+            else
+            {
+                buddy_free(&heap, locations[i]);
+            }
+        }
+        unsigned long pageblocks = 0;
+        while(buddy_reserve_type(&heap, block_size << pageblock_kval, BUDDY_MOVABLE) != NOMEM)
+        {
+            pageblocks++;
+        }
+        printf("\t%-10s %lu unmovable blocks pinned, %lu/%lu pageblocks free (%.1f%%)",
+            grouped ? "grouped:" : "ungrouped:", pinned, pageblocks, total >> pageblock_kval,
+            100.0 * pageblocks / (total >> pageblock_kval));
+        if(grouped)
+        {
+            printf(", %lu fallbacks, %lu claims", heap.fallback_count, heap.claim_count);
+        }
+        printf("\n");
+
+        free(types);
+        free(locations);
+        free(heap.pageblock_types);
+        free(heap.block_map);
+        free(heap.avail);
+    }
+}
+
+int main(int argc, char **args)
+{
+    bench_orders(1UL << 32, 4096);
+    bench_orders(1UL << 34, 4096);
+    bench_random(1UL << 28, 4096);
+    bench_random(1UL << 34, 4096);
+    bench_init(1UL << 30, 4096);
+    bench_init(1UL << 36, 4096);
+    bench_pcp(1UL << 30, 4096, 8);
+    bench_mobility(1UL << 30, 4096, 9);
+    return 0;
+}
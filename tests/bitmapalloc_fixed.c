@@ -0,0 +1,8 @@
+/*
+ * The bitmap allocator specialized for 2 bits per block and 4 KiB blocks,
+ * compared against the generic functions by the tests and benchmarks.
+ */
+#define BITMAP_ALLOC_NAME fixed
+#define BITMAP_ALLOC_BLOCK_BITS 2
+#define BITMAP_ALLOC_BLOCK_SIZE_SHIFT 12
+#include "../src/bitmap_alloc.c"
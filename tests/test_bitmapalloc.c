@@ -3,7 +3,11 @@
 #include <stdlib.h>
 #include <assert.h>
 #include <stdio.h>
+#include <string.h>
 #include <time.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <unistd.h>
 
 typedef struct memblock_t
 {
@@ -11,6 +15,8 @@ typedef struct memblock_t
     unsigned long location;
 } memblock_t;
 
+BITMAP_ALLOC_DECLARE(fixed);
+
 void print_heap_desc(bitmap_heap_descriptor_t *heap)
 {
     printf("heap = {\n"
@@ -57,6 +63,37 @@ void print_memory_map(memory_map_t *map)
     printf("}\n}\n");
 }
 
+/*
+ * The number of regions the memory map of each test can hold.
+ */
+#define MAP_CAPACITY 64
+
+/*
+ * Sets up `memory_map`, backed by the MAP_CAPACITY entries of `regions`, with
+ * `size` bytes of available memory at location 0, and returns a heap over it
+ * with a bitmap of `bits` bits per block allocated to fit. The heap's other
+ * fields are left zero, for the test to set, along with any unavailable
+ * memory, before initializing it.
+ */
+static bitmap_heap_descriptor_t setup_heap(memory_map_t *memory_map,
+    memory_region_t *regions, unsigned long size, unsigned long block_size,
+    unsigned long bits)
+{
+    memory_map->array = regions;
+    memory_map->capacity = MAP_CAPACITY;
+    memory_map->size = 0;
+    memmap_insert_region(memory_map, 0, size, M_AVAILABLE);
+
+    bitmap_heap_descriptor_t heap = {
+        .bitmap = malloc(bitmap_size(memory_map, block_size, bits)),
+        .block_size = block_size,
+        .block_bits = bits,
+        .offset = 0,
+        .mmap = NULL
+    };
+    return heap;
+}
+
 void test_heap(unsigned long size, unsigned long block_size, unsigned long bits, int result)
 {
     printf("[TEST] Bitmap allocator: memory=%lX, block_size=%lu, block_bits=%lu\n", size, block_size, bits);
@@ -140,23 +177,1669 @@ void test_heap(unsigned long size, unsigned long block_size, unsigned long bits,
     free(heap_data);
 }
 
-int main(int argc, char **args)
+void test_cache(unsigned long depth)
 {
-    srand(time(0));
-    test_heap(32, 1, 1, 1);
-    test_heap(256, 0, 1, 1);
-    test_heap(256, 1, 0, 1);
-    test_heap(256, 1, 3, 1);
-    test_heap(256, 1, 128, 1);
-    test_heap(256, 1, 4, 1);
+    printf("[TEST] Bitmap allocator cache: cache_depth=%lu\n", depth);
+    const int cache_capacity = 512;
+    const unsigned long size = 1 << 16;
+    const unsigned long block_size = 16;
+    memory_region_t arr[MAP_CAPACITY];
+    unsigned long heap_cache[cache_capacity];
+    memory_map_t memory_map;
+    bitmap_heap_descriptor_t heap = setup_heap(&memory_map, arr, size, block_size, 2);
+    heap.cache = heap_cache;
+    heap.cache_capacity = cache_capacity;
+    heap.cache_depth = depth;
+    assert(!initialize_heap(&heap, &memory_map));
+    unsigned long total_blocks = heap.free_block_count;
 
-    for(int bs = 1; bs <= 32; bs *= 2)
+    // Fill the heap, then free every other block so that no buddies merge
+    unsigned long *locations = malloc(sizeof(unsigned long) * total_blocks);
+    for(unsigned long i = 0; i < total_blocks; i++)
     {
-        unsigned long heap_size = (1 << llog2(bs)) * 256;
-        unsigned long n = (8 * sizeof(unsigned long)) - 1 - __builtin_clzl((unsigned long) bs);
-        for(int bits = 1; bits < (8 * sizeof(unsigned long)) && (2 * bits) < (8 * (1 << n)); bits <<= 1)
+        locations[i] = reserve_region(&heap, block_size);
+        assert(locations[i] != NOMEM);
+    }
+    for(unsigned long i = 0; i < total_blocks; i += 2)
+    {
+        free_region(&heap, locations[i], 0);
+    }
+
+    heap.cache_hits = 0;
+    heap.cache_misses = 0;
+    for(unsigned long i = 0; i < total_blocks; i += 2)
+    {
+        locations[i] = reserve_region(&heap, block_size);
+        assert(locations[i] != NOMEM);
+        assert(i == 0 || locations[i] != locations[i - 2]);
+    }
+    printf("\t%lu hits, %lu misses\n", heap.cache_hits, heap.cache_misses);
+    assert(heap.cache_hits >= heap.cache_misses * (depth < 4 ? depth : 4));
+    assert(heap.free_block_count == 0);
+    assert(reserve_region(&heap, block_size) == NOMEM);
+
+    for(unsigned long i = 0; i < total_blocks; i++)
+    {
+        free_region(&heap, locations[i], 0);
+    }
+    assert(heap.free_block_count == total_blocks);
+    free(locations);
+    free(heap.bitmap);
+}
+
+void test_batch(unsigned long size, unsigned long block_size, unsigned long bits)
+{
+    printf("[TEST] Bitmap allocator batch: memory=%lX, block_size=%lu, block_bits=%lu\n", size, block_size, bits);
+    memory_region_t arr[MAP_CAPACITY];
+    memory_map_t memory_map;
+    bitmap_heap_descriptor_t heap = setup_heap(&memory_map, arr, size, block_size, bits);
+    assert(!initialize_heap(&heap, &memory_map));
+    unsigned long total_blocks = heap.free_block_count;
+
+    // Leave the heap fragmented by a mix of sizes before batching
+    memblock_t *held = malloc(sizeof(memblock_t) * total_blocks);
+    unsigned long held_count = 0;
+    for(int i = 0; i < total_blocks / 8; i++)
+    {
+        held[held_count].size = heap.block_size * (rand() % 4 + 1);
+        held[held_count].location = reserve_region(&heap, held[held_count].size);
+        if(held[held_count].location != NOMEM)
         {
-            test_heap(heap_size, bs, bits, 0);
+            held_count++;
+        }
+        if(i % 2 && held_count > 0)
+        {
+            held_count--;
+            free_region(&heap, held[held_count].location, bits < 2 ? held[held_count].size : 0);
+        }
+    }
+
+    unsigned long free_blocks = heap.free_block_count;
+    unsigned long *locations = malloc(sizeof(unsigned long) * total_blocks);
+    unsigned long count = reserve_region_batch(&heap, block_size, free_blocks / 2, locations);
+    assert(count == free_blocks / 2);
+    assert(heap.free_block_count == free_blocks - count);
+    count += reserve_region_batch(&heap, block_size, total_blocks, locations + count);
+    assert(count == free_blocks);
+    assert(heap.free_block_count == 0);
+
+    for(unsigned long i = 0; i < count; i++)
+    {
+        assert(locations[i] >= heap.offset);
+        assert(locations[i] + block_size <= heap.offset + size);
+        for(unsigned long j = i + 1; j < count; j++)
+        {
+            assert(locations[i] != locations[j]);
+        }
+        for(unsigned long j = 0; j < held_count; j++)
+        {
+            assert(locations[i] + block_size <= held[j].location
+                || locations[i] >= held[j].location + held[j].size);
+        }
+    }
+
+    for(unsigned long i = 0; i < count; i++)
+    {
+        free_region(&heap, locations[i], block_size);
+    }
+    for(unsigned long i = 0; i < held_count; i++)
+    {
+        free_region(&heap, held[i].location, bits < 2 ? held[i].size : 0);
+    }
+    assert(heap.free_block_count == total_blocks);
+    free(locations);
+    free(held);
+    free(heap.bitmap);
+}
+
+void test_free_batch(unsigned long size, unsigned long block_size, unsigned long bits)
+{
+    printf("[TEST] Bitmap allocator batch free: memory=%lX, block_size=%lu, block_bits=%lu\n", size, block_size, bits);
+    memory_region_t arr[MAP_CAPACITY];
+    memory_map_t memory_map;
+    bitmap_heap_descriptor_t heaps[2];
+    heaps[0] = setup_heap(&memory_map, arr, size, block_size, bits);
+    memmap_insert_region(&memory_map, size / 3, size / 10, M_UNAVAILABLE);
+
+    // Two identical heaps, one freed a region at a time and one in a batch
+    unsigned long storage_size = bitmap_size(&memory_map, block_size, bits);
+    heaps[1] = heaps[0];
+    heaps[1].bitmap = malloc(storage_size);
+    for(int i = 0; i < 2; i++)
+    {
+        assert(!initialize_heap(&heaps[i], &memory_map));
+    }
+    unsigned long total_blocks = heaps[0].free_block_count;
+
+    memblock_t *blocks = malloc(sizeof(memblock_t) * total_blocks);
+    unsigned long count = 0;
+    while(1)
+    {
+        unsigned long block_count = rand() % 4 + 1;
+        blocks[count].size = heaps[0].block_size * block_count;
+        blocks[count].location = reserve_region(&heaps[0], blocks[count].size);
+        if(blocks[count].location == NOMEM)
+        {
+            break;
+        }
+        assert(reserve_region(&heaps[1], blocks[count].size) == blocks[count].location);
+        count++;
+    }
+
+    // Free a random subset, in random order
+    unsigned long *locations = malloc(sizeof(unsigned long) * count);
+    unsigned long *sizes = malloc(sizeof(unsigned long) * count);
+    unsigned long freed = 0;
+    for(unsigned long i = 0; i < count; i++)
+    {
+        unsigned long j = i + rand() % (count - i);
+        memblock_t tmp = blocks[i];
+        blocks[i] = blocks[j];
+        blocks[j] = tmp;
+        if(rand() % 4)
+        {
+            locations[freed] = blocks[i].location;
+            sizes[freed] = blocks[i].size;
+            free_region(&heaps[0], locations[freed], sizes[freed]);
+            freed++;
+        }
+    }
+    free_region_batch(&heaps[1], locations, sizes, freed);
+    assert(heaps[0].free_block_count == heaps[1].free_block_count);
+    assert(memcmp(heaps[0].bitmap, heaps[1].bitmap, storage_size) == 0);
+    printf("\tFreed %lu of %lu regions, heaps match.\n", freed, count);
+
+    free(locations);
+    free(sizes);
+    free(blocks);
+    free(heaps[0].bitmap);
+    free(heaps[1].bitmap);
+}
+
+void test_scan(unsigned long size, unsigned long block_size, unsigned long bits)
+{
+    printf("[TEST] Bitmap allocator scanners: memory=%lX, block_size=%lu, block_bits=%lu\n", size, block_size, bits);
+    memory_region_t arr[MAP_CAPACITY];
+    memory_map_t memory_map;
+    bitmap_heap_descriptor_t base = setup_heap(&memory_map, arr, size, block_size, bits);
+    for(int i = 0; i < 16; i++)
+    {
+        memmap_insert_region(&memory_map, rand() % size, rand() % (size / 16), M_UNAVAILABLE);
+    }
+
+    // Every scanner must build exactly the same heap as the scalar one
+    unsigned long storage_size = bitmap_size(&memory_map, block_size, bits);
+    unsigned long *expected = NULL;
+    unsigned long expected_blocks = 0;
+    for(bitmap_scan_t scan = BITMAP_SCAN_SCALAR; scan <= BITMAP_SCAN_AVX512; scan++)
+    {
+        bitmap_heap_descriptor_t heap = base;
+        heap.bitmap = scan == BITMAP_SCAN_SCALAR ? base.bitmap : malloc(storage_size);
+        heap.scan = scan;
+        assert(!initialize_heap(&heap, &memory_map));
+        assert(heap.scan <= scan && heap.scan >= BITMAP_SCAN_SCALAR);
+        printf("\tRequested scanner %i, using %i\n", scan, heap.scan);
+        if(expected == NULL)
+        {
+            expected = heap.bitmap;
+            expected_blocks = heap.free_block_count;
+        }
+        else
+        {
+            assert(heap.free_block_count == expected_blocks);
+            assert(memcmp(heap.bitmap, expected, storage_size) == 0);
+            free(heap.bitmap);
+        }
+    }
+    free(expected);
+}
+
+typedef struct stress_args_t
+{
+    bitmap_heap_descriptor_t *heap;
+    unsigned char *owners;
+    unsigned long iterations;
+    unsigned int seed;
+} stress_args_t;
+
+void *stress_thread(void *arg)
+{
+    stress_args_t *args = arg;
+    bitmap_heap_descriptor_t *heap = args->heap;
+    const unsigned long capacity = 64;
+    memblock_t held[capacity];
+    unsigned long count = 0;
+    for(unsigned long i = 0; i < args->iterations; i++)
+    {
+        if(count == capacity || (count > 0 && rand_r(&args->seed) % 2))
+        {
+            unsigned long j = rand_r(&args->seed) % count;
+            unsigned long first = held[j].location / heap->block_size;
+            for(unsigned long k = 0; k < held[j].size / heap->block_size; k++)
+            {
+                __atomic_store_n(&args->owners[first + k], 0, __ATOMIC_SEQ_CST);
+            }
+            free_region(heap, held[j].location, held[j].size);
+            held[j] = held[--count];
+        }
+        else
+        {
+            unsigned long size = heap->block_size << (rand_r(&args->seed) % 3);
+            unsigned long location = reserve_region(heap, size);
+            if(location == NOMEM)
+            {
+                continue;
+            }
+
+            // No other thread may hold any part of the region
+            unsigned long first = location / heap->block_size;
+            for(unsigned long k = 0; k < size / heap->block_size; k++)
+            {
+                unsigned char expected = 0;
+                assert(__atomic_compare_exchange_n(&args->owners[first + k], &expected, 1,
+                    0, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST));
+            }
+            held[count].location = location;
+            held[count].size = size;
+            count++;
+        }
+    }
+
+    for(unsigned long j = 0; j < count; j++)
+    {
+        unsigned long first = held[j].location / heap->block_size;
+        for(unsigned long k = 0; k < held[j].size / heap->block_size; k++)
+        {
+            __atomic_store_n(&args->owners[first + k], 0, __ATOMIC_SEQ_CST);
+        }
+        free_region(heap, held[j].location, held[j].size);
+    }
+    return NULL;
+}
+
+void test_concurrent(unsigned long size, unsigned long block_size, unsigned long bits, int threads,
+    int split)
+{
+    printf("[TEST] Bitmap allocator concurrent mode: memory=%lX, block_size=%lu, block_bits=%lu, threads=%i, split=%i\n", 
+        size, block_size, bits, threads, split);
+    memory_region_t arr[MAP_CAPACITY];
+    memory_map_t memory_map;
+    bitmap_heap_descriptor_t heap = setup_heap(&memory_map, arr, size, block_size, split ? 1 : bits);
+    memmap_insert_region(&memory_map, size / 3, size / 10, M_UNAVAILABLE);
+    unsigned long flags_size = metadata_size(&memory_map, block_size, bits);
+    heap.metadata = split ? malloc(flags_size) : NULL;
+    heap.block_bits = bits;
+    heap.concurrent = 1;
+    assert(!initialize_heap(&heap, &memory_map));
+    unsigned long total_blocks = heap.free_block_count;
+    unsigned long *initial = malloc(heap.bitmap_size);
+    memcpy(initial, heap.bitmap, heap.bitmap_size);
+
+    unsigned char *owners = calloc(size / block_size, 1);
+    pthread_t handles[threads];
+    stress_args_t args[threads];
+    for(int i = 0; i < threads; i++)
+    {
+        args[i].heap = &heap;
+        args[i].owners = owners;
+        args[i].iterations = 50000;
+        args[i].seed = rand();
+        assert(!pthread_create(&handles[i], NULL, stress_thread, &args[i]));
+    }
+    for(int i = 0; i < threads; i++)
+    {
+        pthread_join(handles[i], NULL);
+    }
+
+    // Every merge must have happened, leaving the heap as it was initialized
+    assert(heap.free_block_count == total_blocks);
+    assert(memcmp(heap.bitmap, initial, heap.bitmap_size) == 0);
+    for(unsigned long i = 0; split && i < flags_size / sizeof(unsigned long); i++)
+    {
+        assert(heap.metadata[i] == 0);
+    }
+    free(owners);
+    free(initial);
+    free(heap.bitmap);
+    free(heap.metadata);
+}
+
+void test_split(unsigned long size, unsigned long block_size, unsigned long bits,
+    unsigned long section_size)
+{
+    printf("[TEST] Bitmap allocator split metadata: memory=%lX, block_size=%lu, block_bits=%lu, section_size=%lu\n",
+        size, block_size, bits, section_size);
+    memory_region_t arr[MAP_CAPACITY];
+    memory_map_t memory_map;
+    bitmap_heap_descriptor_t heaps[2];
+    heaps[0] = setup_heap(&memory_map, arr, size, block_size, bits);
+    memmap_insert_region(&memory_map, size / 3, size / 10, M_UNAVAILABLE);
+    heaps[0].offset = 0x1000;
+    heaps[0].section_size = section_size;
+
+    // Two identical heaps, one with its metadata interleaved and one without
+    unsigned long flags_size = metadata_size(&memory_map, block_size, bits);
+    heaps[1] = heaps[0];
+    heaps[1].bitmap = malloc(bitmap_size(&memory_map, block_size, 1));
+    heaps[1].metadata = malloc(flags_size);
+    memset(heaps[1].metadata, 0xFF, flags_size);
+    for(int i = 0; i < 2; i++)
+    {
+        assert(!initialize_heap(&heaps[i], &memory_map));
+        while(initialize_section(&heaps[i]));
+    }
+    assert(heaps[1].blocks_in_word == 8 * sizeof(unsigned long));
+    assert(heaps[1].bitmap_size * bits == heaps[0].bitmap_size);
+    unsigned long free_blocks = heaps[1].free_block_count;
+    unsigned long *initial = malloc(heaps[1].bitmap_size);
+    memcpy(initial, heaps[1].bitmap, heaps[1].bitmap_size);
+
+    unsigned long total = size / block_size;
+    memblock_t *blocks = malloc(sizeof(memblock_t) * (total + 1));
+    unsigned long count = 0;
+    while(1)
+    {
+        blocks[count].size = block_size << (rand() % 4);
+        blocks[count].location = reserve_region(&heaps[0], blocks[count].size);
+        assert(reserve_region(&heaps[1], blocks[count].size) == blocks[count].location);
+        if(blocks[count].location == NOMEM)
+        {
+            break;
+        }
+        else if(bits > 2 && rand() % 2)
+        {
+            assert(write_bit(&heaps[0], blocks[count].location, bits - 1, 1) == 1);
+            assert(write_bit(&heaps[1], blocks[count].location, bits - 1, 1) == 1);
+        }
+        count++;
+    }
+    assert(heaps[0].free_block_count == heaps[1].free_block_count);
+
+    // Every block must read the same metadata through both heaps
+    for(unsigned long i = 0; i < count; i++)
+    {
+        for(unsigned long bit = 1; bit < bits; bit++)
+        {
+            assert(read_bit(&heaps[0], blocks[i].location, bit) 
+                == read_bit(&heaps[1], blocks[i].location, bit));
+        }
+        if(bits > 2)
+        {
+            write_bit(&heaps[0], blocks[i].location, bits - 1, 0);
+            write_bit(&heaps[1], blocks[i].location, bits - 1, 0);
+        }
+    }
+
+    // Free half one at a time and the rest in a batch
+    unsigned long *locations = malloc(sizeof(unsigned long) * (count + 1));
+    unsigned long *sizes = malloc(sizeof(unsigned long) * (count + 1));
+    unsigned long batch = 0;
+    for(unsigned long i = 0; i < count; i++)
+    {
+        if(rand() % 2)
+        {
+            free_region(&heaps[0], blocks[i].location, blocks[i].size);
+            free_region(&heaps[1], blocks[i].location, blocks[i].size);
+        }
+        else
+        {
+            locations[batch] = blocks[i].location;
+            sizes[batch++] = blocks[i].size;
+        }
+    }
+    free_region_batch(&heaps[1], locations, bits > 1 ? NULL : sizes, batch);
+
+    unsigned long out[64];
+    unsigned long reserved = reserve_region_batch(&heaps[1], block_size, 64, out);
+    for(unsigned long i = 0; i < reserved; i++)
+    {
+        assert(read_bit(&heaps[1], out[i], 1));
+    }
+    free_region_batch(&heaps[1], out, NULL, bits > 1 ? reserved : 0);
+    for(unsigned long i = 0; bits == 1 && i < reserved; i++)
+    {
+        free_region(&heaps[1], out[i], block_size);
+    }
+
+    // The availability tree must be back where it started, with no state left
+    assert(heaps[1].free_block_count == free_blocks);
+    assert(memcmp(heaps[1].bitmap, initial, heaps[1].bitmap_size) == 0);
+    for(unsigned long i = 0; i < flags_size / sizeof(unsigned long); i++)
+    {
+        assert(heaps[1].metadata[i] == 0);
+    }
+
+    free(locations);
+    free(sizes);
+    free(blocks);
+    free(initial);
+    free(heaps[0].bitmap);
+    free(heaps[1].bitmap);
+    free(heaps[1].metadata);
+}
+
+void test_owners(unsigned long size, unsigned long block_size, unsigned long bits)
+{
+    printf("[TEST] Bitmap allocator owner table: memory=%lX, block_size=%lu, block_bits=%lu\n", size, block_size, bits);
+    memory_region_t arr[MAP_CAPACITY];
+    memory_map_t memory_map;
+    bitmap_heap_descriptor_t heaps[2];
+    heaps[0] = setup_heap(&memory_map, arr, size, block_size, bits);
+    memmap_insert_region(&memory_map, size / 3, size / 10, M_UNAVAILABLE);
+    heaps[0].offset = 0x1000;
+
+    // Two identical heaps, one with an owner table and one without
+    unsigned long storage_size = bitmap_size(&memory_map, block_size, bits);
+    unsigned long table_size = owner_table_size(&memory_map, block_size);
+    heaps[1] = heaps[0];
+    heaps[1].bitmap = malloc(storage_size);
+    heaps[1].owners = malloc(table_size);
+    memset(heaps[1].owners, 0xFF, table_size);
+    for(int i = 0; i < 2; i++)
+    {
+        assert(!initialize_heap(&heaps[i], &memory_map));
+    }
+
+    memblock_t *blocks = malloc(sizeof(memblock_t) * heaps[0].free_block_count);
+    unsigned long count = 0;
+    unsigned long flagged = 0;
+    while(1)
+    {
+        blocks[count].size = block_size << (rand() % 4);
+        blocks[count].location = reserve_region(&heaps[0], blocks[count].size);
+        if(blocks[count].location == NOMEM)
+        {
+            break;
+        }
+        assert(reserve_region(&heaps[1], blocks[count].size) == blocks[count].location);
+        if(bits > 2 && rand() % 2)
+        {
+            unsigned long inner = blocks[count].location 
+                + block_size * (rand() % (blocks[count].size / block_size));
+            assert(write_bit(&heaps[0], blocks[count].location, bits - 1, 1) == 1);
+            assert(write_bit(&heaps[1], inner, bits - 1, 1) == 1);
+            flagged++;
+        }
+        count++;
+    }
+
+    // Every block of every region must see the same metadata through both heaps
+    for(unsigned long i = 0; i < count; i++)
+    {
+        unsigned long expected = read_bit(&heaps[0], blocks[i].location, bits - 1);
+        for(unsigned long b = 0; b < blocks[i].size; b += block_size)
+        {
+            assert(read_bit(&heaps[0], blocks[i].location + b, bits - 1) == expected);
+            assert(read_bit(&heaps[1], blocks[i].location + b, bits - 1) == expected);
+        }
+    }
+    if(bits > 2)
+    {
+        assert(memcmp(heaps[0].bitmap, heaps[1].bitmap, storage_size) == 0);
+        assert(read_bit_range(&heaps[1], heaps[1].offset, size, bits - 1) == flagged);
+        assert(write_bit_range(&heaps[1], heaps[1].offset, size, bits - 1, 1) == count);
+        assert(read_bit_range(&heaps[1], heaps[1].offset, size, bits - 1) == count);
+        assert(read_bit_range(&heaps[0], heaps[0].offset, size, bits - 1) == flagged);
+    }
+
+    // Freeing every region must leave the table empty
+    for(unsigned long i = 0; i < count; i++)
+    {
+        free_region(&heaps[1], blocks[i].location, block_size);
+    }
+    for(unsigned long i = 0; i < table_size; i++)
+    {
+        assert(heaps[1].owners[i] == 0);
+    }
+    printf("\tChecked %lu regions.\n", count);
+    free(blocks);
+    for(int i = 0; i < 2; i++)
+    {
+        free(heaps[i].bitmap);
+        free(heaps[i].owners);
+    }
+}
+
+void test_sections(unsigned long size, unsigned long block_size, unsigned long bits,
+    unsigned long section_size)
+{
+    printf("[TEST] Bitmap allocator sections: memory=%lX, block_size=%lu, block_bits=%lu, section_size=%lX\n", size, block_size, bits, section_size);
+    memory_region_t arr[MAP_CAPACITY];
+    memory_map_t memory_map;
+    bitmap_heap_descriptor_t heaps[3];
+    heaps[0] = setup_heap(&memory_map, arr, size, block_size, bits);
+    for(int i = 0; i < 8; i++)
+    {
+        memmap_insert_region(&memory_map, rand() % size, rand() % (size / 16), M_UNAVAILABLE);
+    }
+
+    // One heap built all at once, one built explicitly and one on demand
+    unsigned long storage_size = bitmap_size(&memory_map, block_size, bits);
+    for(int i = 1; i < 3; i++)
+    {
+        heaps[i] = heaps[0];
+        heaps[i].bitmap = malloc(storage_size);
+        heaps[i].section_size = section_size;
+    }
+    for(int i = 0; i < 3; i++)
+    {
+        assert(!initialize_heap(&heaps[i], &memory_map));
+    }
+    unsigned long total_blocks = heaps[0].free_block_count;
+    assert(heaps[1].free_block_count <= total_blocks);
+
+    while(initialize_section(&heaps[1]) > 0);
+    assert(heaps[1].free_block_count == total_blocks);
+    assert(memcmp(heaps[0].bitmap, heaps[1].bitmap, storage_size) == 0);
+
+    // Allocating everything must build every section without overlaps
+    unsigned char *owners = calloc(size / block_size, 1);
+    unsigned long *locations = malloc(sizeof(unsigned long) * (total_blocks + 1));
+    unsigned long count = 0;
+    while((locations[count] = reserve_region(&heaps[2], block_size)) != NOMEM)
+    {
+        assert(!owners[locations[count] / block_size]);
+        owners[locations[count] / block_size] = 1;
+        count++;
+    }
+    assert(count == total_blocks);
+    assert(initialize_section(&heaps[2]) == 0);
+    for(unsigned long i = 0; i < count; i++)
+    {
+        free_region(&heaps[2], locations[i], block_size);
+    }
+    assert(heaps[2].free_block_count == total_blocks);
+    assert(memcmp(heaps[0].bitmap, heaps[2].bitmap, storage_size) == 0);
+    printf("\tBuilt %lu sections.\n", heaps[1].next_section);
+
+    free(owners);
+    free(locations);
+    for(int i = 0; i < 3; i++)
+    {
+        free(heaps[i].bitmap);
+    }
+}
+
+void test_sparse(unsigned long block_size, unsigned long bits, unsigned long section_size)
+{
+    printf("[TEST] Bitmap allocator sparse heap: block_size=%lu, block_bits=%lu, section_size=%lX\n", block_size, bits, section_size);
+    const int memory_map_capacity = 32;
+    memory_region_t arr[memory_map_capacity];
+    memory_map_t memory_map = {
+        .array = arr,
+        .capacity = memory_map_capacity,
+        .size = 0
+    };
+    unsigned long hole = 1UL << 26;
+    memmap_insert_region(&memory_map, 0, 1 << 14, M_AVAILABLE);
+    memmap_insert_region(&memory_map, hole / 2 + 100, 3000, M_AVAILABLE);
+    memmap_insert_region(&memory_map, hole, 1 << 14, M_AVAILABLE);
+    memmap_insert_region(&memory_map, hole + 1000, 200, M_UNAVAILABLE);
+
+    // A sparse heap must hold the same blocks as one spanning the holes
+    unsigned long sections = sparse_section_count(&memory_map, block_size, section_size);
+    unsigned long storage_size = sparse_bitmap_size(&memory_map, block_size, bits, section_size);
+    assert(storage_size < bitmap_size(&memory_map, block_size, bits) / 64);
+    bitmap_heap_descriptor_t dense = {
+        .bitmap = malloc(bitmap_size(&memory_map, block_size, bits)),
+        .block_size = block_size,
+        .cache = NULL,
+        .cache_capacity = 0,
+        .block_bits = bits,
+        .offset = 0x1000,
+        .mmap = NULL
+    };
+    bitmap_heap_descriptor_t sparse = dense;
+    sparse.bitmap = malloc(storage_size);
+    sparse.owners = malloc(sparse_owner_table_size(&memory_map, block_size, section_size));
+    sparse.directory = malloc(sizeof(unsigned long) * sections);
+    sparse.directory_capacity = sections;
+    sparse.section_size = section_size;
+    assert(!initialize_heap(&dense, &memory_map));
+    assert(!initialize_heap(&sparse, &memory_map));
+    assert(sparse.directory_size == sections);
+    unsigned long total_blocks = dense.free_block_count;
+    free(dense.bitmap);
+
+    unsigned char *used = calloc(2 * hole / block_size, 1);
+    memblock_t *blocks = malloc(sizeof(memblock_t) * (total_blocks + 1));
+    unsigned long max_order = llog2(section_size / block_size);
+    for(int round = 0; round < 2; round++)
+    {
+        // Random sizes up to a whole section, then single blocks
+        unsigned long count = 0;
+        while(1)
+        {
+            blocks[count].size = block_size << (round ? 0 : rand() % (max_order + 1));
+            blocks[count].location = reserve_region(&sparse, blocks[count].size);
+            if(blocks[count].location == NOMEM)
+            {
+                break;
+            }
+
+            unsigned long location = blocks[count].location - sparse.offset;
+            for(unsigned long b = location; b < location + blocks[count].size; b += block_size)
+            {
+                assert(b < (1 << 14) || (b >= hole / 2 + 100 && b + block_size <= hole / 2 + 3100)
+                    || (b >= hole && b < hole + (1 << 14) && (b + block_size <= hole + 1000 || b >= hole + 1200)));
+                assert(!used[b / block_size]);
+                used[b / block_size] = 1;
+            }
+            if(bits > 2)
+            {
+                write_bit(&sparse, blocks[count].location, bits - 1, 1);
+            }
+            count++;
         }
+        assert(reserve_region(&sparse, section_size * 2) == NOMEM);
+        assert(round == 0 || count == total_blocks);
+        if(bits > 2)
+        {
+            assert(read_bit_range(&sparse, sparse.offset, hole * 2, bits - 1) == count);
+        }
+
+        for(unsigned long i = 0; i < count; i++)
+        {
+            if(bits > 2)
+            {
+                assert(read_bit(&sparse, blocks[i].location + blocks[i].size - 1, bits - 1));
+                write_bit(&sparse, blocks[i].location, bits - 1, 0);
+            }
+            free_region(&sparse, blocks[i].location, blocks[i].size);
+            memset(used + (blocks[i].location - sparse.offset) / block_size, 0,
+                blocks[i].size / block_size);
+        }
+        assert(sparse.free_block_count == total_blocks);
+    }
+    printf("\t%lu sections, %lu bytes of bitmap.\n", sections, storage_size);
+
+    free(used);
+    free(blocks);
+    free(sparse.bitmap);
+    free(sparse.owners);
+    free(sparse.directory);
+}
+
+void test_huge(unsigned long block_size, unsigned long bits, int height)
+{
+    printf("[TEST] Bitmap allocator huge heap: block_size=%lu, block_bits=%lu, blocks=2^%i\n", block_size, bits, height);
+    const int memory_map_capacity = 8;
+    memory_region_t arr[memory_map_capacity];
+    memory_map_t memory_map = {
+        .array = arr,
+        .capacity = memory_map_capacity,
+        .size = 0
+    };
+    unsigned long memory_size = block_size << height;
+    unsigned long section_size = block_size << 16;
+    memmap_insert_region(&memory_map, 0, section_size, M_AVAILABLE);
+    memmap_insert_region(&memory_map, memory_size - section_size, section_size, M_AVAILABLE);
+
+    // Back the bitmap with a sparse file, so only the pages touched are stored
+    unsigned long storage_size = bitmap_size(&memory_map, block_size, bits);
+    char path[] = "/tmp/test_bitmapalloc.XXXXXX";
+    int fd = mkstemp(path);
+    assert(fd >= 0);
+    unlink(path);
+    void *storage = MAP_FAILED;
+    if(ftruncate(fd, storage_size) == 0)
+    {
+        storage = mmap(NULL, storage_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    }
+    if(storage == MAP_FAILED)
+    {
+        printf("\tCould not map %lu bytes of storage, skipping.\n", storage_size);
+        close(fd);
+        return;
+    }
+
+    bitmap_heap_descriptor_t heap = {
+        .bitmap = storage,
+        .block_size = block_size,
+        .cache = NULL,
+        .cache_capacity = 0,
+        .block_bits = bits,
+        .offset = 0,
+        .section_size = section_size,
+        .mmap = NULL
+    };
+    assert(!initialize_heap(&heap, &memory_map));
+    assert(heap.height == height);
+    assert(heap.free_block_count == section_size / block_size);
+
+    // The top levels are shared between sections; they must come back unchanged
+    unsigned long top_words = 1UL << (height - 16);
+    unsigned long *top = malloc(sizeof(unsigned long) * top_words);
+    memcpy(top, heap.bitmap, sizeof(unsigned long) * top_words);
+
+    unsigned long locations[64];
+    for(int i = 0; i < 64; i++)
+    {
+        locations[i] = reserve_region(&heap, block_size << (i % 4));
+        assert(locations[i] != NOMEM && locations[i] < section_size);
+        assert(write_bit(&heap, locations[i], bits - 1, 1) == 1);
+    }
+    for(int i = 0; i < 64; i++)
+    {
+        assert(read_bit(&heap, locations[i], bits - 1));
+        write_bit(&heap, locations[i], bits - 1, 0);
+        free_region(&heap, locations[i], block_size << (i % 4));
+    }
+    assert(reserve_region(&heap, section_size) == 0);
+    free_region(&heap, 0, section_size);
+    assert(heap.free_block_count == section_size / block_size);
+    assert(memcmp(top, heap.bitmap, sizeof(unsigned long) * top_words) == 0);
+
+    free(top);
+    munmap(storage, storage_size);
+    close(fd);
+}
+
+void test_specialized(unsigned long size)
+{
+    printf("[TEST] Bitmap allocator specialized variant: memory=%lX, block_size=4096, block_bits=2\n", size);
+    const unsigned long block_size = 4096;
+    memory_region_t arr[MAP_CAPACITY];
+    memory_map_t memory_map;
+    bitmap_heap_descriptor_t heaps[2];
+    heaps[0] = setup_heap(&memory_map, arr, size, block_size, 2);
+    memmap_insert_region(&memory_map, size / 3, size / 10, M_UNAVAILABLE);
+
+    // The same operations on a generic and a specialized heap must agree
+    unsigned long storage_size = bitmap_size(&memory_map, block_size, 2);
+    unsigned long caches[2][64];
+    heaps[0].offset = 0x1000;
+    heaps[1] = heaps[0];
+    heaps[1].bitmap = malloc(storage_size);
+    for(int i = 0; i < 2; i++)
+    {
+        heaps[i].cache = caches[i];
+        heaps[i].cache_capacity = 64;
+    }
+    assert(!initialize_heap(&heaps[0], &memory_map));
+    assert(!fixed_initialize_heap(&heaps[1], &memory_map));
+    assert(memcmp(heaps[0].bitmap, heaps[1].bitmap, storage_size) == 0);
+
+    memblock_t *blocks = malloc(sizeof(memblock_t) * heaps[0].free_block_count);
+    unsigned long count = 0;
+    while(1)
+    {
+        blocks[count].size = block_size << (rand() % 4);
+        blocks[count].location = reserve_region(&heaps[0], blocks[count].size);
+        assert(fixed_reserve_region(&heaps[1], blocks[count].size) == blocks[count].location);
+        if(blocks[count].location == NOMEM)
+        {
+            break;
+        }
+        else if(rand() % 2)
+        {
+            assert(write_bit(&heaps[0], blocks[count].location, 1, 0) == 0);
+            assert(fixed_write_bit(&heaps[1], blocks[count].location, 1, 0) == 0);
+        }
+        assert(fixed_read_bit(&heaps[1], blocks[count].location, 1) 
+            == read_bit(&heaps[0], blocks[count].location, 1));
+        count++;
+    }
+    assert(memcmp(heaps[0].bitmap, heaps[1].bitmap, storage_size) == 0);
+
+    for(unsigned long i = 0; i < count; i++)
+    {
+        if(blocks[i].location != NOMEM && rand() % 2)
+        {
+            free_region(&heaps[0], blocks[i].location, blocks[i].size);
+            fixed_free_region(&heaps[1], blocks[i].location, blocks[i].size);
+            blocks[i].location = NOMEM;
+        }
+    }
+    assert(heaps[0].free_block_count == heaps[1].free_block_count);
+    assert(memcmp(heaps[0].bitmap, heaps[1].bitmap, storage_size) == 0);
+
+    unsigned long batch[2][64];
+    unsigned long reserved = reserve_region_batch(&heaps[0], block_size, 64, batch[0]);
+    assert(fixed_reserve_region_batch(&heaps[1], block_size, 64, batch[1]) == reserved);
+    assert(memcmp(batch[0], batch[1], sizeof(unsigned long) * reserved) == 0);
+    free_region_batch(&heaps[0], batch[0], NULL, reserved);
+    fixed_free_region_batch(&heaps[1], batch[1], NULL, reserved);
+    for(unsigned long i = 0; i < count; i++)
+    {
+        if(blocks[i].location != NOMEM)
+        {
+            free_region(&heaps[0], blocks[i].location, blocks[i].size);
+            fixed_free_region(&heaps[1], blocks[i].location, blocks[i].size);
+        }
+    }
+    assert(memcmp(heaps[0].bitmap, heaps[1].bitmap, storage_size) == 0);
+
+    // A heap with a different geometry is rejected
+    heaps[1].block_bits = 4;
+    assert(fixed_initialize_heap(&heaps[1], &memory_map));
+    heaps[1].block_bits = 2;
+    heaps[1].block_size = 2 * block_size;
+    assert(fixed_initialize_heap(&heaps[1], &memory_map));
+
+    free(blocks);
+    free(heaps[0].bitmap);
+    free(heaps[1].bitmap);
+}
+
+/*
+ * State of the counting stand-in for an `mmap` callback used by test_mmap.
+ */
+static struct
+{
+    unsigned long offset;
+    unsigned long block_size;
+    unsigned char *mapped;
+    unsigned long calls;
+    unsigned long fail_at;
+} mmap_stub;
+
+static int count_mmap(void *location, unsigned long size)
+{
+    mmap_stub.calls++;
+    if(mmap_stub.calls == mmap_stub.fail_at)
+    {
+        return -1;
+    }
+    unsigned long first = ((unsigned long)location - mmap_stub.offset) / mmap_stub.block_size;
+    for(unsigned long i = first; i < first + size / mmap_stub.block_size; i++)
+    {
+        assert(!mmap_stub.mapped[i]);
+        mmap_stub.mapped[i] = 1;
+    }
+    return 0;
+}
+
+/*
+ * Counts the runs of blocks in [first, last) that are unmapped in `mapped`.
+ */
+static unsigned long unmapped_runs(const unsigned char *mapped, unsigned long first,
+    unsigned long last)
+{
+    unsigned long runs = 0;
+    for(unsigned long i = first; i < last; i++)
+    {
+        runs += !mapped[i] && (i == first || mapped[i - 1]);
+    }
+    return runs;
+}
+
+void test_mmap(unsigned long block_size, unsigned long bits)
+{
+    const unsigned long total = 1 << 12;
+    const unsigned long size = block_size * total;
+    printf("[TEST] Bitmap allocator mmap runs: memory=%lX, block_size=%lu, block_bits=%lu\n",
+        size, block_size, bits);
+    memory_region_t arr[MAP_CAPACITY];
+    memory_map_t memory_map;
+    bitmap_heap_descriptor_t heap = setup_heap(&memory_map, arr, size, block_size, bits);
+    heap.offset = 0x10000;
+    heap.mmap = count_mmap;
+    unsigned char *before = malloc(total);
+    mmap_stub.offset = heap.offset;
+    mmap_stub.block_size = block_size;
+    mmap_stub.mapped = calloc(total, 1);
+    mmap_stub.calls = 0;
+    mmap_stub.fail_at = 0;
+    assert(!initialize_heap(&heap, &memory_map));
+    assert(mmap_stub.calls == 0);
+
+    // A fresh region is mapped with one call, and only once
+    unsigned long location = reserve_region(&heap, block_size * 512);
+    assert(location != NOMEM && mmap_stub.calls == 1);
+    free_region(&heap, location, block_size * 512);
+    assert(reserve_region(&heap, block_size * 512) == location);
+    assert(mmap_stub.calls == 1);
+
+    // Leave a gap between mapped regions
+    unsigned long gapped = reserve_region(&heap, block_size * 1024);
+    assert(gapped != NOMEM && mmap_stub.calls == 2);
+    free_region(&heap, gapped, block_size * 1024);
+    free_region(&heap, location, block_size * 512);
+
+    // A failed mapping gives the region back and marks only what was mapped
+    unsigned long free_blocks = heap.free_block_count;
+    memcpy(before, mmap_stub.mapped, total);
+    unsigned long runs = unmapped_runs(before, 0, total);
+    assert(runs == 2);
+    mmap_stub.calls = 0;
+    mmap_stub.fail_at = 2;
+    assert(reserve_region(&heap, size) == NOMEM);
+    assert(mmap_stub.calls == 2);
+    assert(heap.free_block_count == free_blocks);
+    assert(unmapped_runs(mmap_stub.mapped, 0, total) == runs - 1);
+
+    // Retrying maps each remaining run once, without mapping anything twice
+    memcpy(before, mmap_stub.mapped, total);
+    mmap_stub.calls = 0;
+    mmap_stub.fail_at = 0;
+    assert(reserve_region(&heap, size) == heap.offset);
+    assert(mmap_stub.calls == unmapped_runs(before, 0, total));
+    assert(unmapped_runs(mmap_stub.mapped, 0, total) == 0);
+    free_region(&heap, heap.offset, size);
+    assert(heap.free_block_count == total);
+
+    free(mmap_stub.mapped);
+    free(before);
+    free(heap.bitmap);
+}
+
+static unsigned long mapped_bytes;
+
+static int touch_mmap(void *location, unsigned long size)
+{
+    mapped_bytes += size;
+    return 0;
+}
+
+static int madvise_unmap(void *location, unsigned long size)
+{
+    return madvise(location, size, MADV_DONTNEED);
+}
+
+/*
+ * Counts the pages of [location, location + size) which are resident.
+ */
+static unsigned long resident_pages(void *location, unsigned long size)
+{
+    unsigned long page_size = sysconf(_SC_PAGESIZE);
+    unsigned long pages = size / page_size;
+    unsigned char *vec = malloc(pages);
+    assert(!mincore(location, size, vec));
+    unsigned long count = 0;
+    for(unsigned long i = 0; i < pages; i++)
+    {
+        count += vec[i] & 1;
+    }
+    free(vec);
+    return count;
+}
+
+void test_unmap(unsigned long bits)
+{
+    const unsigned long block_size = sysconf(_SC_PAGESIZE);
+    const unsigned long total = 1 << 12;
+    const unsigned long size = block_size * total;
+    const unsigned long region = block_size << 4;
+    const unsigned long regions = total / 2 / 16;
+    printf("[TEST] Bitmap allocator unmap: memory=%lX, block_size=%lu, block_bits=%lu\n",
+        size, block_size, bits);
+    memory_region_t arr[MAP_CAPACITY];
+    memory_map_t memory_map;
+    bitmap_heap_descriptor_t heap = setup_heap(&memory_map, arr, size, block_size, bits);
+
+    char *space = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    assert(space != MAP_FAILED);
+    heap.offset = (unsigned long)space;
+    heap.mmap = touch_mmap;
+    heap.unmap = madvise_unmap;
+    heap.unmap_height = 4;
+    heap.unmap_high = total / 4;
+    heap.unmap_low = total / 16;
+    mapped_bytes = 0;
+    assert(!initialize_heap(&heap, &memory_map));
+
+    // Fill half the heap and write to all of it
+    unsigned long *locations = malloc(sizeof(unsigned long) * regions);
+    for(unsigned long i = 0; i < regions; i++)
+    {
+        locations[i] = reserve_region(&heap, region);
+        assert(locations[i] != NOMEM);
+        memset((void*)locations[i], 0xA5, region);
+    }
+    assert(resident_pages(space, size) == total / 2);
+    assert(mapped_bytes == size / 2 && heap.dirty_block_count == 0);
+
+    // Churn below the high-water mark keeps its mapping
+    for(int i = 0; i < 1000; i++)
+    {
+        free_region(&heap, locations[0], region);
+        assert(reserve_region(&heap, region) == locations[0]);
+    }
+    assert(mapped_bytes == size / 2);
+    assert(resident_pages(space, size) == total / 2);
+
+    // Freeing everything gives memory back until below the low-water mark
+    for(unsigned long i = 0; i < regions; i++)
+    {
+        free_region(&heap, locations[i], region);
+        assert(heap.dirty_block_count < heap.unmap_high);
+    }
+    unsigned long resident = resident_pages(space, size);
+    assert(resident < total / 2);
+    assert(resident == heap.dirty_block_count);
+
+    // Reserving the whole heap maps exactly what was unmapped
+    mapped_bytes = 0;
+    assert(reserve_region(&heap, size) == heap.offset);
+    assert(mapped_bytes == size - resident * block_size);
+    assert(heap.dirty_block_count == 0);
+    memset(space, 0x5A, size);
+    free_region(&heap, heap.offset, size);
+    assert(resident_pages(space, size) == heap.dirty_block_count);
+
+    free(locations);
+    free(heap.bitmap);
+    munmap(space, size);
+}
+
+void test_extents(unsigned long size, unsigned long block_size, unsigned long bits)
+{
+    printf("[TEST] Bitmap allocator extents: memory=%lX, block_size=%lu, block_bits=%lu\n",
+        size, block_size, bits);
+    memory_region_t arr[MAP_CAPACITY];
+    memory_map_t memory_map;
+    bitmap_heap_descriptor_t heap = setup_heap(&memory_map, arr, size, block_size, bits);
+    heap.offset = 0x1000;
+    assert(!initialize_heap(&heap, &memory_map));
+    unsigned long total = heap.free_block_count;
+    unsigned long *locations = malloc(sizeof(unsigned long) * total);
+    unsigned long *sizes = malloc(sizeof(unsigned long) * total);
+
+    // On an empty heap, the extents follow the binary representation
+    assert(reserve_extents(&heap, 0, locations, sizes, total) == 0);
+    assert(reserve_extents(&heap, total + 1, locations, sizes, total) == 0);
+    assert(reserve_extents(&heap, 13, locations, sizes, 2) == 0);
+    assert(heap.free_block_count == total);
+    assert(reserve_extents(&heap, 13, locations, sizes, 3) == 3);
+    assert(sizes[0] == 8 * block_size && sizes[1] == 4 * block_size && sizes[2] == block_size);
+    assert(heap.free_block_count == total - 13);
+    free_region_batch(&heap, locations, sizes, 3);
+    assert(heap.free_block_count == total);
+
+    // Leave every other block free, so no two free blocks are contiguous
+    for(unsigned long i = 0; i < total; i++)
+    {
+        locations[i] = reserve_region(&heap, block_size);
+        assert(locations[i] != NOMEM);
+    }
+    for(unsigned long i = 0; i < total; i += 2)
+    {
+        free_region(&heap, locations[i], block_size);
+    }
+    unsigned long *held = malloc(sizeof(unsigned long) * total / 2);
+    for(unsigned long i = 0; i < total / 2; i++)
+    {
+        held[i] = locations[2 * i + 1];
+    }
+    assert(reserve_region(&heap, 2 * block_size) == NOMEM);
+
+    unsigned long count = total / 2;
+    assert(reserve_extents(&heap, count, locations, sizes, count - 1) == 0);
+    assert(heap.free_block_count == count);
+    assert(reserve_extents(&heap, count, locations, sizes, count) == count);
+    assert(heap.free_block_count == 0);
+    for(unsigned long i = 0; i < count; i++)
+    {
+        assert(sizes[i] == block_size);
+        assert((locations[i] - heap.offset) / block_size % 2 == 0);
+        for(unsigned long j = 0; j < i; j++)
+        {
+            assert(locations[i] != locations[j]);
+        }
+    }
+
+    free_region_batch(&heap, locations, sizes, count);
+    free_region_batch(&heap, held, sizes, count);
+    assert(heap.free_block_count == total);
+    assert(reserve_region(&heap, size) == heap.offset);
+
+    free(held);
+    free(sizes);
+    free(locations);
+    free(heap.bitmap);
+}
+
+/*
+ * Tests whether the aligned region of `blocks` blocks at block `first` is
+ * free, according to the state `free` kept alongside a heap.
+ */
+static int region_free(const unsigned char *unused, unsigned long first, unsigned long blocks)
+{
+    for(unsigned long i = first; i < first + blocks; i++)
+    {
+        if(!unused[i])
+        {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+void test_in_range(unsigned long size, unsigned long block_size, unsigned long bits,
+    unsigned long section_size, int concurrent)
+{
+    printf("[TEST] Bitmap allocator in range: memory=%lX, block_size=%lu, block_bits=%lu, section_size=%lX, concurrent=%d\n",
+        size, block_size, bits, section_size, concurrent);
+    const int cache_capacity = 256;
+    memory_region_t arr[MAP_CAPACITY];
+    unsigned long heap_cache[cache_capacity];
+    memory_map_t memory_map;
+    bitmap_heap_descriptor_t heap = setup_heap(&memory_map, arr, size, block_size, bits);
+    for(int i = 0; i < 6; i++)
+    {
+        memmap_insert_region(&memory_map, rand() % size, rand() % (size / 16), M_UNAVAILABLE);
+    }
+    heap.cache = concurrent ? NULL : heap_cache;
+    heap.cache_capacity = concurrent ? 0 : cache_capacity;
+    heap.offset = 0x10000;
+    heap.concurrent = concurrent;
+    heap.section_size = section_size;
+    assert(!initialize_heap(&heap, &memory_map));
+
+    // Find which blocks the heap can hand out at all
+    unsigned long total = size / block_size;
+    unsigned char *unused = calloc(total, 1);
+    unsigned long *locations = malloc(sizeof(unsigned long) * total);
+    unsigned long *sizes = malloc(sizeof(unsigned long) * total);
+    unsigned long count = 0;
+    while((locations[count] = reserve_region(&heap, block_size)) != NOMEM)
+    {
+        unused[(locations[count++] - heap.offset) / block_size] = 1;
+    }
+    for(unsigned long i = 0; i < count; i++)
+    {
+        free_region(&heap, locations[i], block_size);
+    }
+
+    count = 0;
+    for(int round = 0; round < 2000; round++)
+    {
+        unsigned long blocks = 1UL << (rand() % 5);
+        unsigned long min_addr = heap.offset - size / 8 + rand() % (size + size / 8);
+        unsigned long max_addr = min_addr + rand() % (size / 2);
+        unsigned long location = reserve_region_in_range(&heap, blocks * block_size,
+            min_addr, max_addr);
+        if(location != NOMEM)
+        {
+            unsigned long first = (location - heap.offset) / block_size;
+            assert(location >= min_addr && location + blocks * block_size <= max_addr);
+            assert(first % blocks == 0 && region_free(unused, first, blocks));
+            memset(&unused[first], 0, blocks);
+            locations[count] = location;
+            sizes[count++] = blocks * block_size;
+        }
+        else
+        {
+            // No free block of that size may lie wholly within the window
+            for(unsigned long first = 0; first < total; first += blocks)
+            {
+                unsigned long start = heap.offset + first * block_size;
+                assert(start < min_addr || start + blocks * block_size > max_addr
+                    || !region_free(unused, first, blocks));
+            }
+        }
+
+        if(count > 0 && rand() % 3 == 0)
+        {
+            unsigned long i = rand() % count;
+            free_region(&heap, locations[i], sizes[i]);
+            memset(&unused[(locations[i] - heap.offset) / block_size], 1, sizes[i] / block_size);
+            locations[i] = locations[--count];
+            sizes[i] = sizes[count];
+        }
+    }
+
+    // Windows wholly inside or outside of the heap
+    assert(reserve_region_in_range(&heap, block_size, 0, heap.offset) == NOMEM);
+    assert(reserve_region_in_range(&heap, 2 * block_size, heap.offset,
+        heap.offset + block_size) == NOMEM);
+    for(unsigned long i = 0; i < count; i++)
+    {
+        free_region(&heap, locations[i], sizes[i]);
+        memset(&unused[(locations[i] - heap.offset) / block_size], 1, sizes[i] / block_size);
+    }
+    unsigned long location = reserve_region_in_range(&heap, block_size, 0, ~0UL);
+    assert(location != NOMEM && unused[(location - heap.offset) / block_size]);
+
+    free(sizes);
+    free(locations);
+    free(unused);
+    free(heap.bitmap);
+}
+
+/*
+ * Recomputes the checksum of the snapshot header at the start of `header`
+ * after a test has altered it, as save_snapshot computes it. The header
+ * starts with its magic, version, size, snapshot size and checksum words.
+ */
+static void reseal_snapshot(unsigned long *header)
+{
+    const unsigned char *bytes = (const unsigned char*)header;
+    unsigned long hash = 0xcbf29ce4UL;
+    for(unsigned long i = 0; i < header[2]; i++)
+    {
+        if(i / sizeof(unsigned long) != 4)
+        {
+            hash = (hash ^ bytes[i]) * 0x01000193UL;
+        }
+    }
+    header[4] = hash;
+}
+
+void test_snapshot(unsigned long size, unsigned long block_size, unsigned long bits,
+    unsigned long section_size, int split)
+{
+    printf("[TEST] Bitmap allocator snapshot: memory=%lX, block_size=%lu, block_bits=%lu, section_size=%lX, split=%d\n",
+        size, block_size, bits, section_size, split);
+    const int cache_capacity = 256;
+    memory_region_t arr[MAP_CAPACITY];
+    unsigned long heap_cache[cache_capacity];
+    memory_map_t memory_map;
+    bitmap_heap_descriptor_t heap = setup_heap(&memory_map, arr, size, block_size, split ? 1 : bits);
+    for(int i = 0; i < 6; i++)
+    {
+        memmap_insert_region(&memory_map, rand() % size, rand() % (size / 16), M_UNAVAILABLE);
+    }
+    heap.metadata = split ? malloc(metadata_size(&memory_map, block_size, bits)) : NULL;
+    heap.owners = malloc(owner_table_size(&memory_map, block_size));
+    heap.pack_counts = malloc(pack_table_size(&memory_map, block_size, 0, block_size << 6));
+    heap.pack_size = block_size << 6;
+    heap.cache = heap_cache;
+    heap.cache_capacity = cache_capacity;
+    heap.cache_depth = 4;
+    heap.block_bits = bits;
+    heap.offset = 0x10000;
+    heap.section_size = section_size;
+    assert(!initialize_heap(&heap, &memory_map));
+
+    unsigned long total = size / block_size;
+    memblock_t *blocks = malloc(sizeof(memblock_t) * total);
+    unsigned long count = 0;
+    for(int i = 0; i < 1000; i++)
+    {
+        blocks[count].size = block_size << (rand() % 4);
+        blocks[count].location = reserve_region(&heap, blocks[count].size);
+        if(blocks[count].location != NOMEM)
+        {
+            count++;
+        }
+        if(count > 0 && rand() % 3 == 0)
+        {
+            unsigned long j = rand() % count;
+            free_region(&heap, blocks[j].location, blocks[j].size);
+            blocks[j] = blocks[--count];
+        }
+    }
+
+    // Save to a file, and take it up again from a separate mapping of it
+    unsigned long length = snapshot_size(&heap);
+    char path[] = "/tmp/test_bitmapalloc.XXXXXX";
+    int fd = mkstemp(path);
+    assert(fd >= 0);
+    unlink(path);
+    assert(ftruncate(fd, length) == 0);
+    void *saved = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    assert(saved != MAP_FAILED);
+    assert(save_snapshot(&heap, saved, length - 1) == 0);
+    assert(save_snapshot(&heap, saved, length) == length);
+    void *mapped = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    assert(mapped != MAP_FAILED && mapped != saved);
+    munmap(saved, length);
+
+    bitmap_heap_descriptor_t restored = {
+        .section_map = &memory_map
+    };
+    assert(fixed_restore_snapshot(&restored, mapped, length) != 0);
+    assert(restore_snapshot(&restored, mapped, length - 1) != 0);
+    ((unsigned char*)mapped)[48] ^= 1;
+    assert(restore_snapshot(&restored, mapped, length) != 0);
+    ((unsigned char*)mapped)[48] ^= 1;
+
+    // A well-formed header placing the bitmap past the end is refused too
+    unsigned long *words = (unsigned long*)mapped;
+    unsigned long bitmap_offset = words[5];
+    words[5] = words[3] + sizeof(unsigned long);
+    reseal_snapshot(words);
+    assert(restore_snapshot(&restored, mapped, length) != 0);
+    words[5] = bitmap_offset;
+    reseal_snapshot(words);
+    assert(restore_snapshot(&restored, mapped, length) == 0);
+    assert((char*)restored.bitmap > (char*)mapped
+        && (char*)restored.bitmap < (char*)mapped + length);
+    assert(restored.free_block_count == heap.free_block_count);
+    assert(restored.next_section == heap.next_section);
+    assert(memcmp(restored.bitmap, heap.bitmap, heap.bitmap_size) == 0);
+    assert(memcmp(restored.pack_counts, heap.pack_counts,
+        pack_table_size(&memory_map, block_size, 0, heap.pack_size)) == 0);
+
+    // Both heaps carry on exactly alike, including the preserved regions
+    for(int i = 0; i < 1000; i++)
+    {
+        unsigned long region = block_size << (rand() % 4);
+        unsigned long location = reserve_region(&heap, region);
+        assert(reserve_region(&restored, region) == location);
+        if(location != NOMEM)
+        {
+            blocks[count].location = location;
+            blocks[count++].size = region;
+        }
+        if(count > 0 && rand() % 3 == 0)
+        {
+            unsigned long j = rand() % count;
+            free_region(&heap, blocks[j].location, blocks[j].size);
+            free_region(&restored, blocks[j].location, blocks[j].size);
+            blocks[j] = blocks[--count];
+        }
+    }
+    for(unsigned long i = 0; i < count; i++)
+    {
+        free_region(&heap, blocks[i].location, blocks[i].size);
+        free_region(&restored, blocks[i].location, blocks[i].size);
+    }
+    assert(restored.free_block_count == heap.free_block_count);
+    assert(memcmp(restored.bitmap, heap.bitmap, heap.bitmap_size) == 0);
+
+    munmap(mapped, length);
+    close(fd);
+    free(blocks);
+    free(heap.pack_counts);
+    free(heap.owners);
+    free(heap.metadata);
+    free(heap.bitmap);
+}
+
+void test_colors(unsigned long size, unsigned long block_size, unsigned long bits,
+    unsigned long colors, unsigned long section_size)
+{
+    printf("[TEST] Bitmap allocator colors: memory=%lX, block_size=%lu, block_bits=%lu, colors=%lu, section_size=%lX\n",
+        size, block_size, bits, colors, section_size);
+    const int cache_capacity = 256;
+    memory_region_t arr[MAP_CAPACITY];
+    unsigned long heap_cache[cache_capacity];
+    memory_map_t memory_map;
+    bitmap_heap_descriptor_t heap = setup_heap(&memory_map, arr, size, block_size, bits);
+    heap.cache = heap_cache;
+    heap.cache_capacity = cache_capacity;
+    heap.offset = 0x10000 + 3 * block_size;
+    heap.section_size = section_size;
+    heap.colors = 3;
+    assert(initialize_heap(&heap, &memory_map) != 0);
+    heap.colors = colors;
+    assert(!initialize_heap(&heap, &memory_map));
+
+    // A caller keeping its own color rotates through every color in turn
+    unsigned long total = size / block_size;
+    unsigned long *locations = malloc(sizeof(unsigned long) * total);
+    unsigned long *sizes = malloc(sizeof(unsigned long) * total);
+    unsigned long count = 0;
+    unsigned long color = 0;
+    for(unsigned long i = 0; i < 4 * colors; i++)
+    {
+        unsigned long expected = color;
+        unsigned long built = heap.next_section;
+        sizes[count] = block_size;
+        locations[count] = reserve_region_colored(&heap, block_size, &color);
+        assert(locations[count] != NOMEM);
+        // Every section has each color, so at most one more is built
+        assert(heap.next_section <= built + 1);
+        assert((locations[count] / block_size) % colors == expected);
+        assert(color == (expected + 1) % colors);
+        count++;
+    }
+
+    // Larger regions cover the color wanted
+    for(unsigned long i = 0; i < 4 * colors; i++)
+    {
+        unsigned long blocks = 1UL << (rand() % 3);
+        unsigned long wanted = rand() % colors;
+        color = wanted;
+        sizes[count] = blocks * block_size;
+        locations[count] = reserve_region_colored(&heap, sizes[count], &color);
+        assert(locations[count] != NOMEM);
+        assert((locations[count] - heap.offset) % sizes[count] == 0);
+        unsigned long start = (locations[count] / block_size) % colors;
+        assert(((wanted - start) & (colors - 1)) < blocks);
+        assert(color == (start + blocks) % colors);
+        count++;
+    }
+
+    // Once a color runs out, other colors are taken
+    unsigned long fallbacks = 0;
+    while(fallbacks < 16)
+    {
+        color = 1;
+        locations[count] = reserve_region_colored(&heap, block_size, &color);
+        assert(locations[count] != NOMEM);
+        if((locations[count] / block_size) % colors == 1)
+        {
+            assert(fallbacks == 0);
+        }
+        else
+        {
+            fallbacks++;
+        }
+        sizes[count++] = block_size;
+    }
+
+    for(unsigned long i = 0; i < count; i++)
+    {
+        free_region(&heap, locations[i], sizes[i]);
+    }
+    assert(heap.free_block_count == total);
+    assert(reserve_region(&heap, size) == heap.offset);
+
+    free(sizes);
+    free(locations);
+    free(heap.bitmap);
+}
+
+/*
+ * A step of a trace of reservations: a region of `size` bytes reserved at
+ * this step and freed at step `end`.
+ */
+typedef struct trace_entry_t
+{
+    unsigned long size;
+    unsigned long end;
+} trace_entry_t;
+
+static int compare_trace_ends(const void *a, const void *b)
+{
+    const trace_entry_t *x = *(const trace_entry_t* const*)a;
+    const trace_entry_t *y = *(const trace_entry_t* const*)b;
+    return x->end < y->end ? -1 : x->end > y->end;
+}
+
+/*
+ * Counts the groups of `group` blocks in which no block is in use.
+ */
+static unsigned long count_free_groups(const unsigned char *used, unsigned long total,
+    unsigned long group)
+{
+    unsigned long count = 0;
+    for(unsigned long first = 0; first < total; first += group)
+    {
+        unsigned long i = first;
+        while(i < first + group && !used[i])
+        {
+            i++;
+        }
+        count += i == first + group;
+    }
+    return count;
+}
+
+/*
+ * Replays `trace` against a fresh heap, packing reservations into groups of
+ * `pack_size` bytes if `pack` is nonzero. Returns the number of wholly free
+ * groups, summed over a sample taken every `steps` / 16 steps.
+ */
+static unsigned long replay_trace(unsigned long size, unsigned long block_size,
+    unsigned long bits, unsigned long pack_size, int pack, trace_entry_t *trace,
+    trace_entry_t **ends, unsigned long steps, unsigned long *failures)
+{
+    const int cache_capacity = 256;
+    memory_region_t arr[MAP_CAPACITY];
+    unsigned long heap_cache[cache_capacity];
+    memory_map_t memory_map;
+    bitmap_heap_descriptor_t heap = setup_heap(&memory_map, arr, size, block_size, bits);
+    heap.pack_counts = pack ? malloc(pack_table_size(&memory_map, block_size, 0, pack_size)) : NULL;
+    heap.pack_size = pack_size;
+    heap.cache = heap_cache;
+    heap.cache_capacity = cache_capacity;
+    heap.offset = 1UL << 32;
+    assert(!initialize_heap(&heap, &memory_map));
+
+    unsigned long total = size / block_size;
+    unsigned long group = pack_size / block_size;
+    unsigned char *used = calloc(total, 1);
+    unsigned long *locations = malloc(sizeof(unsigned long) * steps);
+    unsigned long next_end = 0;
+    unsigned long free_groups = 0;
+    *failures = 0;
+    for(unsigned long t = 0; t <= steps; t++)
+    {
+        for(; next_end < steps && (ends[next_end]->end <= t || t == steps); next_end++)
+        {
+            unsigned long i = ends[next_end] - trace;
+            if(locations[i] != NOMEM)
+            {
+                free_region(&heap, locations[i], trace[i].size);
+                memset(&used[(locations[i] - heap.offset) / block_size], 0,
+                    trace[i].size / block_size);
+            }
+        }
+        if(t == steps)
+        {
+            break;
+        }
+
+        locations[t] = reserve_region(&heap, trace[t].size);
+        if(locations[t] == NOMEM)
+        {
+            (*failures)++;
+            continue;
+        }
+        memset(&used[(locations[t] - heap.offset) / block_size], 1, trace[t].size / block_size);
+        if(t % (steps / 16) == 0)
+        {
+            free_groups += count_free_groups(used, total, group);
+        }
+        if(pack && t % (steps / 4) == 0)
+        {
+            // The counts follow the blocks in use in each group
+            for(unsigned long g = 0; g < total / group; g++)
+            {
+                unsigned long unused = 0;
+                for(unsigned long i = g * group; i < (g + 1) * group; i++)
+                {
+                    unused += !used[i];
+                }
+                assert(heap.pack_counts[g] == unused);
+            }
+        }
+    }
+
+    assert(heap.free_block_count == total);
+    for(unsigned long g = 0; pack && g < total / group; g++)
+    {
+        assert(heap.pack_counts[g] == group);
+    }
+    assert(reserve_region(&heap, size) == heap.offset);
+
+    free(locations);
+    free(used);
+    free(heap.pack_counts);
+    free(heap.bitmap);
+    return free_groups;
+}
+
+void test_pack(unsigned long size, unsigned long block_size, unsigned long bits,
+    unsigned long pack_size)
+{
+    printf("[TEST] Bitmap allocator packing: memory=%lX, block_size=%lu, block_bits=%lu, pack_size=%lX\n",
+        size, block_size, bits, pack_size);
+
+    // Fill the heap, and free all but a tenth of it at once. Then reserve
+    // short-lived regions while the rest of the first ones are freed, with
+    // some which live much longer.
+    const unsigned long steps = 40000;
+    trace_entry_t *trace = malloc(sizeof(trace_entry_t) * steps);
+    trace_entry_t **ends = malloc(sizeof(trace_entry_t*) * steps);
+    for(unsigned long t = 0; t < steps; t++)
+    {
+        trace[t].size = block_size << (rand() % 5);
+        if(t < steps / 4)
+        {
+            trace[t].end = steps / 4 + (rand() % 10 == 0 ? rand() % (3 * steps / 4) : 0);
+        }
+        else
+        {
+            trace[t].end = t + 1 + (rand() % 20 == 0 ? rand() % (steps / 4) : rand() % 64);
+        }
+        ends[t] = &trace[t];
+    }
+    qsort(ends, steps, sizeof(*ends), compare_trace_ends);
+
+    unsigned long lowest_failures;
+    unsigned long packed_failures;
+    unsigned long lowest = replay_trace(size, block_size, bits, pack_size, 0,
+        trace, ends, steps, &lowest_failures);
+    unsigned long packed = replay_trace(size, block_size, bits, pack_size, 1,
+        trace, ends, steps, &packed_failures);
+    printf("Free groups of %lu over 16 samples: lowest address %lu (%lu failed), packed %lu (%lu failed)\n",
+        size / pack_size, lowest, lowest_failures, packed, packed_failures);
+
+    free(ends);
+    free(trace);
+}
+
+int main(int argc, char **args)
+{
+    srand(time(0));
+    test_heap(32, 1, 1, 1);
+    test_heap(256, 0, 1, 1);
+    test_heap(256, 1, 0, 1);
+    test_heap(256, 1, 3, 1);
+    test_heap(256, 1, 128, 1);
+    test_heap(256, 1, 4, 1);
+
+    for(int bs = 1; bs <= 32; bs *= 2)
+    {
+        unsigned long heap_size = (1 << llog2(bs)) * 256;
+        unsigned long n = (8 * sizeof(unsigned long)) - 1 - __builtin_clzl((unsigned long) bs);
+        for(int bits = 1; bits < (8 * sizeof(unsigned long)) && (2 * bits) < (8 * (1 << n)); bits <<= 1)
+        {
+            test_heap(heap_size, bs, bits, 0);
+        }
+    }
+
+    test_cache(1);
+    test_cache(8);
+    test_cache(32);
+
+    test_huge(4096, 4, 33);
+    test_specialized(1 << 24);
+    test_mmap(4096, 4);
+    test_mmap(64, 8);
+    test_unmap(4);
+    test_unmap(16);
+    test_pack(1UL << 28, 4096, 2, 1 << 21);
+
+    for(unsigned long bits = 1; bits <= 8; bits *= 2)
+    {
+        test_batch(1 << 14, 16, bits);
+        test_batch(1 << 16, 64, bits);
+        test_free_batch(1 << 14, 16, bits);
+        test_free_batch(1 << 18, 64, bits);
+        test_scan(1 << 20, 16, bits);
+        test_concurrent(1 << 14, 16, bits, 4, 0);
+        test_concurrent(1 << 14, 16, bits, 4, 1);
+        test_split(1 << 16, 16, bits, 0);
+        test_split(1 << 18, 16, bits, 1 << 12);
+        test_owners(1 << 14, 16, bits);
+        test_extents(1 << 14, 16, bits);
+        test_in_range(1 << 16, 16, bits, 0, 0);
+        test_in_range(1 << 16, 16, bits, 1 << 12, 0);
+        test_in_range(1 << 16, 16, bits, 0, 1);
+        test_snapshot(1 << 16, 16, bits, 0, 0);
+        test_snapshot(1 << 18, 16, bits, 1 << 12, bits > 1);
+        test_sections(1 << 18, 16, bits, 1 << 12);
+        test_sections(1 << 18, 16, bits, 16);
+        test_sparse(16, bits, 1 << 12);
+        test_pack(1 << 20, 16, bits, 1 << 10);
+        test_colors(1 << 16, 16, bits, 8, 0);
+        test_colors(1 << 20, 16, bits, 256, 1 << 12);
     }
 }
\ No newline at end of file
@@ -1,6 +1,11 @@
 #include "libmalloc/buddy_alloc.h"
+#include <assert.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
 
 typedef struct memblock_t
 {
@@ -18,29 +23,756 @@ void print_heap(FILE *file, buddy_descriptor_t *heap)
     fprintf(file, "\t.block_map = {\n");
     for(unsigned int i = 0; i < count; i++)
     {
-        unsigned long linkf_diff = heap->block_map[i].linkf - heap->block_map;
-        unsigned long linkb_diff = heap->block_map[i].linkb - heap->block_map;
-        fprintf(file, "\t\t%u: {.tag = %s, .kval = %lu, .linkf = %li, .linkb = %li}\n",
+        unsigned long linkf = BUDDY_LINKF(heap->block_map[i]);
+        unsigned long linkb = BUDDY_LINKB(heap->block_map[i]);
+        fprintf(file, "\t\t%u: {.tag = %s, .kval = %u, .linkf = %li, .linkb = %li}\n",
             i,
-            heap->block_map[i].tag ? "BLOCK_FREE" : "BLOCK_RESERVED",
-            heap->block_map[i].kval,
-            linkf_diff < count ? linkf_diff : -1,
-            linkb_diff < count ? linkb_diff : -1);
+            BUDDY_TAG(heap->block_map[i]) ? "BLOCK_FREE" : "BLOCK_RESERVED",
+            BUDDY_KVAL(heap->block_map[i]),
+            linkf < count ? (long)linkf : -1,
+            linkb < count ? (long)linkb : -1);
     }
     fprintf(file, "\t}\n");
     fprintf(file, "\t.avail = {\n");
     for(unsigned int i = 0; i <= heap->max_kval; i++)
     {
-        fprintf(file, "\t\t%u: {.linkf = %lu, .linkb = %lu}\n",
+        unsigned long linkf = BUDDY_LINKF(heap->avail[i]);
+        unsigned long linkb = BUDDY_LINKB(heap->avail[i]);
+        fprintf(file, "\t\t%u: {.linkf = %li, .linkb = %li}\n",
             i,
-            heap->avail[i].linkf - heap->block_map,
-            heap->avail[i].linkb - heap->block_map);
+            linkf < count ? (long)linkf : -1,
+            linkb < count ? (long)linkb : -1);
     }
     fprintf(file, "\t}\n}\n");
 }
 
+/*
+ * Tests whether the aligned region of `blocks` blocks at block `first` is
+ * free, according to the state `unused` kept alongside a heap.
+ */
+static int region_free(const unsigned char *unused, unsigned long first, unsigned long blocks)
+{
+    for(unsigned long i = first; i < first + blocks; i++)
+    {
+        if(!unused[i])
+        {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/*
+ * Fills a block map with junk before a heap is set up over it, since only
+ * some of its entries are written by `buddy_alloc_init`.
+ */
+static void fill_junk(buddy_block_t *block_map, unsigned long size)
+{
+    for(unsigned long i = 0; i < size; i++)
+    {
+        ((unsigned char*)block_map)[i] = rand();
+    }
+}
+
+void test_in_range(unsigned long size, unsigned long block_size)
+{
+    printf("[TEST] Buddy allocator in range: memory=%lX, block_size=%lu\n", size, block_size);
+    memory_region_t arr[32];
+    memory_map_t memory_map = {
+        .array = arr,
+        .capacity = 32,
+        .size = 0
+    };
+    memmap_insert_region(&memory_map, 0, size, M_AVAILABLE);
+    for(int i = 0; i < 6; i++)
+    {
+        memmap_insert_region(&memory_map, rand() % size, rand() % (size / 16), M_UNAVAILABLE);
+    }
+
+    buddy_descriptor_t heap = {
+        .avail = malloc(sizeof(buddy_block_t) * 64),
+        .block_map = malloc(buddy_map_size(&memory_map, block_size)),
+        .block_size = block_size,
+        .mmap = NULL,
+        .offset = 0x10000
+    };
+    fill_junk(heap.block_map, buddy_map_size(&memory_map, block_size));
+    assert(!buddy_alloc_init(&heap, &memory_map));
+
+    // Find which blocks the heap can hand out at all
+    unsigned long total = 1UL << heap.max_kval;
+    unsigned char *unused = calloc(total, 1);
+    unsigned long *locations = malloc(sizeof(unsigned long) * total);
+    unsigned long *sizes = malloc(sizeof(unsigned long) * total);
+    unsigned long count = 0;
+    while((locations[count] = buddy_reserve(&heap, block_size)) != NOMEM)
+    {
+        unused[(locations[count++] - heap.offset) / block_size] = 1;
+    }
+    for(unsigned long i = 0; i < count; i++)
+    {
+        buddy_free(&heap, locations[i]);
+    }
+    unsigned long free_blocks = heap.free_block_count;
+    assert(free_blocks == count);
+
+    count = 0;
+    for(int round = 0; round < 2000; round++)
+    {
+        unsigned long blocks = 1UL << (rand() % 5);
+        unsigned long min_addr = heap.offset - size / 8 + rand() % (size + size / 8);
+        unsigned long max_addr = min_addr + rand() % (size / 2);
+        unsigned long location = buddy_reserve_in_range(&heap, blocks * block_size,
+            min_addr, max_addr);
+        if(location != NOMEM)
+        {
+            unsigned long first = (location - heap.offset) / block_size;
+            assert(location >= min_addr && location + blocks * block_size <= max_addr);
+            assert(first % blocks == 0 && region_free(unused, first, blocks));
+            memset(&unused[first], 0, blocks);
+            locations[count] = location;
+            sizes[count++] = blocks * block_size;
+        }
+        else
+        {
+            // No free block of that size may lie wholly within the window
+            for(unsigned long first = 0; first < total; first += blocks)
+            {
+                unsigned long start = heap.offset + first * block_size;
+                assert(start < min_addr || start + blocks * block_size > max_addr
+                    || !region_free(unused, first, blocks));
+            }
+        }
+
+        if(count > 0 && rand() % 3 == 0)
+        {
+            unsigned long i = rand() % count;
+            assert(buddy_free(&heap, locations[i]) == sizes[i]);
+            memset(&unused[(locations[i] - heap.offset) / block_size], 1, sizes[i] / block_size);
+            locations[i] = locations[--count];
+            sizes[i] = sizes[count];
+        }
+    }
+
+    for(unsigned long i = 0; i < count; i++)
+    {
+        buddy_free(&heap, locations[i]);
+    }
+    assert(heap.free_block_count == free_blocks);
+    assert(buddy_reserve_in_range(&heap, block_size, 0, heap.offset) == NOMEM);
+
+    free(sizes);
+    free(locations);
+    free(unused);
+    free(heap.block_map);
+    free(heap.avail);
+}
+
+void test_snapshot(unsigned long size, unsigned long block_size)
+{
+    printf("[TEST] Buddy allocator snapshot: memory=%lX, block_size=%lu\n", size, block_size);
+    memory_region_t arr[32];
+    memory_map_t memory_map = {
+        .array = arr,
+        .capacity = 32,
+        .size = 0
+    };
+    memmap_insert_region(&memory_map, 0, size, M_AVAILABLE);
+    for(int i = 0; i < 6; i++)
+    {
+        memmap_insert_region(&memory_map, rand() % size, rand() % (size / 16), M_UNAVAILABLE);
+    }
+
+    buddy_descriptor_t heap = {
+        .avail = malloc(sizeof(buddy_block_t) * 64),
+        .block_map = malloc(buddy_map_size(&memory_map, block_size)),
+        .block_size = block_size,
+        .mmap = NULL,
+        .offset = 0x10000
+    };
+    assert(!buddy_alloc_init(&heap, &memory_map));
+
+    unsigned long total = 1UL << heap.max_kval;
+    memblock_t *blocks = malloc(sizeof(memblock_t) * total);
+    unsigned long count = 0;
+    for(int i = 0; i < 1000; i++)
+    {
+        blocks[count].size = block_size << (rand() % 4);
+        blocks[count].location = buddy_reserve(&heap, blocks[count].size);
+        if(blocks[count].location != NOMEM)
+        {
+            count++;
+        }
+        if(count > 0 && rand() % 3 == 0)
+        {
+            unsigned long j = rand() % count;
+            buddy_free(&heap, blocks[j].location);
+            blocks[j] = blocks[--count];
+        }
+    }
+
+    // Save to a file, and take it up from a second mapping of the file
+    unsigned long length = buddy_snapshot_size(&heap);
+    char path[] = "/tmp/test_buddyalloc.XXXXXX";
+    int fd = mkstemp(path);
+    assert(fd >= 0);
+    unlink(path);
+    assert(ftruncate(fd, length) == 0);
+    void *saved = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    assert(saved != MAP_FAILED);
+    assert(buddy_save_snapshot(&heap, saved, length - 1) == 0);
+    assert(buddy_save_snapshot(&heap, saved, length) == length);
+    void *mapped = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    assert(mapped != MAP_FAILED && mapped != saved);
+    munmap(saved, length);
+
+    buddy_descriptor_t restored = {0};
+    ((unsigned char*)mapped)[8] ^= 1;
+    assert(buddy_restore_snapshot(&restored, mapped, length) != 0);
+    ((unsigned char*)mapped)[8] ^= 1;
+    assert(buddy_restore_snapshot(&restored, mapped, length - 1) != 0);
+    assert(buddy_restore_snapshot(&restored, mapped, length) == 0);
+    assert(restored.free_block_count == heap.free_block_count);
+
+    // Restoring again where it now lies leaves it untouched
+    assert(buddy_restore_snapshot(&restored, mapped, length) == 0);
+    assert((void*)restored.avail > mapped);
+
+    // Both heaps carry on exactly alike, including the preserved blocks
+    for(int i = 0; i < 1000; i++)
+    {
+        unsigned long region = block_size << (rand() % 4);
+        unsigned long location = buddy_reserve(&heap, region);
+        assert(buddy_reserve(&restored, region) == location);
+        if(location != NOMEM)
+        {
+            blocks[count].location = location;
+            blocks[count++].size = region;
+        }
+        if(count > 0 && rand() % 3 == 0)
+        {
+            unsigned long j = rand() % count;
+            assert(buddy_free(&heap, blocks[j].location) == buddy_free(&restored, blocks[j].location));
+            blocks[j] = blocks[--count];
+        }
+    }
+    for(unsigned long i = 0; i < count; i++)
+    {
+        buddy_free(&heap, blocks[i].location);
+        buddy_free(&restored, blocks[i].location);
+    }
+    assert(restored.free_block_count == heap.free_block_count);
+
+    munmap(mapped, length);
+    close(fd);
+    free(blocks);
+    free(heap.block_map);
+    free(heap.avail);
+}
+
+/*
+ * Checks that the mask of available orders agrees with which avail lists hold
+ * a block.
+ */
+static void check_orders(const buddy_descriptor_t *heap)
+{
+    unsigned long types = heap->pageblock_types ? BUDDY_MOBILITY_TYPES : 1;
+    for(unsigned long type = 0; type < types; type++)
+    {
+        const buddy_block_t *avail = heap->avail + type * (heap->max_kval + 1);
+        for(unsigned long k = 0; k <= heap->max_kval; k++)
+        {
+            int nonempty = BUDDY_LINKF(avail[k]) != BUDDY_NIL;
+            assert(nonempty == ((heap->avail_mask[type] >> k) & 1));
+        }
+        assert((heap->avail_mask[type] >> heap->max_kval) <= 1);
+    }
+}
+
+void test_orders(unsigned long size, unsigned long block_size)
+{
+    printf("[TEST] Buddy allocator orders: memory=%lX, block_size=%lu\n", size, block_size);
+    memory_region_t arr[32];
+    memory_map_t memory_map = {
+        .array = arr,
+        .capacity = 32,
+        .size = 0
+    };
+    memmap_insert_region(&memory_map, 0, size, M_AVAILABLE);
+    for(int i = 0; i < 6; i++)
+    {
+        memmap_insert_region(&memory_map, rand() % size, rand() % (size / 16), M_UNAVAILABLE);
+    }
+
+    buddy_descriptor_t heap = {
+        .avail = malloc(sizeof(buddy_block_t) * 64),
+        .block_map = malloc(buddy_map_size(&memory_map, block_size)),
+        .block_size = block_size,
+        .mmap = NULL,
+        .offset = 0x10000
+    };
+    fill_junk(heap.block_map, buddy_map_size(&memory_map, block_size));
+    assert(!buddy_alloc_init(&heap, &memory_map));
+    check_orders(&heap);
+
+    unsigned long total = 1UL << heap.max_kval;
+    memblock_t *blocks = malloc(sizeof(memblock_t) * total);
+    unsigned long count = 0;
+    for(int i = 0; i < 4000; i++)
+    {
+        unsigned long k = rand() % 8;
+        unsigned long region = block_size << k;
+        int in_range = rand() % 4 == 0;
+        unsigned long location = in_range
+            ? buddy_reserve_in_range(&heap, region, heap.offset + rand() % size, heap.offset + size)
+            : buddy_reserve(&heap, region);
+        if(location != NOMEM)
+        {
+            blocks[count].location = location;
+            blocks[count++].size = region;
+        }
+        else if(!in_range)
+        {
+            // Giving up means no order at least k had a block to split
+            assert((heap.avail_mask[0] >> k) == 0);
+        }
+        check_orders(&heap);
+
+        if(count > 0 && rand() % 2 == 0)
+        {
+            unsigned long j = rand() % count;
+            assert(buddy_free(&heap, blocks[j].location) == blocks[j].size);
+            blocks[j] = blocks[--count];
+            check_orders(&heap);
+        }
+    }
+    for(unsigned long i = 0; i < count; i++)
+    {
+        buddy_free(&heap, blocks[i].location);
+    }
+    check_orders(&heap);
+
+    // A heap with more blocks than a link can index is refused
+    memory_map.size = 0;
+    memmap_insert_region(&memory_map, 0, (block_size << BUDDY_MAX_KVAL) * 2, M_AVAILABLE);
+    buddy_descriptor_t large = heap;
+    large.block_map = NULL;
+    assert(buddy_alloc_init(&large, &memory_map) != 0);
+
+    // One of 2^26 blocks is set up
+    memory_map.size = 0;
+    memmap_insert_region(&memory_map, 0, block_size << 26, M_AVAILABLE);
+    large.block_map = malloc(buddy_map_size(&memory_map, block_size));
+    assert(buddy_alloc_init(&large, &memory_map) == 0);
+    assert(large.max_kval == 26);
+    unsigned long location = buddy_reserve(&large, block_size);
+    assert(location == large.offset);
+    buddy_free(&large, location);
+    free(large.block_map);
+
+    free(blocks);
+    free(heap.block_map);
+    free(heap.avail);
+}
+
+void test_init(unsigned long size, unsigned long block_size)
+{
+    printf("[TEST] Buddy allocator init: memory=%lX, block_size=%lu\n", size, block_size);
+    memory_region_t arr[32];
+    memory_map_t memory_map = {
+        .array = arr,
+        .capacity = 32,
+        .size = 0
+    };
+    memmap_insert_region(&memory_map, 0, size, M_AVAILABLE);
+    for(int i = 0; i < 8; i++)
+    {
+        memmap_insert_region(&memory_map, rand() % size, rand() % (size / 16), M_UNAVAILABLE);
+    }
+
+    buddy_descriptor_t heap = {
+        .avail = malloc(sizeof(buddy_block_t) * 64),
+        .block_map = malloc(buddy_map_size(&memory_map, block_size)),
+        .block_size = block_size,
+        .mmap = NULL,
+        .offset = 0x10000
+    };
+    fill_junk(heap.block_map, buddy_map_size(&memory_map, block_size));
+    assert(!buddy_alloc_init(&heap, &memory_map));
+    check_orders(&heap);
+
+    // Exactly the blocks lying wholly within available regions are free
+    unsigned long total = 1UL << heap.max_kval;
+    unsigned char *unused = calloc(total, 1);
+    unsigned long expected = 0;
+    for(int i = 0; i < memory_map.size; i++)
+    {
+        unsigned long first = (arr[i].location + block_size - 1) / block_size;
+        unsigned long end = (arr[i].location + arr[i].size) / block_size;
+        for(unsigned long j = first; arr[i].type == M_AVAILABLE && j < end; j++)
+        {
+            unused[j] = 1;
+            expected++;
+        }
+    }
+    assert(heap.free_block_count == expected);
+
+    unsigned long *locations = malloc(sizeof(unsigned long) * total);
+    unsigned long count = 0;
+    while((locations[count] = buddy_reserve(&heap, block_size)) != NOMEM)
+    {
+        unsigned long index = (locations[count++] - heap.offset) / block_size;
+        assert(index < total && unused[index]);
+        unused[index] = 0;
+    }
+    assert(count == expected && heap.free_block_count == 0);
+
+    // Freed again, they are all handed out once more
+    for(unsigned long i = 0; i < count; i++)
+    {
+        buddy_free(&heap, locations[i]);
+    }
+    check_orders(&heap);
+    assert(heap.free_block_count == expected);
+
+    free(locations);
+    free(unused);
+    free(heap.block_map);
+    free(heap.avail);
+}
+
+static unsigned long current_cpu;
+static int heap_locked;
+static unsigned long lock_count;
+
+static unsigned long test_cpu_id(void)
+{
+    return current_cpu;
+}
+
+static void test_lock(buddy_descriptor_t *heap)
+{
+    assert(!heap_locked);
+    heap_locked = 1;
+    lock_count++;
+}
+
+static void test_unlock(buddy_descriptor_t *heap)
+{
+    assert(heap_locked);
+    heap_locked = 0;
+}
+
+void test_pcp(unsigned long size, unsigned long block_size)
+{
+    printf("[TEST] Buddy allocator per-CPU lists: memory=%lX, block_size=%lu\n", size, block_size);
+    const unsigned long cpus = 4;
+    memory_region_t arr[32];
+    memory_map_t memory_map = {
+        .array = arr,
+        .capacity = 32,
+        .size = 0
+    };
+    memmap_insert_region(&memory_map, 0, size, M_AVAILABLE);
+    for(int i = 0; i < 6; i++)
+    {
+        memmap_insert_region(&memory_map, rand() % size, rand() % (size / 16), M_UNAVAILABLE);
+    }
+
+    buddy_descriptor_t heap = {
+        .avail = malloc(sizeof(buddy_block_t) * 64),
+        .block_map = malloc(buddy_map_size(&memory_map, block_size)),
+        .block_size = block_size,
+        .mmap = NULL,
+        .offset = 0x10000
+    };
+    assert(!buddy_alloc_init(&heap, &memory_map));
+    unsigned long initial_count = heap.free_block_count;
+    unsigned long initial_mask = heap.avail_mask[0];
+
+    buddy_pcp_t lists[cpus];
+    buddy_pcp_descriptor_t pcp = {
+        .heap = &heap,
+        .lists = lists,
+        .cpu_count = cpus,
+        .orders = BUDDY_PCP_ORDERS,
+        .low = 4,
+        .high = 3,
+        .cpu_id = test_cpu_id,
+        .lock = test_lock,
+        .unlock = test_unlock
+    };
+    assert(buddy_pcp_init(&pcp));
+    pcp.high = 12;
+    assert(!buddy_pcp_init(&pcp));
+
+    // Blocks are reserved and freed on random CPUs, sometimes another than
+    // the one which reserved them
+    unsigned long total = 1UL << heap.max_kval;
+    unsigned char *unused = malloc(total);
+    memset(unused, 1, total);
+    memblock_t *blocks = malloc(sizeof(memblock_t) * total);
+    unsigned long count = 0;
+    unsigned long operations = 0;
+    lock_count = 0;
+    for(int i = 0; i < 20000; i++)
+    {
+        current_cpu = rand() % cpus;
+        if(count > 0 && rand() % 2)
+        {
+            unsigned long j = rand() % count;
+            unsigned long first = (blocks[j].location - heap.offset) / block_size;
+            assert(buddy_pcp_free(&pcp, blocks[j].location) == blocks[j].size * block_size);
+            memset(unused + first, 1, blocks[j].size);
+            blocks[j] = blocks[--count];
+        }
+        else
+        {
+            unsigned long k = rand() % 6;
+            unsigned long location = buddy_pcp_reserve(&pcp, block_size << k);
+            if(location == NOMEM)
+            {
+                continue;
+            }
+            unsigned long first = (location - heap.offset) / block_size;
+            assert(first % (1UL << k) == 0 && region_free(unused, first, 1UL << k));
+            memset(unused + first, 0, 1UL << k);
+            blocks[count++] = (memblock_t){.size = 1UL << k, .location = location};
+        }
+        operations++;
+        for(unsigned long cpu = 0; cpu < cpus; cpu++)
+        {
+            for(unsigned long k = 0; k < BUDDY_PCP_ORDERS; k++)
+            {
+                assert(lists[cpu].count[k] <= pcp.high);
+            }
+        }
+    }
+    assert(!heap_locked && lock_count < operations);
+
+    // Once every block is freed and every list drained, the heap is whole
+    while(count > 0)
+    {
+        current_cpu = count % cpus;
+        count--;
+        buddy_pcp_free(&pcp, blocks[count].location);
+    }
+    for(unsigned long cpu = 0; cpu < cpus; cpu++)
+    {
+        buddy_pcp_drain(&pcp, cpu);
+        for(unsigned long k = 0; k < BUDDY_PCP_ORDERS; k++)
+        {
+            assert(lists[cpu].count[k] == 0 && lists[cpu].first[k] == BUDDY_NIL);
+        }
+    }
+    check_orders(&heap);
+    assert(heap.free_block_count == initial_count && heap.avail_mask[0] == initial_mask);
+
+    free(blocks);
+    free(unused);
+    free(heap.block_map);
+    free(heap.avail);
+}
+
+/*
+ * Checks that each free block is listed under the type of its pageblock, and
+ * that the lists hold every free block.
+ */
+static void check_types(const buddy_descriptor_t *heap)
+{
+    unsigned long free_blocks = 0;
+    for(unsigned long type = 0; type < BUDDY_MOBILITY_TYPES; type++)
+    {
+        const buddy_block_t *avail = heap->avail + type * (heap->max_kval + 1);
+        for(unsigned long k = 0; k <= heap->max_kval; k++)
+        {
+            for(unsigned long index = BUDDY_LINKF(avail[k]); index != BUDDY_NIL;
+                index = BUDDY_LINKF(heap->block_map[index]))
+            {
+                assert(heap->pageblock_types[index >> heap->pageblock_kval] == type);
+                assert(BUDDY_KVAL(heap->block_map[index]) == k);
+                assert(BUDDY_TAG(heap->block_map[index]) == 1);
+                free_blocks += 1UL << k;
+            }
+        }
+    }
+    assert(free_blocks == heap->free_block_count);
+}
+
+void test_mobility(unsigned long size, unsigned long block_size)
+{
+    printf("[TEST] Buddy allocator mobility: memory=%lX, block_size=%lu\n", size, block_size);
+    const unsigned long pageblock_kval = 4;
+    memory_region_t arr[32];
+    memory_map_t memory_map = {
+        .array = arr,
+        .capacity = 32,
+        .size = 0
+    };
+    memmap_insert_region(&memory_map, 0, size, M_AVAILABLE);
+    for(int i = 0; i < 6; i++)
+    {
+        memmap_insert_region(&memory_map, rand() % size, rand() % (size / 16), M_UNAVAILABLE);
+    }
+
+    unsigned long types_size = buddy_pageblock_types_size(&memory_map, block_size, pageblock_kval);
+    buddy_descriptor_t heap = {
+        .avail = malloc(sizeof(buddy_block_t) * BUDDY_MOBILITY_TYPES * (BUDDY_MAX_KVAL + 1)),
+        .block_map = malloc(buddy_map_size(&memory_map, block_size)),
+        .block_size = block_size,
+        .mmap = NULL,
+        .offset = 0x10000,
+        .pageblock_types = malloc(types_size),
+        .pageblock_kval = 64
+    };
+    fill_junk(heap.block_map, buddy_map_size(&memory_map, block_size));
+    assert(buddy_alloc_init(&heap, &memory_map));
+    heap.pageblock_kval = pageblock_kval;
+    assert(!buddy_alloc_init(&heap, &memory_map));
+    assert(types_size == 1UL << (heap.max_kval - pageblock_kval));
+    check_orders(&heap);
+    check_types(&heap);
+    assert(buddy_reserve_type(&heap, block_size, BUDDY_MOBILITY_TYPES) == NOMEM);
+    unsigned long initial_count = heap.free_block_count;
+
+    // Per-CPU lists of movable blocks refill from movable pageblocks, which
+    // every pageblock starts out as, so none is claimed for another type
+    buddy_pcp_t lists[1];
+    buddy_pcp_descriptor_t pcp = {
+        .heap = &heap,
+        .lists = lists,
+        .cpu_count = 1,
+        .orders = BUDDY_PCP_ORDERS,
+        .low = 4,
+        .high = 8,
+        .type = BUDDY_MOBILITY_TYPES
+    };
+    assert(buddy_pcp_init(&pcp));
+    pcp.type = BUDDY_MOVABLE;
+    assert(!buddy_pcp_init(&pcp));
+    unsigned long held[64];
+    for(int i = 0; i < 64; i++)
+    {
+        held[i] = buddy_pcp_reserve(&pcp, block_size << (i % 4));
+        assert(held[i] != NOMEM);
+    }
+    assert(heap.claim_count == 0 && heap.fallback_count == 0);
+    for(int i = 0; i < 64; i++)
+    {
+        buddy_pcp_free(&pcp, held[i]);
+    }
+    buddy_pcp_drain(&pcp, 0);
+    assert(heap.free_block_count == initial_count);
+    check_types(&heap);
+    unsigned long initial_order = 8 * sizeof(unsigned long) - 1
+        - __builtin_clzl(heap.avail_mask[BUDDY_MOVABLE]);
+
+    unsigned long total = 1UL << heap.max_kval;
+    unsigned char *unused = malloc(total);
+    memset(unused, 1, total);
+    memblock_t *blocks = malloc(sizeof(memblock_t) * total);
+    unsigned long count = 0;
+    for(int i = 0; i < 4000; i++)
+    {
+        if(count > 0 && rand() % 2)
+        {
+            unsigned long j = rand() % count;
+            unsigned long first = (blocks[j].location - heap.offset) / block_size;
+            assert(buddy_free(&heap, blocks[j].location) == blocks[j].size * block_size);
+            memset(unused + first, 1, blocks[j].size);
+            blocks[j] = blocks[--count];
+        }
+        else
+        {
+            unsigned long k = rand() % 6;
+            unsigned long type = rand() % BUDDY_MOBILITY_TYPES;
+            unsigned long location = i % 7 == 0
+                ? buddy_reserve_in_range(&heap, block_size << k, heap.offset + size / 4,
+                    heap.offset + size / 2)
+                : buddy_reserve_type(&heap, block_size << k, type);
+            if(location == NOMEM)
+            {
+                continue;
+            }
+            unsigned long first = (location - heap.offset) / block_size;
+            assert(first % (1UL << k) == 0 && region_free(unused, first, 1UL << k));
+            memset(unused + first, 0, 1UL << k);
+            blocks[count++] = (memblock_t){.size = 1UL << k, .location = location};
+        }
+        if(i % 64 == 0)
+        {
+            check_orders(&heap);
+            check_types(&heap);
+        }
+    }
+    assert(heap.fallback_count > 0 && heap.claim_count > 0);
+
+    // A snapshot carries the pageblock types along
+    unsigned long length = buddy_snapshot_size(&heap);
+    void *saved = malloc(length);
+    assert(buddy_save_snapshot(&heap, saved, length) == length);
+    buddy_descriptor_t restored = {0};
+    assert(buddy_restore_snapshot(&restored, saved, length) == 0);
+    assert(restored.pageblock_types != NULL && restored.pageblock_kval == pageblock_kval);
+    for(int i = 0; i < 500; i++)
+    {
+        unsigned long region = block_size << (rand() % 4);
+        unsigned long type = rand() % BUDDY_MOBILITY_TYPES;
+        unsigned long location = buddy_reserve_type(&heap, region, type);
+        assert(buddy_reserve_type(&restored, region, type) == location);
+        if(location != NOMEM)
+        {
+            unsigned long first = (location - heap.offset) / block_size;
+            memset(unused + first, 0, region / block_size);
+            blocks[count++] = (memblock_t){.size = region / block_size, .location = location};
+        }
+    }
+    check_types(&restored);
+    free(saved);
+
+    // Once every block is freed, the heap is whole again whatever the types
+    while(count > 0)
+    {
+        count--;
+        buddy_free(&heap, blocks[count].location);
+    }
+    check_orders(&heap);
+    check_types(&heap);
+    assert(heap.free_block_count == initial_count);
+    unsigned long top = 0;
+    for(unsigned long type = 0; type < BUDDY_MOBILITY_TYPES; type++)
+    {
+        top |= heap.avail_mask[type];
+    }
+    assert(8 * sizeof(unsigned long) - 1 - __builtin_clzl(top) == initial_order);
+
+    free(blocks);
+    free(unused);
+    free(heap.pageblock_types);
+    free(heap.block_map);
+    free(heap.avail);
+}
+
 int main(int argc, char **argv)
 {
+    if(argc < 3)
+    {
+        srand(time(0));
+        test_in_range(1 << 16, 16);
+        test_in_range(1 << 20, 64);
+        test_snapshot(1 << 16, 16);
+        test_snapshot(1 << 20, 64);
+        test_orders(1 << 16, 16);
+        test_orders(1 << 20, 64);
+        test_init(1 << 16, 16);
+        test_init(1 << 20, 64);
+        test_pcp(1 << 16, 16);
+        test_pcp(1 << 20, 64);
+        test_mobility(1 << 16, 16);
+        test_mobility(1 << 20, 64);
+        return 0;
+    }
+
     unsigned long mem_size;
     unsigned long block_size;
     sscanf(argv[1], "%lu", &mem_size);